@@ -1,13 +1,15 @@
-#include <deque>
+#include <algorithm>
 #include <map>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <getopt.h>
 #include <math.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <pthread.h>
 
 extern "C" {
 #include "map_align.h"
@@ -259,6 +261,7 @@ struct option longopts[] = {
     { "table", no_argument, 0, 'T' },
     { "shoot", no_argument, 0, 'F' },
     { "foot", no_argument, 0, 'F' },
+    { "jobs", required_argument, 0, 'j' },
 	{ 0,0,0,0 }
 } ;
 
@@ -266,7 +269,7 @@ void usage( const char* pname )
 {
 	fputs( "Usage: ", stdout ) ;
 	fputs( pname, stdout ) ;
-	fputs( " [-r <ref.fa>] [-a] [-t] [-s M-N] [-v] <aln.maln> \n\n"
+	fputs( " [-r <ref.fa>] [-a] [-t] [-s M-N] [-j N] [-v] <aln.maln> \n\n"
 		"Reads a maln file and tries to quantify contained contamination.\n"
 		"Options:\n"
 		"  -r, --reference FILE     FASTA file with the likely contaminant (default: builtin mt311)\n"
@@ -276,6 +279,7 @@ void usage( const char* pname )
 		"  -n, --numpos N           Require N diagnostic sites in a single read (default: 1)\n"
         "  -f, --force              Do not look for a higher numbered .maln\n"
         "  -T, --table              Output as tables (easier for scripts, harder on the eyes)\n"
+        "  -j, --jobs N             Use N threads for files and their reads (output stays the same)\n"
 		"  -v, --verbose            Increase verbosity level (can be repeated)\n"
 		"  -h, --help               Print this help message\n\n", stdout ) ;
 }
@@ -326,7 +330,7 @@ void print_dp_list( FILE* out, dp_list::const_iterator i, dp_list::const_iterato
     if(t) putc( t, out ) ;
 }
 
-void print_results( int *summary, bool mktable )
+void print_results( FILE* out, int *summary, bool mktable )
 {
     double z = 1.96 ; // this is Z_{0.975}, giving a 95% confidence interval (I hope...)
     double k = summary[dirt], n = k + summary[clean] ;
@@ -349,21 +353,709 @@ void print_results( int *summary, bool mktable )
     for( whatsit klass = unknown ; klass != maxwhatsits ; klass = (whatsit)( (int)klass +1 ) )
     {
         if( mktable ) {
-            printf( "%d\t", summary[klass] ) ;
+            fprintf( out, "%d\t", summary[klass] ) ;
         } else {
-            printf( "  %*s fragments: %d", labellen, label[klass], summary[klass] ) ;
+            fprintf( out, "  %*s fragments: %d", labellen, label[klass], summary[klass] ) ;
             if( klass == dirt )
             {
-                if( nn ) printf( " (%.1f .. %.1f .. %.1f%%)", lb, ml, ub ) ;
+                if( nn ) fprintf( out, " (%.1f .. %.1f .. %.1f%%)", lb, ml, ub ) ;
             }
-            putchar( '\n' ) ;
+            putc( '\n', out ) ;
         }
     }
     if( mktable ) {
-        if( nn ) printf( "%.1f\t%.1f\t%.1f\t", lb, ml, ub ) ;
-        else fputs( "N/A\tN/A\tN/A\t", stdout ) ;
+        if( nn ) fprintf( out, "%.1f\t%.1f\t%.1f\t", lb, ml, ub ) ;
+        else fputs( "N/A\tN/A\tN/A\t", out ) ;
     }
-    else putchar( '\n' ) ;
+    else putc( '\n', out ) ;
+}
+
+// Settings that apply to every maln file checked
+struct check_opts {
+    bool adna ;
+    bool mktable ;
+    bool really ;
+    bool hum_ref_ok ;
+    int min_diag_posns ;
+    int verbose ;
+    int maxd ;                  // 0 => a tenth of the longer sequence
+    int span_from, span_to ;
+    int num_threads ;           // threads for the passes over the fragments
+} ;
+
+typedef std::map< std::string, std::pair< whatsit, int > > Bfrags ;
+
+// What pass two found out about one fragment
+struct frag_class {
+    whatsit klass, klass2 ;
+    int votes, votes2 ;
+} ;
+
+// One of the two passes over the fragments of a maln, run on several
+// threads, each claiming FRAG_CHUNK fragments at a time.  Fragments
+// only read the shared state; what they find goes into slots of their
+// own and is combined in fragment order afterwards, so the result is
+// the same on any number of threads.
+struct frag_pass {
+    const check_opts *opts ;
+    MapAlignmentP maln ;
+    dp_list *l ;
+    char *aln_con, *aln_ass ;
+    std::vector< cached_pwaln > *cached_pwalns ;        // one per fragment
+    std::vector< std::map< int, char > > upgrades ;     // pass one, per chunk: weak
+                                                        // positions found contaminated
+                                                        // and the contaminant base
+    std::vector< frag_class > classes ;                 // pass two, one per fragment
+    Bfrags bfrags, bfrags2 ;                            // classes of back halves by id
+    int summary[ maxwhatsits ], summary2[ maxwhatsits ] ;
+    void (*work)( frag_pass*, int ) ;
+    int num_threads ;
+    int num_chunks ;
+    int next_chunk ;
+    pthread_mutex_t lock ;
+} ;
+
+// Pass one for fragment n: align it to the lifted over contaminant and
+// note weakly diagnostic positions where it looks like the contaminant.
+void pass_one_frag( frag_pass *fp, int n )
+{
+    const check_opts& o = *fp->opts ;
+    MapAlignmentP maln = fp->maln ;
+    const dp_list& l = *fp->l ;
+    char *aln_con = fp->aln_con, *aln_ass = fp->aln_ass ;
+    const AlnSeqP *s = maln->AlnSeqArray + n ;
+    PSSMP submat = maln->fpsm ;
+    std::map< int, char >& upgrades = fp->upgrades[ n / FRAG_CHUNK ] ;
+
+    std::string the_ass( maln->ref->seq + (*s)->start, (*s)->end - (*s)->start + 1 ) ;
+    // are we overlapping anything at all?
+    std::pair< dp_list::const_iterator, dp_list::const_iterator > p =
+        overlapped_diagnostic_positions( l, *s ) ;
+
+    if( o.verbose >= 3 )
+    {
+        fprintf( stderr, "%s/%c:\n  %d potentially diagnostic positions",
+                 (*s)->id, (*s)->segment, (int)std::distance( p.first, p.second ) ) ;
+        if( o.verbose >= 4 ) 
+        {
+            putc( ':', stderr ) ; putc( ' ', stderr ) ;
+            print_dp_list( stderr, p.first, p.second, 0 ) ;
+        }
+        fprintf( stderr, "; range:  %d..%d\n", (*s)->start, (*s)->end ) ;
+    }
+
+    // reconstruct read and reference sequences, align them
+    std::string the_read ;
+    for( char *nt = (*s)->seq, **ins = (*s)->ins ; *nt ; ++nt, ++ins )
+    {
+        if( *nt != '-' ) the_read.push_back( *nt ) ;
+        if( *ins ) the_read.append( *ins ) ;
+    }
+    std::string lifted = lift_over( aln_con, aln_ass, (*s)->start, (*s)->end + 2 ) ;
+
+    if( o.verbose >= 5 )
+    {
+        fprintf( stderr, "\nraw read: %s\nlifted:   %s\nassembly: %s\n\n"
+                "aln.read: %s\naln.assm: %s\nmatches:  ",
+                the_read.c_str(), lifted.c_str(), the_ass.c_str(), 
+                (*s)->seq, the_ass.c_str() ) ;
+        std::string::const_iterator b = the_ass.begin(), e = the_ass.end() ;
+        const char* pc = (*s)->seq ;
+        while( b != e && *pc ) putc( *b++ == *pc++ ? '*' : ' ', stderr ) ;
+    }
+
+    int size = std::max( lifted.size(), the_read.size() ) ;
+
+    AlignmentP frag_aln = init_alignment( size, size, 0, 0 ) ;
+
+    std::string ref_for_mia = lifted ;
+    for( size_t i = 0 ; i != ref_for_mia.length() ; ++i )
+    {
+        switch (toupper(ref_for_mia[i]))
+        {
+            case 'A':
+            case 'C':
+            case 'G':
+            case 'T':
+                ref_for_mia[i] = toupper( ref_for_mia[i] ) ;
+                break ;
+            default:
+                ref_for_mia[i] = 'N' ;
+        }
+    }
+    
+    frag_aln->seq1 = ref_for_mia.c_str() ;
+    frag_aln->len1 = ref_for_mia.size() ;
+    frag_aln->seq2 = the_read.c_str() ;
+    frag_aln->len2 = the_read.size() ;
+    frag_aln->sg5 = 1 ;
+    frag_aln->sg3 = 1 ;
+    frag_aln->submat = submat ;
+    pop_s1c_in_a( frag_aln ) ;
+    pop_s2c_in_a( frag_aln ) ;
+    dyn_prog( frag_aln ) ;
+
+    pw_aln_frag pwaln ;
+    max_sg_score( frag_aln ) ;			// ARGH!  This has a vital side-effect!!!
+    find_align_begin( frag_aln ) ;  	//        And so has this...
+    populate_pwaln_to_begin( frag_aln, &pwaln ) ;
+    pwaln.start = frag_aln->abc;
+
+    char *paln1 = aln_con, *paln2 = aln_ass ;
+    int ass_pos = 0 ;
+    while( ass_pos != (*s)->start && *paln1 && *paln2 ) 
+    {
+        if( *paln2 != '-' ) ass_pos++ ;
+        ++paln1 ;
+        ++paln2 ;
+    }
+
+    if( o.verbose >= 5 )
+    {
+        fprintf( stderr, "\n\naln.read: %s\naln.ref:  %s\nmatches:  ",
+                 pwaln.frag_seq, pwaln.ref_seq ) ;
+
+        const char* b = pwaln.ref_seq ;
+        const char* pc = pwaln.frag_seq ;
+        while( *b && *pc ) putc( *b++ == *pc++ ? '*' : ' ', stderr ) ;
+        putc( '\n', stderr ) ;
+        putc( '\n', stderr ) ;
+    }
+
+    cached_pwaln& cached = (*fp->cached_pwalns)[n] ;
+    cached.start = pwaln.start ;
+    cached.ref_seq = pwaln.ref_seq ;
+    cached.frag_seq = pwaln.frag_seq ;
+
+    std::string in_ref = lifted.substr( 0, pwaln.start ) ;
+    in_ref.append( pwaln.ref_seq ) ;
+
+    char *in_frag_v_ref = pwaln.frag_seq ;
+    char *in_ass = maln->ref->seq + (*s)->start ;
+    char *in_frag_v_ass = (*s)->seq ;
+
+    if( o.verbose ) {
+        if(*paln1!=in_ref[0]||*paln1=='-') fprintf( stderr, "huh? (R+%d) %.10s %.10s\n", pwaln.start, paln1, in_ref.c_str() ) ;
+        if(*paln2!=in_ass[0]&&*paln2!='-') fprintf( stderr, "huh? (A+%d) %.10s %.10s\n", pwaln.start, paln2, in_ass ) ;
+    }
+
+    // iterate over alignment.  if we see something diagnosable
+    // as contaminant, we mark that position as strong.
+    while( ass_pos != (*s)->end +1 && *paln1 && *paln2 && !in_ref.empty() && *in_ass && *in_frag_v_ass && *in_frag_v_ref )
+    {
+        if( is_weakly_diagnostic( *paln1, *paln2 ) ) {
+            dp_list::const_iterator iter = l.find( ass_pos ) ;
+            if( iter == l.end() ) {
+                fprintf( stderr, "diagnostic site not found: %d\n", ass_pos ) ;
+            } else {
+                if( o.verbose >= 4 )
+                    fprintf( stderr, "diagnostic pos.: %d %c(%c)/%c %c/%c",
+                            ass_pos, iter->second.consensus, in_ref[0], *in_frag_v_ref, *in_ass, *in_frag_v_ass ) ;
+                if( *in_frag_v_ref != *in_frag_v_ass ) 
+                {
+                    if( o.verbose >= 4 ) fputs( " in disagreement.", stderr ) ;
+                } else {
+                    bool maybe_clean = consistent( o.adna, iter->second.assembly, *in_frag_v_ass ) ;
+                    bool maybe_dirt =  consistent( o.adna, iter->second.consensus,  *in_frag_v_ref ) ;
+
+                    if( !maybe_clean && maybe_dirt && iter->second.strength == weak
+                            && upgrades.find( ass_pos ) == upgrades.end() ) {
+                        if( o.verbose >= 4 )
+                            fputs( " possible contaminant, upgraded to `effective'.", stderr ) ;
+                        upgrades[ ass_pos ] = *in_frag_v_ref ;
+                    }
+                }
+            }
+            if( o.verbose >= 4 ) putc( '\n', stderr ) ;
+        }
+
+        if( *paln1 != '-' ) {
+            do {
+                in_ref=in_ref.substr(1) ;
+                in_frag_v_ref++ ;
+            } while( in_ref[0] == '-' ) ;
+        }
+        if( *paln2 != '-' ) {
+            ass_pos++ ;
+            do {
+                in_ass++ ;
+                in_frag_v_ass++ ;
+            } while( *in_ass == '-' ) ;
+        }
+        ++paln1 ;
+        ++paln2 ;
+    }
+    if( o.verbose >= 4 ) fprintf( stderr, "\n" ) ;
+
+    free_alignment( frag_aln ) ;
+}
+
+// Pass two for fragment n: classify it by its (strongly or actually)
+// diagnostic positions.
+void pass_two_frag( frag_pass *fp, int n )
+{
+    const check_opts& o = *fp->opts ;
+    MapAlignmentP maln = fp->maln ;
+    const dp_list& l = *fp->l ;
+    char *aln_con = fp->aln_con, *aln_ass = fp->aln_ass ;
+    const AlnSeqP *s = maln->AlnSeqArray + n ;
+    const cached_pwaln *cpwaln = &(*fp->cached_pwalns)[n] ;
+
+    whatsit klass = unknown ;
+    whatsit klass2 = unknown ;
+    int votes = 0, votes2 = 0 ;
+
+    std::string the_ass( maln->ref->seq + (*s)->start, (*s)->end - (*s)->start + 1 ) ;
+    // enough overlap?  (we only have _actually_ diagnostic positions now)
+    std::pair< dp_list::const_iterator, dp_list::const_iterator > p =
+        overlapped_diagnostic_positions( l, *s ) ;
+    if( std::distance( p.first, p.second ) < o.min_diag_posns )
+    {
+        if( o.verbose >= 3 ) {
+            fputs( (*s)->id, stderr ) ;
+            putc( '/', stderr ) ;
+            putc( (*s)->segment, stderr ) ;
+            fputs( ": no diagnostic positions\n", stderr ) ;
+        }
+    }
+    else
+    {
+        if( o.verbose >= 3 )
+        {
+            fprintf( stderr, "%s/%c: %d diagnostic positions", (*s)->id, (*s)->segment, (int)std::distance( p.first, p.second ) ) ;
+            if( o.verbose >= 4 ) 
+            {
+                putc( ':', stderr ) ; putc( ' ', stderr ) ;
+                print_dp_list( stderr, p.first, p.second, 0 ) ;
+            }
+            fprintf( stderr, "; range:  %d..%d\n", (*s)->start, (*s)->end ) ;
+        }
+
+        // Hmm, all this iterator business is somewhat lacking...
+        char *paln1 = aln_con, *paln2 = aln_ass ;
+        int ass_pos = 0 ;
+        while( ass_pos != (*s)->start && *paln1 && *paln2 ) 
+        {
+            if( *paln2 != '-' ) ass_pos++ ;
+            ++paln1 ;
+            ++paln2 ;
+        }
+
+        char *in_ass = maln->ref->seq + (*s)->start ;
+        char *in_frag_v_ass = (*s)->seq ;
+        std::string::const_iterator in_frag_v_ref = cpwaln->frag_seq.begin() ;
+
+        std::string lifted = lift_over( aln_con, aln_ass, (*s)->start, (*s)->end + 1 ) ;
+        std::string in_ref = lifted.substr( 0, cpwaln->start ) ;
+        in_ref.append( cpwaln->ref_seq ) ;
+
+        while( ass_pos != (*s)->end +1 && *paln1 && *paln2 && !in_ref.empty() && *in_ass && *in_frag_v_ass && *in_frag_v_ref )
+        {
+            if( is_weakly_diagnostic( *paln1, *paln2 ) ) {
+                dp_list::const_iterator iter = l.find( ass_pos ) ;
+                if( iter != l.end() ) {
+                    if( o.verbose >= 4 )
+                        fprintf( stderr, "diagnostic pos. %s: %d %c(%c)/%c %c/%c",
+                                iter->second.strength == strong ? "(strong)" : "  (weak)",
+                                ass_pos, iter->second.consensus, in_ref[0], *in_frag_v_ref, *in_ass, *in_frag_v_ass ) ;
+                    if( *in_frag_v_ref != *in_frag_v_ass ) 
+                    {
+                        if( o.verbose >= 4 ) fputs( " in disagreement.\n", stderr ) ;
+                    }
+                    else
+                    {
+                        bool maybe_clean = consistent( o.adna, iter->second.assembly, *in_frag_v_ass ) ;
+                        bool maybe_dirt  = consistent( o.adna, iter->second.consensus,  *in_frag_v_ref ) ;
+
+                        if( o.verbose >= 4 )
+                        {
+                            fputs( maybe_dirt  ? " " : " in", stderr ) ;
+                            fputs( "consistent/", stderr ) ;
+                            fputs( maybe_clean ? "" : "in", stderr ) ;
+                            fputs( "consistent\n", stderr ) ; 
+                        }
+
+                        update_class( klass2, votes2, maybe_clean, maybe_dirt && !maybe_clean ) ;
+                        if( iter->second.strength == strong ) 
+                            update_class( klass, votes, maybe_clean, maybe_dirt ) ;
+                    }
+                }
+            }
+
+            if( *paln1 != '-' ) {
+                do {
+                    in_ref=in_ref.substr(1) ;
+                    in_frag_v_ref++ ;
+                } while( in_ref[0] == '-' ) ;
+            }
+            if( *paln2 != '-' ) {
+                ass_pos++ ;
+                do {
+                    in_ass++ ;
+                    in_frag_v_ass++ ;
+                } while( *in_ass == '-' ) ;
+            }
+            ++paln1 ;
+            ++paln2 ;
+        }
+        if( o.verbose >= 4 ) putc( '\n', stderr ) ;
+    }
+
+    fp->classes[n].klass = klass ;
+    fp->classes[n].votes = votes ;
+    fp->classes[n].klass2 = klass2 ;
+    fp->classes[n].votes2 = votes2 ;
+}
+
+// Makes the weak positions chunk c found contaminated effective, unless
+// an earlier chunk did already.  Applied in chunk order, the first
+// fragment (in maln order) to show a contaminant at a weak position
+// decides the contaminant base, just as if the fragments had been
+// aligned one after the other.
+void apply_upgrades( frag_pass *fp, int c )
+{
+    for( std::map< int, char >::const_iterator u = fp->upgrades[c].begin() ; u != fp->upgrades[c].end() ; ++u )
+    {
+        Dp& dp = (*fp->l)[ u->first ] ;
+        if( dp.strength == weak ) {
+            dp.contaminant = u->second ;
+            dp.strength = effective ;
+        }
+    }
+}
+
+// Joins fragment n with its other half and counts it.  Whether a front
+// half finds its back half depends on the order of the fragments, so
+// this runs in maln order.
+void join_frag( frag_pass *fp, int n )
+{
+    const check_opts& o = *fp->opts ;
+    const AlnSeqP *s = fp->maln->AlnSeqArray + n ;
+    whatsit klass = fp->classes[n].klass ;
+    whatsit klass2 = fp->classes[n].klass2 ;
+    int votes = fp->classes[n].votes, votes2 = fp->classes[n].votes2 ;
+    Bfrags::const_iterator i = fp->bfrags.find( (*s)->id ) ;
+    Bfrags::const_iterator i2 = fp->bfrags2.find( (*s)->id ) ;
+
+    switch( (*s)->segment )
+    {
+        case 'b':
+            fp->bfrags[ (*s)->id ] = std::make_pair( klass, votes ) ;
+            fp->bfrags2[ (*s)->id ] = std::make_pair( klass2, votes2 ) ;
+            if( o.verbose >= 3 ) putc( '\n', stderr ) ;
+            break ;
+
+        case 'f':
+            if( i == fp->bfrags.end() ) 
+            {
+                fputs( (*s)->id, stderr ) ;
+                fputs( "/f is missing its back.\n", stderr ) ;
+            }
+            else
+            {
+                votes += i->second.second ;
+                klass = merge_whatsit( klass, i->second.first ) ;
+            }
+
+            if( i2 == fp->bfrags2.end() ) 
+            {
+                fputs( (*s)->id, stderr ) ;
+                fputs( "/f is missing its back.\n", stderr ) ;
+            }
+            else
+            {
+                votes2 += i->second.second ;
+                klass2 = merge_whatsit( klass2, i->second.first ) ;
+            }
+
+        case 'a':
+            if( o.verbose >= 2 ) fprintf( stderr, "%s is %s (%d votes)\n", (*s)->id, label[klass], votes ) ;
+            if( o.verbose >= 2 ) fprintf( stderr, "%s is %s (%d votes)\n", (*s)->id, label[klass2], votes2 ) ;
+            if( o.verbose >= 3 ) putc( '\n', stderr ) ;
+            fp->summary[klass]++ ;
+            fp->summary2[klass2]++ ;
+            break ;
+
+        default:
+            fputs( "don't know how to handle fragment type ", stderr ) ;
+            putc( (*s)->segment, stderr ) ;
+            putc( '\n', stderr ) ;
+    }
+}
+
+void* frag_pass_worker( void* arg )
+{
+    frag_pass *fp = (frag_pass*)arg ;
+    for(;;)
+    {
+        pthread_mutex_lock( &fp->lock ) ;
+        int c = fp->next_chunk++ ;
+        pthread_mutex_unlock( &fp->lock ) ;
+        if( c >= fp->num_chunks ) return 0 ;
+
+        int end = std::min( (c+1) * FRAG_CHUNK, fp->maln->num_aln_seqs ) ;
+        for( int n = c * FRAG_CHUNK ; n != end ; ++n ) {
+            fp->work( fp, n ) ;
+            // alone, we can show later fragments what earlier ones found
+            if( fp->num_threads == 1 && fp->work == pass_one_frag ) apply_upgrades( fp, c ) ;
+            if( fp->num_threads == 1 && fp->work == pass_two_frag ) join_frag( fp, n ) ;
+        }
+    }
+}
+
+// Runs work on every fragment, on fp->num_threads threads (one of them
+// this one).
+void run_frag_pass( frag_pass *fp, void (*work)( frag_pass*, int ) )
+{
+    fp->work = work ;
+    fp->next_chunk = 0 ;
+    int num_threads = fp->num_threads ;
+    if( num_threads > fp->num_chunks ) num_threads = fp->num_chunks ;
+    std::vector< pthread_t > threads( num_threads > 1 ? num_threads : 1 ) ;
+    for( int t = 1 ; t < num_threads ; ++t )
+        if( pthread_create( &threads[t], 0, frag_pass_worker, fp ) ) {
+            fprintf( stderr, "Could not start worker thread %d\n", t ) ;
+            exit( 1 ) ;
+        }
+    frag_pass_worker( fp ) ;
+    for( int t = 1 ; t < num_threads ; ++t )
+        pthread_join( threads[t], 0 ) ;
+}
+
+// Checks one maln file and writes its report (one table row if
+// o.mktable) to out.  Returns 0, or 1 if the file could not be checked,
+// in which case the report is incomplete.
+int check_maln( const check_opts& o, const std::string& infile, FILE* out )
+{
+
+    if( o.mktable ) {
+        fputs( infile.c_str(), out ) ;
+        putc( '\t', out ) ;
+    }
+    else {
+        fputs( infile.c_str(), out ) ;
+        putc( '\n', out ) ;
+        putc( '\n', out ) ;
+    }
+    MapAlignmentP maln = read_ma( infile.c_str() ) ;
+
+    bool maln_ref_ok = sanity_check_sequence( maln->ref->seq ) ;
+    if( !maln_ref_ok ) fputs( "FUBAR'ed maln file: consensus sequence contains gap symbols.\n", stderr ) ;
+    if( !o.hum_ref_ok || !maln_ref_ok ) {
+        fputs( "Problem might exist between keyboard and chair.  I give up.\n", stderr ) ;
+        return 1 ;
+    }
+
+    int maxd = o.maxd ? o.maxd : max( strlen(hum_ref.seq), strlen(maln->ref->seq) ) / 10 ;
+    char *aln_con = (char*)malloc( strlen(hum_ref.seq) + maxd + 2 ) ;
+    char *aln_ass = (char*)malloc( strlen(maln->ref->seq) + maxd + 2 ) ;
+    unsigned d = myers_diff( hum_ref.seq, myers_align_globally, maln->ref->seq, maxd, aln_con, aln_ass ) ;
+
+    if( d == UINT_MAX ) {
+        fprintf( stderr, "\n *** Could not align references with up to %d mismatches.\n"
+                         " *** This is usually a sign of trouble, but\n"
+                         " *** IF AND ONLY IF YOU KNOW WHAT YOU ARE DOING, you can\n"
+                         " *** try the -d N option with N > %d.\n\n", maxd, maxd ) ;
+        return 1 ;
+    }
+    if( o.mktable ) fprintf( out, "%d\t", d ) ;
+    else fprintf( out, "  %d alignment distance between reference and assembly.\n", d ) ;
+
+    if( o.verbose >= 6 ) print_aln( aln_con, aln_ass ) ;
+
+    dp_list l = mk_dp_list( aln_con, aln_ass, o.span_from, o.span_to ) ;
+    if( o.mktable ) fprintf( out, "%u\t", (unsigned)l.size() ) ;
+    else fprintf( out, "  %u total differences between reference and assembly.\n", (unsigned)l.size() ) ;
+
+    int num_strong = 0 ;
+    for( dp_list::const_iterator i = l.begin() ; i != l.end() ; ++i )
+        if( i->second.strength > weak ) ++num_strong ;
+    if( o.mktable ) fprintf( out, "%d\t", (int)l.size() ) ; 
+    else {
+        fprintf( out, "  %d diagnostic positions", (int)l.size() ) ;
+        if( o.span_from != 0 || o.span_to != INT_MAX )
+            fprintf( out, " in range [%d,%d)", o.span_from, o.span_to ) ;
+        fprintf( out, ", %d of which are strongly diagnostic.\n", num_strong ) ;
+    }
+
+    if( o.verbose >= 3 ) {
+        print_dp_list( stderr, l.begin(), l.end(), '\n', 0 ) ;
+        print_dp_list( stderr, l.begin(), l.end(), '\n', 1 ) ;
+    }
+
+    if( num_strong < 40 && !o.really ) {
+        fprintf( stderr, "\n *** Low number (%d) of diagnostic positions found.\n"
+                         " *** I will stop now for your own safety.\n"
+                         " *** If you are sure you want to shoot yourself\n"
+                         " *** in the foot, read the man page to learn\n"
+                         " *** how to lift this restriction.\n\n", num_strong ) ;
+        return 1 ;
+    }
+
+    std::vector< cached_pwaln > cached_pwalns( maln->num_aln_seqs ) ;
+
+    frag_pass fp ;
+    fp.opts = &o ;
+    fp.maln = maln ;
+    fp.l = &l ;
+    fp.aln_con = aln_con ;
+    fp.aln_ass = aln_ass ;
+    fp.cached_pwalns = &cached_pwalns ;
+    fp.num_chunks = (maln->num_aln_seqs + FRAG_CHUNK - 1) / FRAG_CHUNK ;
+    fp.upgrades.resize( fp.num_chunks ) ;
+    fp.classes.resize( maln->num_aln_seqs ) ;
+    std::fill( fp.summary, fp.summary + maxwhatsits, 0 ) ;
+    std::fill( fp.summary2, fp.summary2 + maxwhatsits, 0 ) ;
+    pthread_mutex_init( &fp.lock, 0 ) ;
+    // debug output of the fragments comes in maln order on one thread only
+    fp.num_threads = o.verbose ? 1 : o.num_threads ;
+
+    if( o.verbose >= 2 ) fputs( "Pass one: finding actually diagnostic positions.\n", stderr ) ;
+    for( const AlnSeqP *s = maln->AlnSeqArray ; s != maln->AlnSeqArray + maln->num_aln_seqs ; ++s )
+        fixup_name( *s ) ;
+    run_frag_pass( &fp, pass_one_frag ) ;
+
+    for( int c = 0 ; c != fp.num_chunks ; ++c ) apply_upgrades( &fp, c ) ;
+
+    for( dp_list::iterator i = l.begin(), j = l.end() ; i != j ; )
+    {
+        dp_list::iterator k = i ;
+        k++ ;
+        if( i->second.strength == weak ) l.erase( i ) ;
+        i=k ;
+    }
+    {
+        int t = 0 ;
+        for( dp_list::const_iterator i = l.begin() ; i != l.end() ; ++i )
+            if( is_transversion( i->second.consensus, i->second.assembly ) ) ++t ;
+        if( o.mktable ) fprintf( out, "%d\t%d\t", t, num_strong ) ; 
+        else {
+            fprintf( out, "  %d effectively diagnostic positions", (int)l.size() ) ;
+            if( o.span_from != 0 || o.span_to != INT_MAX )
+                fprintf( out, " in range [%d,%d)", o.span_from, o.span_to ) ;
+            fprintf( out, ", %d of which are transversions.\n\n", t ) ;
+        }
+    }
+    if( o.verbose >= 3 ) print_dp_list( stderr, l.begin(), l.end(), '\n' ) ;
+
+    if( o.verbose >= 2 ) fputs( "Pass two: classifying fragments.\n", stderr ) ;
+    run_frag_pass( &fp, pass_two_frag ) ;
+    pthread_mutex_destroy( &fp.lock ) ;
+
+    if( fp.num_threads != 1 )
+        for( int n = 0 ; n != maln->num_aln_seqs ; ++n ) join_frag( &fp, n ) ;
+
+    if( !o.mktable ) {
+        int t = 0 ;
+        for( dp_list::const_iterator i = l.begin(), e = l.end() ; i != e ; ++i )
+            if( i->second.strength == strong ) t++ ;
+        fprintf( out, "  strongly diagnostic positions: %d\n", t ) ;
+    }
+    print_results( out, fp.summary, o.mktable ) ;
+    if( !o.mktable ) fprintf( out, "  effectively diagnostic positions: %d\n", (int)l.size() ) ;
+    else fprintf( out, "%d\t", (int)l.size() ) ; 
+
+    print_results( out, fp.summary2, o.mktable ) ;
+    putc( '\n', out ) ;
+
+    free_map_alignment( maln ) ;
+    free( aln_con ) ;
+    free( aln_ass ) ;
+    return 0 ;
+}
+
+// One maln file of a parallel run and its report, kept until all
+// files before it have been printed.
+struct check_job {
+    std::string infile ;
+    char *report ;
+    size_t report_size ;
+    int status ;
+    bool done ;
+} ;
+
+struct check_queue {
+    const check_opts *opts ;
+    std::vector< check_job > jobs ;
+    size_t next ;               // next job for a worker to claim
+    bool stop ;                 // a job failed, claim no more
+    pthread_mutex_t lock ;
+    pthread_cond_t finished ;   // signalled whenever a job is done
+} ;
+
+// Claims files one at a time and checks each into a memory buffer.
+void* check_worker( void* arg )
+{
+    check_queue *q = (check_queue*)arg ;
+    for(;;)
+    {
+        pthread_mutex_lock( &q->lock ) ;
+        if( q->stop || q->next == q->jobs.size() ) {
+            pthread_mutex_unlock( &q->lock ) ;
+            return 0 ;
+        }
+        check_job& j = q->jobs[ q->next++ ] ;
+        pthread_mutex_unlock( &q->lock ) ;
+
+        FILE* out = open_memstream( &j.report, &j.report_size ) ;
+        int status = check_maln( *q->opts, j.infile, out ) ;
+        fclose( out ) ;
+
+        pthread_mutex_lock( &q->lock ) ;
+        j.status = status ;
+        j.done = true ;
+        pthread_cond_broadcast( &q->finished ) ;
+        pthread_mutex_unlock( &q->lock ) ;
+    }
+}
+
+// Checks the files on num_jobs threads and prints their reports in the
+// order given, stopping after the first file that fails.
+int check_in_parallel( const check_opts& o, const std::vector< std::string >& infiles, int num_jobs )
+{
+    check_queue q ;
+    q.opts = &o ;
+    q.jobs.resize( infiles.size() ) ;
+    for( size_t i = 0 ; i != infiles.size() ; ++i ) {
+        q.jobs[i].infile = infiles[i] ;
+        q.jobs[i].report = 0 ;
+        q.jobs[i].report_size = 0 ;
+        q.jobs[i].status = 0 ;
+        q.jobs[i].done = false ;
+    }
+    q.next = 0 ;
+    q.stop = false ;
+    pthread_mutex_init( &q.lock, 0 ) ;
+    pthread_cond_init( &q.finished, 0 ) ;
+
+    if( (size_t)num_jobs > infiles.size() ) num_jobs = infiles.size() ;
+    std::vector< pthread_t > threads( num_jobs ) ;
+    for( int t = 0 ; t != num_jobs ; ++t )
+        if( pthread_create( &threads[t], 0, check_worker, &q ) ) {
+            fprintf( stderr, "Could not start worker thread %d\n", t ) ;
+            exit( 1 ) ;
+        }
+
+    int status = 0 ;
+    for( size_t i = 0 ; i != q.jobs.size() && !status ; ++i )
+    {
+        pthread_mutex_lock( &q.lock ) ;
+        while( !q.jobs[i].done ) pthread_cond_wait( &q.finished, &q.lock ) ;
+        status = q.jobs[i].status ;
+        if( status ) q.stop = true ;
+        pthread_mutex_unlock( &q.lock ) ;
+
+        fwrite( q.jobs[i].report, 1, q.jobs[i].report_size, stdout ) ;
+        fflush( stdout ) ;
+    }
+
+    for( int t = 0 ; t != num_jobs ; ++t )
+        pthread_join( threads[t], 0 ) ;
+    for( size_t i = 0 ; i != q.jobs.size() ; ++i )
+        free( q.jobs[i].report ) ;
+    pthread_mutex_destroy( &q.lock ) ;
+    pthread_cond_destroy( &q.finished ) ;
+    return status ;
 }
 
 int main( int argc, char * const argv[] )
@@ -377,12 +1069,13 @@ int main( int argc, char * const argv[] )
 	int verbose = 0 ;
 	int maxd = 0 ;
 	int span_from = 0, span_to = INT_MAX ;
+    int num_jobs = 1 ;
 
 	if( argc == 0 ) { usage( argv[0] ) ; return 0 ; }
 
 	int opt ;
 	do {
-		opt = getopt_long( argc, argv, "r:avhts:d:n:MfTF", longopts, 0 ) ;
+		opt = getopt_long( argc, argv, "r:avhts:d:n:MfTFj:", longopts, 0 ) ;
 		switch( opt ) 
 		{
 			case 'r': 
@@ -427,6 +1120,10 @@ int main( int argc, char * const argv[] )
             case 'F':
                 really = true;
                 break ;
+            case 'j':
+                num_jobs = atoi( optarg ) ;
+                if( num_jobs < 1 ) num_jobs = 1 ;
+                break ;
 		}
 	} while( opt != -1 ) ;
 
@@ -450,439 +1147,28 @@ int main( int argc, char * const argv[] )
         putchar( '\n' ) ;
     }
 
+    check_opts o ;
+    o.adna = adna ;
+    o.mktable = mktable ;
+    o.really = really ;
+    o.hum_ref_ok = hum_ref_ok ;
+    o.min_diag_posns = min_diag_posns ;
+    o.verbose = verbose ;
+    o.maxd = maxd ;
+    o.span_from = span_from ;
+    o.span_to = span_to ;
+
+    std::vector< std::string > infiles ;
     for( ; optind != argc ; ++optind )
-    {
-        int summary[ maxwhatsits ] = {0} ;
-        int summary2[ maxwhatsits ] = {0} ;
-
-        std::string infile( be_clever ? find_maln( argv[optind] ) : argv[optind] ) ;
-        if( mktable ) {
-            fputs( infile.c_str(), stdout ) ;
-            putchar( '\t' ) ;
-        }
-        else {
-            puts( infile.c_str() ) ;
-            putchar( '\n' ) ;
-        }
-        MapAlignmentP maln = read_ma( infile.c_str() ) ;
-        PSSMP submat = maln->fpsm ;
-
-        bool maln_ref_ok = sanity_check_sequence( maln->ref->seq ) ;
-        if( !maln_ref_ok ) fputs( "FUBAR'ed maln file: consensus sequence contains gap symbols.\n", stderr ) ;
-        if( !hum_ref_ok || !maln_ref_ok ) {
-            fputs( "Problem might exist between keyboard and chair.  I give up.\n", stderr ) ;
-            return 1 ;
-        }
-
-        if( !maxd ) maxd = max( strlen(hum_ref.seq), strlen(maln->ref->seq) ) / 10 ;
-        char *aln_con = (char*)malloc( strlen(hum_ref.seq) + maxd + 2 ) ;
-        char *aln_ass = (char*)malloc( strlen(maln->ref->seq) + maxd + 2 ) ;
-        unsigned d = myers_diff( hum_ref.seq, myers_align_globally, maln->ref->seq, maxd, aln_con, aln_ass ) ;
-
-        if( d == UINT_MAX ) {
-            fprintf( stderr, "\n *** Could not align references with up to %d mismatches.\n"
-                             " *** This is usually a sign of trouble, but\n"
-                             " *** IF AND ONLY IF YOU KNOW WHAT YOU ARE DOING, you can\n"
-                             " *** try the -d N option with N > %d.\n\n", maxd, maxd ) ;
-            return 1 ;
-        }
-        if( mktable ) printf( "%d\t", d ) ;
-        else printf( "  %d alignment distance between reference and assembly.\n", d ) ;
-
-        if( verbose >= 6 ) print_aln( aln_con, aln_ass ) ;
-
-        dp_list l = mk_dp_list( aln_con, aln_ass, span_from, span_to ) ;
-        if( mktable ) printf( "%u\t", (unsigned)l.size() ) ;
-        else printf( "  %u total differences between reference and assembly.\n", (unsigned)l.size() ) ;
-
-        int num_strong = 0 ;
-        for( dp_list::const_iterator i = l.begin() ; i != l.end() ; ++i )
-            if( i->second.strength > weak ) ++num_strong ;
-        if( mktable ) printf( "%d\t", (int)l.size() ) ; 
-        else {
-            printf( "  %d diagnostic positions", (int)l.size() ) ;
-            if( span_from != 0 || span_to != INT_MAX )
-                printf( " in range [%d,%d)", span_from, span_to ) ;
-            printf( ", %d of which are strongly diagnostic.\n", num_strong ) ;
-        }
-
-        if( verbose >= 3 ) {
-            print_dp_list( stderr, l.begin(), l.end(), '\n', 0 ) ;
-            print_dp_list( stderr, l.begin(), l.end(), '\n', 1 ) ;
-        }
-
-        if( num_strong < 40 && !really ) {
-            fprintf( stderr, "\n *** Low number (%d) of diagnostic positions found.\n"
-                             " *** I will stop now for your own safety.\n"
-                             " *** If you are sure you want to shoot yourself\n"
-                             " *** in the foot, read the man page to learn\n"
-                             " *** how to lift this restriction.\n\n", num_strong ) ;
-            return 1 ;
-        }
-
-        typedef std::map< std::string, std::pair< whatsit, int > > Bfrags ;
-        Bfrags bfrags, bfrags2 ;
-        std::deque< cached_pwaln > cached_pwalns ;
-
-        if( verbose >= 2 ) fputs( "Pass one: finding actually diagnostic positions.\n", stderr ) ;
-        for( const AlnSeqP *s = maln->AlnSeqArray ; s != maln->AlnSeqArray + maln->num_aln_seqs ; ++s )
-        {
-            fixup_name( *s ) ;
-
-            std::string the_ass( maln->ref->seq + (*s)->start, (*s)->end - (*s)->start + 1 ) ;
-            // are we overlapping anything at all?
-            std::pair< dp_list::const_iterator, dp_list::const_iterator > p =
-                overlapped_diagnostic_positions( l, *s ) ;
-
-            if( verbose >= 3 )
-            {
-                fprintf( stderr, "%s/%c:\n  %d potentially diagnostic positions",
-                         (*s)->id, (*s)->segment, (int)std::distance( p.first, p.second ) ) ;
-                if( verbose >= 4 ) 
-                {
-                    putc( ':', stderr ) ; putc( ' ', stderr ) ;
-                    print_dp_list( stderr, p.first, p.second, 0 ) ;
-                }
-                fprintf( stderr, "; range:  %d..%d\n", (*s)->start, (*s)->end ) ;
-            }
-
-            // reconstruct read and reference sequences, align them
-            std::string the_read ;
-            for( char *nt = (*s)->seq, **ins = (*s)->ins ; *nt ; ++nt, ++ins )
-            {
-                if( *nt != '-' ) the_read.push_back( *nt ) ;
-                if( *ins ) the_read.append( *ins ) ;
-            }
-            std::string lifted = lift_over( aln_con, aln_ass, (*s)->start, (*s)->end + 2 ) ;
-
-            if( verbose >= 5 )
-            {
-                fprintf( stderr, "\nraw read: %s\nlifted:   %s\nassembly: %s\n\n"
-                        "aln.read: %s\naln.assm: %s\nmatches:  ",
-                        the_read.c_str(), lifted.c_str(), the_ass.c_str(), 
-                        (*s)->seq, the_ass.c_str() ) ;
-                std::string::const_iterator b = the_ass.begin(), e = the_ass.end() ;
-                const char* pc = (*s)->seq ;
-                while( b != e && *pc ) putc( *b++ == *pc++ ? '*' : ' ', stderr ) ;
-            }
-
-            int size = std::max( lifted.size(), the_read.size() ) ;
-
-            AlignmentP frag_aln = init_alignment( size, size, 0, 0 ) ;
-
-            std::string ref_for_mia = lifted ;
-            for( size_t i = 0 ; i != ref_for_mia.length() ; ++i )
-            {
-                switch (toupper(ref_for_mia[i]))
-                {
-                    case 'A':
-                    case 'C':
-                    case 'G':
-                    case 'T':
-                        ref_for_mia[i] = toupper( ref_for_mia[i] ) ;
-                        break ;
-                    default:
-                        ref_for_mia[i] = 'N' ;
-                }
-            }
-        
-            frag_aln->seq1 = ref_for_mia.c_str() ;
-            frag_aln->len1 = ref_for_mia.size() ;
-            frag_aln->seq2 = the_read.c_str() ;
-            frag_aln->len2 = the_read.size() ;
-            frag_aln->sg5 = 1 ;
-            frag_aln->sg3 = 1 ;
-            frag_aln->submat = submat ;
-            pop_s1c_in_a( frag_aln ) ;
-            pop_s2c_in_a( frag_aln ) ;
-            dyn_prog( frag_aln ) ;
-
-            pw_aln_frag pwaln ;
-            max_sg_score( frag_aln ) ;			// ARGH!  This has a vital side-effect!!!
-            find_align_begin( frag_aln ) ;  	//        And so has this...
-            populate_pwaln_to_begin( frag_aln, &pwaln ) ;
-            pwaln.start = frag_aln->abc;
-
-            char *paln1 = aln_con, *paln2 = aln_ass ;
-            int ass_pos = 0 ;
-            while( ass_pos != (*s)->start && *paln1 && *paln2 ) 
-            {
-                if( *paln2 != '-' ) ass_pos++ ;
-                ++paln1 ;
-                ++paln2 ;
-            }
-
-            if( verbose >= 5 )
-            {
-                fprintf( stderr, "\n\naln.read: %s\naln.ref:  %s\nmatches:  ",
-                         pwaln.frag_seq, pwaln.ref_seq ) ;
-
-                const char* b = pwaln.ref_seq ;
-                const char* pc = pwaln.frag_seq ;
-                while( *b && *pc ) putc( *b++ == *pc++ ? '*' : ' ', stderr ) ;
-                putc( '\n', stderr ) ;
-                putc( '\n', stderr ) ;
-            }
-
-            cached_pwalns.push_back( cached_pwaln() ) ;
-            cached_pwalns.back().start = pwaln.start ;
-            cached_pwalns.back().ref_seq = pwaln.ref_seq ;
-            cached_pwalns.back().frag_seq = pwaln.frag_seq ;
-
-            std::string in_ref = lifted.substr( 0, pwaln.start ) ;
-            in_ref.append( pwaln.ref_seq ) ;
-
-            char *in_frag_v_ref = pwaln.frag_seq ;
-            char *in_ass = maln->ref->seq + (*s)->start ;
-            char *in_frag_v_ass = (*s)->seq ;
-
-            if( verbose ) {
-                if(*paln1!=in_ref[0]||*paln1=='-') fprintf( stderr, "huh? (R+%d) %.10s %.10s\n", pwaln.start, paln1, in_ref.c_str() ) ;
-                if(*paln2!=in_ass[0]&&*paln2!='-') fprintf( stderr, "huh? (A+%d) %.10s %.10s\n", pwaln.start, paln2, in_ass ) ;
-            }
-
-            // iterate over alignment.  if we see something diagnosable
-            // as contaminant, we mark that position as strong.
-            while( ass_pos != (*s)->end +1 && *paln1 && *paln2 && !in_ref.empty() && *in_ass && *in_frag_v_ass && *in_frag_v_ref )
-            {
-                if( is_weakly_diagnostic( *paln1, *paln2 ) ) {
-                    dp_list::iterator iter = l.find( ass_pos ) ;
-                    if( iter == l.end() ) {
-                        fprintf( stderr, "diagnostic site not found: %d\n", ass_pos ) ;
-                    } else {
-                        if( verbose >= 4 )
-                            fprintf( stderr, "diagnostic pos.: %d %c(%c)/%c %c/%c",
-                                    ass_pos, iter->second.consensus, in_ref[0], *in_frag_v_ref, *in_ass, *in_frag_v_ass ) ;
-                        if( *in_frag_v_ref != *in_frag_v_ass ) 
-                        {
-                            if( verbose >= 4 ) fputs( " in disagreement.", stderr ) ;
-                        } else {
-                            bool maybe_clean = consistent( adna, iter->second.assembly, *in_frag_v_ass ) ;
-                            bool maybe_dirt =  consistent( adna, iter->second.consensus,  *in_frag_v_ref ) ;
-
-                            if( !maybe_clean && maybe_dirt && iter->second.strength == weak ) {
-                                if( verbose >= 4 )
-                                    fputs( " possible contaminant, upgraded to `effective'.", stderr ) ;
-                                iter->second.contaminant = *in_frag_v_ref ;
-                                iter->second.strength = effective ;
-                            }
-                        }
-                    }
-                    if( verbose >= 4 ) putc( '\n', stderr ) ;
-                }
-
-                if( *paln1 != '-' ) {
-                    do {
-                        in_ref=in_ref.substr(1) ;
-                        in_frag_v_ref++ ;
-                    } while( in_ref[0] == '-' ) ;
-                }
-                if( *paln2 != '-' ) {
-                    ass_pos++ ;
-                    do {
-                        in_ass++ ;
-                        in_frag_v_ass++ ;
-                    } while( *in_ass == '-' ) ;
-                }
-                ++paln1 ;
-                ++paln2 ;
-            }
-            if( verbose >= 4 ) fprintf( stderr, "\n" ) ;
-
-            free_alignment( frag_aln ) ;
-        }
+        infiles.push_back( be_clever ? find_maln( argv[optind] ) : argv[optind] ) ;
 
-        for( dp_list::iterator i = l.begin(), j = l.end() ; i != j ; )
-        {
-            dp_list::iterator k = i ;
-            k++ ;
-            if( i->second.strength == weak ) l.erase( i ) ;
-            i=k ;
-        }
-        {
-            int t = 0 ;
-            for( dp_list::const_iterator i = l.begin() ; i != l.end() ; ++i )
-                if( is_transversion( i->second.consensus, i->second.assembly ) ) ++t ;
-            if( mktable ) printf( "%d\t%d\t", t, num_strong ) ; 
-            else {
-                printf( "  %d effectively diagnostic positions", (int)l.size() ) ;
-                if( span_from != 0 || span_to != INT_MAX )
-                    printf( " in range [%d,%d)", span_from, span_to ) ;
-                printf( ", %d of which are transversions.\n\n", t ) ;
-            }
-        }
-        if( verbose >= 3 ) print_dp_list( stderr, l.begin(), l.end(), '\n' ) ;
-
-        if( verbose >= 2 ) fputs( "Pass two: classifying fragments.\n", stderr ) ;
-        std::deque< cached_pwaln >::const_iterator cpwaln = cached_pwalns.begin() ;
-        for( const AlnSeqP *s = maln->AlnSeqArray ; s != maln->AlnSeqArray + maln->num_aln_seqs ; ++s, ++cpwaln )
-        {
-            whatsit klass = unknown ;
-            whatsit klass2 = unknown ;
-            int votes = 0, votes2 = 0 ;
-
-            std::string the_ass( maln->ref->seq + (*s)->start, (*s)->end - (*s)->start + 1 ) ;
-            // enough overlap?  (we only have _actually_ diagnostic positions now)
-            std::pair< dp_list::const_iterator, dp_list::const_iterator > p =
-                overlapped_diagnostic_positions( l, *s ) ;
-            if( std::distance( p.first, p.second ) < min_diag_posns )
-            {
-                if( verbose >= 3 ) {
-                    fputs( (*s)->id, stderr ) ;
-                    putc( '/', stderr ) ;
-                    putc( (*s)->segment, stderr ) ;
-                    fputs( ": no diagnostic positions\n", stderr ) ;
-                }
-            }
-            else
-            {
-                if( verbose >= 3 )
-                {
-                    fprintf( stderr, "%s/%c: %d diagnostic positions", (*s)->id, (*s)->segment, (int)std::distance( p.first, p.second ) ) ;
-                    if( verbose >= 4 ) 
-                    {
-                        putc( ':', stderr ) ; putc( ' ', stderr ) ;
-                        print_dp_list( stderr, p.first, p.second, 0 ) ;
-                    }
-                    fprintf( stderr, "; range:  %d..%d\n", (*s)->start, (*s)->end ) ;
-                }
+    // threads left over when there are fewer files than jobs go to
+    // the passes over the fragments of each file
+    int files_at_once = std::min( (size_t)num_jobs, infiles.size() ) ;
+    o.num_threads = num_jobs / files_at_once ;
+    if( files_at_once > 1 ) return check_in_parallel( o, infiles, files_at_once ) ;
 
-                // Hmm, all this iterator business is somewhat lacking...
-                char *paln1 = aln_con, *paln2 = aln_ass ;
-                int ass_pos = 0 ;
-                while( ass_pos != (*s)->start && *paln1 && *paln2 ) 
-                {
-                    if( *paln2 != '-' ) ass_pos++ ;
-                    ++paln1 ;
-                    ++paln2 ;
-                }
-
-                char *in_ass = maln->ref->seq + (*s)->start ;
-                char *in_frag_v_ass = (*s)->seq ;
-                std::string::const_iterator in_frag_v_ref = cpwaln->frag_seq.begin() ;
-
-                std::string lifted = lift_over( aln_con, aln_ass, (*s)->start, (*s)->end + 1 ) ;
-                std::string in_ref = lifted.substr( 0, cpwaln->start ) ;
-                in_ref.append( cpwaln->ref_seq ) ;
-
-                while( ass_pos != (*s)->end +1 && *paln1 && *paln2 && !in_ref.empty() && *in_ass && *in_frag_v_ass && *in_frag_v_ref )
-                {
-                    if( is_weakly_diagnostic( *paln1, *paln2 ) ) {
-                        dp_list::const_iterator iter = l.find( ass_pos ) ;
-                        if( iter != l.end() ) {
-                            if( verbose >= 4 )
-                                fprintf( stderr, "diagnostic pos. %s: %d %c(%c)/%c %c/%c",
-                                        iter->second.strength == strong ? "(strong)" : "  (weak)",
-                                        ass_pos, iter->second.consensus, in_ref[0], *in_frag_v_ref, *in_ass, *in_frag_v_ass ) ;
-                            if( *in_frag_v_ref != *in_frag_v_ass ) 
-                            {
-                                if( verbose >= 4 ) fputs( " in disagreement.\n", stderr ) ;
-                            }
-                            else
-                            {
-                                bool maybe_clean = consistent( adna, iter->second.assembly, *in_frag_v_ass ) ;
-                                bool maybe_dirt  = consistent( adna, iter->second.consensus,  *in_frag_v_ref ) ;
-
-                                if( verbose >= 4 )
-                                {
-                                    fputs( maybe_dirt  ? " " : " in", stderr ) ;
-                                    fputs( "consistent/", stderr ) ;
-                                    fputs( maybe_clean ? "" : "in", stderr ) ;
-                                    fputs( "consistent\n", stderr ) ; 
-                                }
-
-                                update_class( klass2, votes2, maybe_clean, maybe_dirt && !maybe_clean ) ;
-                                if( iter->second.strength == strong ) 
-                                    update_class( klass, votes, maybe_clean, maybe_dirt ) ;
-                            }
-                        }
-                    }
-
-                    if( *paln1 != '-' ) {
-                        do {
-                            in_ref=in_ref.substr(1) ;
-                            in_frag_v_ref++ ;
-                        } while( in_ref[0] == '-' ) ;
-                    }
-                    if( *paln2 != '-' ) {
-                        ass_pos++ ;
-                        do {
-                            in_ass++ ;
-                            in_frag_v_ass++ ;
-                        } while( *in_ass == '-' ) ;
-                    }
-                    ++paln1 ;
-                    ++paln2 ;
-                }
-                if( verbose >= 4 ) putc( '\n', stderr ) ;
-            }
-
-            Bfrags::const_iterator i = bfrags.find( (*s)->id ) ;
-            Bfrags::const_iterator i2 = bfrags2.find( (*s)->id ) ;
-
-            switch( (*s)->segment )
-            {
-                case 'b':
-                    bfrags[ (*s)->id ] = std::make_pair( klass, votes ) ;
-                    bfrags2[ (*s)->id ] = std::make_pair( klass2, votes2 ) ;
-                    if( verbose >= 3 ) putc( '\n', stderr ) ;
-                    break ;
-
-                case 'f':
-                    if( i == bfrags.end() ) 
-                    {
-                        fputs( (*s)->id, stderr ) ;
-                        fputs( "/f is missing its back.\n", stderr ) ;
-                    }
-                    else
-                    {
-                        votes += i->second.second ;
-                        klass = merge_whatsit( klass, i->second.first ) ;
-                    }
-
-                    if( i2 == bfrags2.end() ) 
-                    {
-                        fputs( (*s)->id, stderr ) ;
-                        fputs( "/f is missing its back.\n", stderr ) ;
-                    }
-                    else
-                    {
-                        votes2 += i->second.second ;
-                        klass2 = merge_whatsit( klass2, i->second.first ) ;
-                    }
-
-                case 'a':
-                    if( verbose >= 2 ) fprintf( stderr, "%s is %s (%d votes)\n", (*s)->id, label[klass], votes ) ;
-                    if( verbose >= 2 ) fprintf( stderr, "%s is %s (%d votes)\n", (*s)->id, label[klass2], votes2 ) ;
-                    if( verbose >= 3 ) putc( '\n', stderr ) ;
-                    summary[klass]++ ;
-                    summary2[klass2]++ ;
-                    break ;
-
-                default:
-                    fputs( "don't know how to handle fragment type ", stderr ) ;
-                    putc( (*s)->segment, stderr ) ;
-                    putc( '\n', stderr ) ;
-            }
-        }
-
-        if( !mktable ) {
-            int t = 0 ;
-            for( dp_list::const_iterator i = l.begin(), e = l.end() ; i != e ; ++i )
-                if( i->second.strength == strong ) t++ ;
-            printf( "  strongly diagnostic positions: %d\n", t ) ;
-        }
-        print_results( summary, mktable ) ;
-        if( !mktable ) printf( "  effectively diagnostic positions: %d\n", (int)l.size() ) ;
-        else printf( "%d\t", (int)l.size() ) ; 
-
-        print_results( summary2, mktable ) ;
-        putc( '\n', stdout ) ;
-
-        free_map_alignment( maln ) ;
-        free( aln_con ) ;
-        free( aln_ass ) ;
-    }
+    for( size_t i = 0 ; i != infiles.size() ; ++i )
+        if( int status = check_maln( o, infiles[i], stdout ) ) return status ;
+    return 0 ;
 }
-
-
@@ -232,14 +232,52 @@ int add_virgin_fs2fsdb( FragSeqP fs, FSDB fsdb ) {
 
 
 
+/* sort_fsdb_by
+   Args: (1) FSDB fsdb - database to sort
+         (2) int qscore - Boolean; TRUE => sort on qual_sum, FALSE =>
+             sort on score
+   Packs the order fs_comp (or fs_comp_qscore) defines into a SortKey
+   for each FragSeq and sorts the keys on fsdb->num_threads threads.
+   The sort is stable: FragSeqs the comparator finds equal stay in
+   the order they were in
+*/
+static void sort_fsdb_by( FSDB fsdb, int qscore ) {
+  SortKeyP keys;
+  FragSeqP fs;
+  size_t i;
+
+  keys = (SortKeyP)save_malloc( fsdb->num_fss * sizeof(SortKey) );
+  for( i = 0; i < fsdb->num_fss; i++ ) {
+    fs = fsdb->fss[i];
+    /* Reverse strand guys first */
+    keys[i].k[0] = fs->rc ? 0 : 1;
+    if ( fs->rc ) {
+      keys[i].k[1] = int_sort_key( fs->ae, 1 );
+      keys[i].k[2] = int_sort_key( fs->as, 0 );
+    }
+    else {
+      keys[i].k[1] = int_sort_key( fs->as, 0 );
+      keys[i].k[2] = int_sort_key( fs->ae, 1 );
+    }
+    keys[i].k[3] = int_sort_key( qscore ? fs->qual_sum : fs->score, 1 );
+    keys[i].item = fs;
+  }
+
+  sort_keys( keys, fsdb->num_fss, fsdb->num_threads );
+
+  for( i = 0; i < fsdb->num_fss; i++ ) {
+    fsdb->fss[i] = (FragSeqP)keys[i].item;
+  }
+  free( keys );
+}
+
 /* Sorts the fsdb->fss on rc, as, ae, score
    After sorting all 1 strand alignments are first
    These are sorted by as, then ae, with the highest
    scoring guys first
 */
 void sort_fsdb( FSDB fsdb ) {
-  qsort( (void*)fsdb->fss, (size_t)fsdb->num_fss,
-	 sizeof(FragSeqP), fs_comp );
+  sort_fsdb_by( fsdb, 0 );
 }
 
 /* Sorts the fsdb->fss on rc, as, ae, qual_sum
@@ -248,8 +286,7 @@ void sort_fsdb( FSDB fsdb ) {
    scoring guys first
 */
 void sort_fsdb_qscore( FSDB fsdb ) {
-  qsort( (void*)fsdb->fss, (size_t)fsdb->num_fss,
-	 sizeof(FragSeqP), fs_comp_qscore );
+  sort_fsdb_by( fsdb, 1 );
 }
 
 
@@ -756,6 +793,7 @@ FSDB init_FSDB ( void ) {
 
   fsdb->size = INIT_NUM_ALN_SEQS;
   fsdb->num_fss = 0;
+  fsdb->num_threads = 1;
 
   return fsdb;
 }
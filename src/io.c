@@ -1,23 +1,697 @@
 #include "io.h"
 
+/* seq_char_tbl maps every byte of a sequence line to what is kept
+   of it in a FragSeq: 0 for whitespace, which is skipped, and the
+   upper case of anything else, just as isspace and toupper would
+   in the C locale. qual_char_tbl does the same without changing
+   case */
+static char seq_char_tbl[256];
+static char qual_char_tbl[256];
+static int char_tbls_done = 0;
+
+static void init_char_tbls( void ) {
+  int c;
+  if ( char_tbls_done ) {
+    return;
+  }
+  for( c = 0; c < 256; c++ ) {
+    if ( (c == ' ') || (c == '\t') || (c == '\n') ||
+	 (c == '\v') || (c == '\f') || (c == '\r') ) {
+      seq_char_tbl[c] = qual_char_tbl[c] = 0;
+    }
+    else {
+      seq_char_tbl[c] = ((c >= 'a') && (c <= 'z')) ? c - 'a' + 'A' : c;
+      qual_char_tbl[c] = c;
+    }
+  }
+  char_tbls_done = 1;
+}
+
+/* read_raw
+   Args: 1. SeqReaderP
+         2. where to put the bytes
+	 3. how many bytes are wanted
+   Takes the bytes still in sr->raw first, then reads the rest
+   straight from the file
+   Returns: number of bytes put in dst, which is less than n only
+            at the end of the file
+*/
+static size_t read_raw( SeqReaderP sr, unsigned char* dst, size_t n ) {
+  size_t got;
+  got = sr->raw_end - sr->raw_pos;
+  if ( got > n ) {
+    got = n;
+  }
+  memcpy( dst, sr->raw + sr->raw_pos, got );
+  sr->raw_pos += got;
+  if ( got < n ) {
+    got += fread( dst + got, sizeof(unsigned char), n - got, sr->f );
+  }
+  return got;
+}
+
+/* refill_raw
+   Args: 1. SeqReaderP
+   Reads as much of the file into sr->raw as fits, once everything
+   in it has been used
+   Returns: number of bytes read; 0 at the end of the file
+*/
+static size_t refill_raw( SeqReaderP sr ) {
+  sr->raw_pos = 0;
+  sr->raw_end = fread( sr->raw, sizeof(unsigned char), READ_BUF_LEN, sr->f );
+  return sr->raw_end;
+}
+
+/* bgzf_block_size
+   Args: 1. the first 12 bytes of a gzip member
+         2. its extra field
+   Returns: the size of the whole member if this is a BGZF block,
+            which says so in a BC subfield of the extra field, or
+	    0 if it is not
+*/
+static size_t bgzf_block_size( const unsigned char* head,
+			       const unsigned char* extra ) {
+  size_t xlen, p, slen;
+  if ( (head[0] != 31) || (head[1] != 139) || (head[2] != 8) ||
+       !(head[3] & 4) ) {
+    return 0;
+  }
+  xlen = head[10] | (head[11] << 8);
+  p = 0;
+  while( p + 4 <= xlen ) {
+    slen = extra[p+2] | (extra[p+3] << 8);
+    if ( (extra[p] == 'B') && (extra[p+1] == 'C') && (slen == 2) &&
+	 (p + 6 <= xlen) ) {
+      return (extra[p+4] | (extra[p+5] << 8)) + 1;
+    }
+    p += 4 + slen;
+  }
+  return 0;
+}
+
+/* inflate_bgzf_block
+   Args: 1. BgzfBlockP to inflate into its b->out
+   Checks the size and CRC32 of what comes out; corrupt input
+   is fatal
+*/
+static void inflate_bgzf_block( BgzfBlockP b ) {
+  z_stream zs;
+  int ret;
+  memset( &zs, 0, sizeof(z_stream) );
+  if ( inflateInit2( &zs, -MAX_WBITS ) != Z_OK ) {
+    fprintf( stderr, "Could not set up zlib for BGZF input\n" );
+    exit( 1 );
+  }
+  zs.next_in = b->cdata;
+  zs.avail_in = b->clen;
+  zs.next_out = (Bytef*)b->out;
+  zs.avail_out = BGZF_MAX_BLOCK;
+  ret = inflate( &zs, Z_FINISH );
+  inflateEnd( &zs );
+  if ( (ret != Z_STREAM_END) || (zs.total_out != b->isize) ||
+       (crc32( crc32( 0L, Z_NULL, 0 ), (Bytef*)b->out, b->isize ) != b->crc) ) {
+    fprintf( stderr, "Corrupt BGZF block in sequence input\n" );
+    exit( 1 );
+  }
+}
+
+/* inflate_bgzf_slice
+   Args: 1. BgzfSliceP, passed as void* so this can be a thread
+   Inflates each block of the slice
+*/
+static void* inflate_bgzf_slice( void* arg ) {
+  BgzfSliceP slice = (BgzfSliceP)arg;
+  int i;
+  for( i = 0; i < slice->num_blocks; i++ ) {
+    inflate_bgzf_block( &slice->blocks[i] );
+  }
+  return NULL;
+}
+
+/* read_bgzf_batch
+   Args: 1. SeqReaderP of BGZF input
+   Reads up to num_threads * BGZF_BLOCKS_PER_THREAD blocks and
+   inflates them into sr->zout, splitting them among num_threads
+   threads
+   Returns: number of blocks read; 0 at the end of the file
+*/
+static int read_bgzf_batch( SeqReaderP sr ) {
+  unsigned char head[12];
+  unsigned char* block;
+  BgzfBlockP b;
+  BgzfSlice one_slice;
+  BgzfSliceP slices;
+  pthread_t* threads;
+  size_t n, xlen, bsize, cpos = 0, opos = 0;
+  int max_blocks, num_blocks = 0, num_threads, first, t;
+
+  max_blocks = sr->num_threads * BGZF_BLOCKS_PER_THREAD;
+  while( num_blocks < max_blocks ) {
+    n = read_raw( sr, head, 12 );
+    if ( n == 0 ) {
+      break;
+    }
+    /* The extra field goes in the block's place in cbuf
+       until it has told us how big the block is */
+    block = sr->cbuf + cpos;
+    xlen = head[10] | (head[11] << 8);
+    if ( (n < 12) || (read_raw( sr, block, xlen ) < xlen) ) {
+      fprintf( stderr, "Truncated BGZF block in sequence input\n" );
+      exit( 1 );
+    }
+    bsize = bgzf_block_size( head, block );
+    if ( (bsize < 12 + xlen + 8) || (bsize > BGZF_MAX_BLOCK) ) {
+      fprintf( stderr, "Corrupt BGZF block in sequence input\n" );
+      exit( 1 );
+    }
+    n = bsize - 12 - xlen;
+    if ( read_raw( sr, block, n ) < n ) {
+      fprintf( stderr, "Truncated BGZF block in sequence input\n" );
+      exit( 1 );
+    }
+    b = &sr->blocks[num_blocks];
+    b->cdata = block;
+    b->clen = n - 8;
+    b->crc = block[n-8] | (block[n-7] << 8) | (block[n-6] << 16) |
+      ((unsigned int)block[n-5] << 24);
+    b->isize = block[n-4] | (block[n-3] << 8) | (block[n-2] << 16) |
+      ((unsigned int)block[n-1] << 24);
+    if ( b->isize > BGZF_MAX_BLOCK ) {
+      fprintf( stderr, "Corrupt BGZF block in sequence input\n" );
+      exit( 1 );
+    }
+    b->out = sr->zout + opos;
+    cpos += b->clen;
+    opos += b->isize;
+    num_blocks++;
+  }
+
+  num_threads = (sr->num_threads < num_blocks) ? sr->num_threads : num_blocks;
+  if ( num_threads <= 1 ) {
+    one_slice.blocks = sr->blocks;
+    one_slice.num_blocks = num_blocks;
+    inflate_bgzf_slice( &one_slice );
+  }
+  else {
+    slices = (BgzfSliceP)save_malloc( num_threads * sizeof(BgzfSlice) );
+    threads = (pthread_t*)save_malloc( num_threads * sizeof(pthread_t) );
+    for( t = 0; t < num_threads; t++ ) {
+      first = t * num_blocks / num_threads;
+      slices[t].blocks = sr->blocks + first;
+      slices[t].num_blocks = (t + 1) * num_blocks / num_threads - first;
+      pthread_create( &threads[t], NULL, inflate_bgzf_slice, &slices[t] );
+    }
+    for( t = 0; t < num_threads; t++ ) {
+      pthread_join( threads[t], NULL );
+    }
+    free( slices );
+    free( threads );
+  }
+  sr->zout_pos = 0;
+  sr->zout_end = opos;
+  return num_blocks;
+}
+
+/* read_bgzf
+   Args: 1. SeqReaderP of BGZF input
+         2. where to put the inflated bytes
+	 3. most bytes wanted
+   Returns: number of bytes put in dst; 0 at the end of the input
+*/
+static size_t read_bgzf( SeqReaderP sr, char* dst, size_t n ) {
+  while( sr->zout_pos == sr->zout_end ) {
+    if ( !read_bgzf_batch( sr ) ) {
+      return 0;
+    }
+  }
+  if ( n > sr->zout_end - sr->zout_pos ) {
+    n = sr->zout_end - sr->zout_pos;
+  }
+  memcpy( dst, sr->zout + sr->zout_pos, n );
+  sr->zout_pos += n;
+  return n;
+}
+
+/* read_gzip
+   Args: 1. SeqReaderP of gzip input
+         2. where to put the inflated bytes
+	 3. most bytes wanted
+   Concatenated gzip members are read as one stream, as gzip -d does
+   Returns: number of bytes put in dst; 0 at the end of the input
+*/
+static size_t read_gzip( SeqReaderP sr, char* dst, size_t n ) {
+  z_stream* zs = sr->zs;
+  int ret;
+
+  zs->next_out = (Bytef*)dst;
+  zs->avail_out = n;
+  while( zs->avail_out == n ) {
+    if ( (sr->raw_pos == sr->raw_end) && !refill_raw( sr ) ) {
+      if ( zs->total_in > 0 ) {
+	fprintf( stderr, "Truncated gzip sequence input\n" );
+	exit( 1 );
+      }
+      break;
+    }
+    zs->next_in = sr->raw + sr->raw_pos;
+    zs->avail_in = sr->raw_end - sr->raw_pos;
+    ret = inflate( zs, Z_NO_FLUSH );
+    sr->raw_pos = sr->raw_end - zs->avail_in;
+    if ( ret == Z_STREAM_END ) {
+      inflateReset( zs );
+    }
+    else if ( ret != Z_OK ) {
+      fprintf( stderr, "Corrupt gzip sequence input: %s\n",
+	       zs->msg ? zs->msg : "inflate failed" );
+      exit( 1 );
+    }
+  }
+  return n - zs->avail_out;
+}
+
+/* read_seq_input
+   Args: 1. SeqReaderP
+         2. where to put the bytes
+	 3. most bytes wanted
+   Returns: number of bytes of sequence input, uncompressed, put
+            in dst; 0 at the end of the input
+*/
+static size_t read_seq_input( SeqReaderP sr, char* dst, size_t n ) {
+  if ( sr->format == SEQ_INPUT_BGZF ) {
+    return read_bgzf( sr, dst, n );
+  }
+  if ( sr->format == SEQ_INPUT_GZIP ) {
+    return read_gzip( sr, dst, n );
+  }
+  return read_raw( sr, (unsigned char*)dst, n );
+}
+
+/* map_seq_file
+   Args: 1. SeqReaderP with its file open but no buffer yet
+   Maps the whole file as sr->buf, if it is a regular, uncompressed
+   file that can be mmapped. Since all of it is then in buf, there
+   is nothing more to read from it
+   Returns: TRUE if it was mapped, FALSE if it must be read
+*/
+static int map_seq_file( SeqReaderP sr ) {
+  struct stat st;
+  void* map;
+  unsigned char* head;
+
+  if ( (fstat( fileno( sr->f ), &st ) != 0) || !S_ISREG( st.st_mode ) ||
+       (st.st_size <= 0) ) {
+    return 0;
+  }
+  map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno( sr->f ), 0 );
+  if ( map == MAP_FAILED ) {
+    return 0;
+  }
+  head = (unsigned char*)map;
+  if ( (st.st_size >= 2) && (head[0] == 31) && (head[1] == 139) ) {
+    munmap( map, st.st_size );
+    return 0;
+  }
+  madvise( map, st.st_size, MADV_SEQUENTIAL );
+  sr->mapped = 1;
+  sr->buf = (char*)map;
+  sr->size = st.st_size;
+  sr->end = st.st_size;
+  sr->eof = 1;
+  return 1;
+}
+
+/* open_seq_reader
+   Args: 1. name of the sequence file to read
+         2. number of threads for inflating BGZF input
+   Returns: a SeqReaderP for reading it, or NULL if it could
+            not be opened
+   gzip and BGZF compressed files are recognized by their first
+   bytes and inflated as they are read. fn "-" is stdin; since the
+   input is never rewound, it may be a pipe. Other uncompressed files
+   are mmapped and parsed where they are, without being read into
+   a buffer first
+*/
+SeqReaderP open_seq_reader( const char* fn, int num_threads ) {
+  SeqReaderP sr;
+  FILE* f;
+  int max_blocks;
+
+  if ( strcmp( fn, "-" ) == 0 ) {
+    f = stdin;
+  }
+  else {
+    f = fileOpen( fn, "r" );
+    if ( f == NULL ) {
+      return NULL;
+    }
+  }
+  init_char_tbls();
+  sr = (SeqReaderP)save_malloc( sizeof(SeqReader) );
+  sr->f = f;
+  sr->pos = 0;
+  sr->end = 0;
+  sr->eof = 0;
+  sr->num_threads = (num_threads < 1) ? 1 : num_threads;
+  sr->format = SEQ_INPUT_PLAIN;
+  sr->raw = NULL;
+  sr->zs = NULL;
+  sr->cbuf = NULL;
+  sr->blocks = NULL;
+  sr->zout = NULL;
+  sr->zout_pos = 0;
+  sr->zout_end = 0;
+  sr->ref_id[0] = '\0';
+  sr->num_refs = 0;
+  sr->bam_ref = -1;
+
+  if ( (f != stdin) && map_seq_file( sr ) ) {
+    return sr;
+  }
+  sr->mapped = 0;
+  sr->buf = (char*)save_malloc( READ_BUF_LEN * sizeof(char) );
+  sr->size = READ_BUF_LEN;
+  sr->raw = (unsigned char*)save_malloc( READ_BUF_LEN * sizeof(unsigned char) );
+  refill_raw( sr );
+  if ( (sr->raw_end >= 2) && (sr->raw[0] == 31) && (sr->raw[1] == 139) ) {
+    if ( (sr->raw_end >= 18) &&
+	 (bgzf_block_size( sr->raw, sr->raw + 12 ) > 0) ) {
+      sr->format = SEQ_INPUT_BGZF;
+      max_blocks = sr->num_threads * BGZF_BLOCKS_PER_THREAD;
+      sr->cbuf = (unsigned char*)save_malloc( max_blocks * BGZF_MAX_BLOCK );
+      sr->zout = (char*)save_malloc( max_blocks * BGZF_MAX_BLOCK );
+      sr->blocks = (BgzfBlockP)save_malloc( max_blocks * sizeof(BgzfBlock) );
+    }
+    else {
+      sr->format = SEQ_INPUT_GZIP;
+      sr->zs = (z_stream*)save_malloc( sizeof(z_stream) );
+      memset( sr->zs, 0, sizeof(z_stream) );
+      if ( inflateInit2( sr->zs, MAX_WBITS + 16 ) != Z_OK ) {
+	fprintf( stderr, "Could not set up zlib for gzip input\n" );
+	exit( 1 );
+      }
+    }
+  }
+  return sr;
+}
+
+/* close_seq_reader
+   Args: 1. SeqReaderP to close
+   Closes its file and frees it
+*/
+void close_seq_reader( SeqReaderP sr ) {
+  if ( sr->f != stdin ) {
+    fclose( sr->f );
+  }
+  if ( sr->zs != NULL ) {
+    inflateEnd( sr->zs );
+    free( sr->zs );
+  }
+  free( sr->cbuf );
+  free( sr->zout );
+  free( sr->blocks );
+  free( sr->raw );
+  if ( sr->mapped ) {
+    munmap( sr->buf, sr->size );
+  }
+  else {
+    free( sr->buf );
+  }
+  free( sr );
+}
+
+/* fill_seq_reader
+   Args: 1. SeqReaderP to read more into
+   Moves the bytes not parsed yet to the front of the buffer and
+   reads as much more as fits
+   Returns: number of bytes read; 0 at the end of the input
+*/
+static size_t fill_seq_reader( SeqReaderP sr ) {
+  size_t n;
+  if ( sr->eof ) {
+    return 0;
+  }
+  if ( sr->pos > 0 ) {
+    memmove( sr->buf, sr->buf + sr->pos, sr->end - sr->pos );
+    sr->end -= sr->pos;
+    sr->pos = 0;
+  }
+  n = read_seq_input( sr, sr->buf + sr->end, sr->size - sr->end );
+  if ( n == 0 ) {
+    sr->eof = 1;
+  }
+  sr->end += n;
+  return n;
+}
+
+/* peek_seq_reader
+   Args: 1. SeqReaderP
+   Returns: the next byte, without parsing it, or EOF
+*/
+static int peek_seq_reader( SeqReaderP sr ) {
+  if ( (sr->pos == sr->end) && !fill_seq_reader( sr ) ) {
+    return EOF;
+  }
+  return (unsigned char)sr->buf[sr->pos];
+}
+
+/* cut_long_line
+   Args: 1. SeqReaderP whose buffer is full of one line, with no
+            newline in it
+         2. pointer to size_t where the length of the line goes
+	 3. pointer to int set TRUE if the line ended with a newline
+   The line is cut to the first half of the buffer, and the rest of
+   it is read into the second half and thrown away, so the buffer
+   never has to grow
+   Returns: pointer to what is kept of the line
+*/
+static char* cut_long_line( SeqReaderP sr, size_t* len, int* has_newline ) {
+  char* nl;
+  size_t keep = sr->size / 2;
+  size_t n;
+
+  *len = keep;
+  *has_newline = 0;
+  while( 1 ) {
+    n = read_seq_input( sr, sr->buf + keep, sr->size - keep );
+    if ( n == 0 ) {
+      sr->eof = 1;
+      sr->pos = sr->end = keep;
+      break;
+    }
+    nl = (char*)memchr( sr->buf + keep, '\n', n );
+    if ( nl != NULL ) {
+      *has_newline = 1;
+      sr->pos = nl - sr->buf + 1;
+      sr->end = keep + n;
+      break;
+    }
+  }
+  return sr->buf;
+}
+
+/* next_line
+   Args: 1. SeqReaderP
+         2. pointer to size_t where the length of the line goes
+	 3. pointer to int set TRUE if the line ended with a newline,
+	    FALSE if with the end of the input
+   Returns: pointer to the next line in the buffer, without its
+            newline, or NULL at the end of the input. It stays
+	    valid until the next read from sr. Lines longer than the
+	    buffer are cut by cut_long_line
+*/
+static char* next_line( SeqReaderP sr, size_t* len, int* has_newline ) {
+  char* nl;
+  char* line;
+  size_t scanned = 0;
+
+  while( 1 ) {
+    nl = (char*)memchr( sr->buf + sr->pos + scanned, '\n',
+			sr->end - sr->pos - scanned );
+    if ( nl != NULL ) {
+      break;
+    }
+    scanned = sr->end - sr->pos;
+    if ( (scanned == sr->size) && !sr->mapped ) {
+      return cut_long_line( sr, len, has_newline );
+    }
+    if ( !fill_seq_reader( sr ) ) {
+      break;
+    }
+  }
+  if ( sr->pos == sr->end ) {
+    return NULL;
+  }
+
+  line = sr->buf + sr->pos;
+  if ( nl != NULL ) {
+    *len = nl - line;
+    *has_newline = 1;
+    sr->pos += *len + 1;
+  }
+  else {
+    *len = sr->end - sr->pos;
+    *has_newline = 0;
+    sr->pos = sr->end;
+  }
+  return line;
+}
+
+/* want_seq_bytes
+   Args: 1. SeqReaderP
+         2. number of bytes wanted
+   Reads more until n bytes not parsed yet are in the buffer
+   Returns: TRUE if they are, FALSE if the input ends first or
+            they would not fit in the buffer
+*/
+static int want_seq_bytes( SeqReaderP sr, size_t n ) {
+  if ( n > sr->size ) {
+    return 0;
+  }
+  while( sr->end - sr->pos < n ) {
+    if ( !fill_seq_reader( sr ) ) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* skip_seq_bytes
+   Args: 1. SeqReaderP
+         2. number of bytes to skip
+   Skips n bytes of the input, however many fit in the buffer
+   Returns: TRUE if they were all skipped, FALSE if the input ended
+*/
+static int skip_seq_bytes( SeqReaderP sr, size_t n ) {
+  size_t m;
+  while( n > 0 ) {
+    if ( (sr->pos == sr->end) && !fill_seq_reader( sr ) ) {
+      return 0;
+    }
+    m = sr->end - sr->pos;
+    if ( m > n ) {
+      m = n;
+    }
+    sr->pos += m;
+    n -= m;
+  }
+  return 1;
+}
+
+/* get_le32
+   Args: 1. pointer to 4 bytes of BAM data
+   Returns: the little-endian number they make, whatever the byte
+            order of this machine
+*/
+static unsigned int get_le32( const char* p ) {
+  const unsigned char* u = (const unsigned char*)p;
+  return (unsigned int)u[0] | ((unsigned int)u[1] << 8) |
+    ((unsigned int)u[2] << 16) | ((unsigned int)u[3] << 24);
+}
+
+/* parse_seq_header
+   Args: 1. header line, without its leading > or @
+         2. its length
+	 3. FragSeqP to put the id and description in
+   The id is everything up to the first whitespace, cut at
+   MAX_ID_LEN; the description is the rest of the line after the
+   whitespace, cut at MAX_DESC_LEN
+*/
+static void parse_seq_header( const char* line, size_t len, FragSeqP frag_seq ) {
+  size_t p = 0, i = 0;
+
+  while( (p < len) && !isspace( line[p] ) ) {
+    if ( i < MAX_ID_LEN ) {
+      frag_seq->id[i++] = line[p];
+    }
+    p++;
+  }
+  frag_seq->id[i] = '\0';
+
+  while( (p < len) && isspace( line[p] ) ) {
+    p++;
+  }
+  i = 0;
+  while( (p < len) && (i < MAX_DESC_LEN) ) {
+    frag_seq->desc[i++] = line[p++];
+  }
+  frag_seq->desc[i] = '\0';
+}
+
 /* find_input_type
-   Args: 1. FILE* pointer to file to be analyzed
+   Args: 1. SeqReaderP for the file to be analyzed
    Returns: sequence code indicating what kind of sequence file
             this is:
 	    0 => fasta
 	    1 => fastq
-   Resets the input FILE pointer to the beginning of the file
+	    2 => SAM
+	    3 => BAM
+   Only peeks at the start of the input; nothing is parsed, except
+   that the header of a BAM file is skipped, leaving sr at its
+   first record, once its references are counted and the one
+   named sr->ref_id, if any, is found
 */
-int find_input_type( FILE * FF ) {
-  char c;
-  c = fgetc( FF );
-  ungetc( c, FF );  
+int find_input_type( SeqReaderP sr ) {
+  static const char* sam_tags[] = { "@HD\t", "@SQ\t", "@RG\t",
+				    "@PG\t", "@CO\t" };
+  const char* line;
+  size_t i, n, name_len;
+  int c, tabs;
+  c = peek_seq_reader( sr );
+  if ( c == '>' ) {
+    return 0;
+  }
+
+  /* BAM, once inflated, starts with its magic, the header text and
+     the reference names. Only which of them is sr->ref_id is
+     needed, to tell records mapped to it from the others */
+  if ( (c == 'B') && want_seq_bytes( sr, 8 ) &&
+       (memcmp( sr->buf + sr->pos, "BAM\1", 4 ) == 0) ) {
+    n = get_le32( sr->buf + sr->pos + 4 );
+    skip_seq_bytes( sr, 8 );
+    skip_seq_bytes( sr, n );
+    if ( want_seq_bytes( sr, 4 ) ) {
+      n = get_le32( sr->buf + sr->pos );
+      skip_seq_bytes( sr, 4 );
+      for( i = 0; i < n; i++ ) {
+	if ( !want_seq_bytes( sr, 4 ) ) {
+	  break;
+	}
+	name_len = get_le32( sr->buf + sr->pos );
+	if ( want_seq_bytes( sr, name_len + 4 ) &&
+	     (name_len == strlen( sr->ref_id ) + 1) &&
+	     (memcmp( sr->buf + sr->pos + 4, sr->ref_id, name_len ) == 0) ) {
+	  sr->bam_ref = i;
+	}
+	sr->num_refs++;
+	skip_seq_bytes( sr, name_len + 8 );
+      }
+    }
+    return 3;
+  }
+
+  /* A SAM header line starts with @ too, but with a two letter
+     record type and a tab */
   if ( c == '@' ) {
+    if ( want_seq_bytes( sr, 4 ) ) {
+      for( i = 0; i < sizeof( sam_tags ) / sizeof( char* ); i++ ) {
+	if ( memcmp( sr->buf + sr->pos, sam_tags[i], 4 ) == 0 ) {
+	  return 2;
+	}
+      }
+    }
     return 1;
   }
 
-  if ( c == '>' ) {
-    return 0;
+  /* SAM without a header: a line of at least 11 tab separated fields */
+  line = sr->buf + sr->pos;
+  tabs = 0;
+  for( i = 0; (i < sr->end - sr->pos) && (line[i] != '\n'); i++ ) {
+    if ( line[i] == '\t' ) {
+      tabs++;
+    }
+  }
+  if ( tabs >= 10 ) {
+    return 2;
   }
 
   /* default */
@@ -26,27 +700,230 @@ int find_input_type( FILE * FF ) {
 
 
 /* read_next_seq
-   Args: 1. FILE* pointer to file being read
+   Args: 1. SeqReaderP for the file being read
          2. FragSeqP pointer to FragSeq where the next sequence data will go
 	 3. int code indicating which parser to use
    Returns: TRUE if a sequence was read,
             FALSE if EOF
 */
-int read_next_seq( FILE * FF, FragSeqP frag_seq, int seq_code ) {
-  if ( seq_code == 0 ) return read_fasta( FF, frag_seq );
-  else /* seq_code == 1 */ return read_fastq( FF, frag_seq );
+int read_next_seq( SeqReaderP sr, FragSeqP frag_seq, int seq_code ) {
+  frag_seq->strand_known = 0;
+  if ( seq_code == 0 ) return read_fasta( sr, frag_seq );
+  else if ( seq_code == 2 ) return read_sam( sr, frag_seq );
+  else if ( seq_code == 3 ) return read_bam( sr, frag_seq );
+  else /* seq_code == 1 */ return read_fastq( sr, frag_seq );
+}
+
+/* strip_mate_suffix
+   Args: 1. sequence id
+   Returns: void
+   Cuts a trailing /1 or /2 off id
+*/
+static void strip_mate_suffix( char* id ) {
+  size_t len = strlen( id );
+  if ( (len > 2) && (id[len-2] == '/') &&
+       ((id[len-1] == '1') || (id[len-1] == '2')) ) {
+    id[len-2] = '\0';
+  }
+}
+
+/* add_mate_suffix
+   Args: 1. sequence id, without a mate suffix
+         2. "/1" or "/2"
+   Returns: void
+   Appends suffix to id, cutting id short if it would not fit
+*/
+static void add_mate_suffix( char* id, const char* suffix ) {
+  if ( strlen( id ) > MAX_ID_LEN - 2 ) {
+    id[MAX_ID_LEN - 2] = '\0';
+  }
+  strcat( id, suffix );
+}
+
+/* merge_mates
+   Args: 1. FragSeqP of the first read of a pair
+         2. FragSeqP of the second read, as it was read
+   Returns: TRUE if the reads overlap and were merged into fs1,
+            FALSE if they were left as they were
+   The reverse complement of the second read is slid along the
+   first one, and the ungapped overlap of at least PE_MIN_OVERLAP
+   bases with no more than PE_MAX_MISMATCH_PCT percent mismatches
+   scoring best is taken. The merged sequence runs from the start
+   of the first read to the end of the second one, so any adapter
+   read through past the end of the insert, on either read, is
+   left out. In the overlap, the base of higher quality is taken;
+   agreeing qualities add up, disagreeing ones are subtracted. If
+   either read has no qualities, the merged one has none either
+*/
+static int merge_mates( FragSeqP fs1, const FragSeqP fs2 ) {
+  char rc_seq[INIT_ALN_SEQ_LEN+1];
+  char rc_qual[INIT_ALN_SEQ_LEN+1];
+  char seq[INIT_ALN_SEQ_LEN+1];
+  char qual[INIT_ALN_SEQ_LEN+1];
+  int len1, len2, has_qual, o, k, b1, b2;
+  int ov_start, ov_end, matches, mismatches, score;
+  int best_o, best_score, merged_len, q1, q2, q, qual_sum;
+  char c1, c2;
+
+  len1 = fs1->seq_len;
+  len2 = fs2->seq_len;
+  has_qual = (fs1->qual[0] != '\0') && (fs2->qual[0] != '\0');
+  for( k = 0; k < len2; k++ ) {
+    rc_seq[k] = revcom_char( fs2->seq[len2 - (k+1)] );
+    rc_qual[k] = has_qual ? fs2->qual[len2 - (k+1)] : QUAL_ASCII_OFFSET;
+  }
+
+  /* The second read starts at o on the first one; o < 0 means the
+     insert is shorter than the second read */
+  best_o = 0;
+  best_score = -1;
+  for( o = len1 - PE_MIN_OVERLAP; o > PE_MIN_OVERLAP - len2; o-- ) {
+    ov_start = (o > 0) ? o : 0;
+    ov_end = (o + len2 < len1) ? o + len2 : len1;
+    if ( ov_end - ov_start < PE_MIN_OVERLAP ) {
+      continue;
+    }
+    matches = mismatches = 0;
+    for( k = ov_start; k < ov_end; k++ ) {
+      c1 = fs1->seq[k];
+      c2 = rc_seq[k - o];
+      if ( (c1 == 'N') || (c2 == 'N') ) {
+	continue;
+      }
+      if ( c1 == c2 ) {
+	matches++;
+      }
+      else {
+	mismatches++;
+      }
+    }
+    if ( (mismatches * 100 > PE_MAX_MISMATCH_PCT * (ov_end - ov_start)) ||
+	 (matches < PE_MIN_OVERLAP) ) {
+      continue;
+    }
+    score = matches - PE_MISMATCH_PENALTY * mismatches;
+    if ( score > best_score ) {
+      best_score = score;
+      best_o = o;
+    }
+  }
+  if ( best_score < 0 ) {
+    return 0;
+  }
+
+  merged_len = best_o + len2;
+  if ( merged_len > INIT_ALN_SEQ_LEN ) {
+    merged_len = INIT_ALN_SEQ_LEN;
+  }
+  qual_sum = 0;
+  for( k = 0; k < merged_len; k++ ) {
+    b1 = (k < len1);
+    b2 = (k >= best_o) && (k - best_o < len2);
+    c1 = b1 ? fs1->seq[k] : 'N';
+    c2 = b2 ? rc_seq[k - best_o] : 'N';
+    q1 = (b1 && has_qual) ? fs1->qual[k] - QUAL_ASCII_OFFSET : 0;
+    q2 = b2 ? rc_qual[k - best_o] - QUAL_ASCII_OFFSET : 0;
+    if ( !b2 || (c2 == 'N') ) {
+      seq[k] = c1;
+      q = q1;
+    }
+    else if ( !b1 || (c1 == 'N') ) {
+      seq[k] = c2;
+      q = q2;
+    }
+    else if ( c1 == c2 ) {
+      seq[k] = c1;
+      q = q1 + q2;
+    }
+    else if ( !has_qual ) {
+      seq[k] = 'N';
+      q = 0;
+    }
+    else {
+      seq[k] = (q1 >= q2) ? c1 : c2;
+      q = (q1 >= q2) ? q1 - q2 : q2 - q1;
+    }
+    if ( q > PE_MAX_QUAL ) {
+      q = PE_MAX_QUAL;
+    }
+    qual[k] = q + QUAL_ASCII_OFFSET;
+    qual_sum += q;
+  }
+  memcpy( fs1->seq, seq, merged_len );
+  fs1->seq[merged_len] = '\0';
+  fs1->seq_len = merged_len;
+  if ( has_qual ) {
+    memcpy( fs1->qual, qual, merged_len );
+    fs1->qual[merged_len] = '\0';
+    fs1->qual_sum = qual_sum;
+  }
+  else {
+    fs1->qual[0] = '\0';
+    fs1->qual_sum = 0;
+  }
+  return 1;
+}
+
+/* read_next_pair
+   Args: 1. SeqReaderP for the first reads of pairs
+         2. SeqReaderP for the second reads; the same as 1. if the
+	    mates are interleaved in one file
+	 3. FragSeqP for the first read, or both merged
+	 4. FragSeqP for the second read
+	 5. int code indicating which parser to use for 1.
+	 6. int code indicating which parser to use for 2.
+   Returns: 0 if EOF,
+            1 if the mates overlapped and were merged into fs1,
+	    2 if they did not, and are in fs1 and fs2
+   Merged mates keep their id, without any /1 or /2; unmerged ones
+   get /1 and /2 after it. Exits if the mates do not have the same
+   id, or one file ends before the other
+*/
+int read_next_pair( SeqReaderP sr1, SeqReaderP sr2, FragSeqP fs1,
+		    FragSeqP fs2, int seq_code1, int seq_code2 ) {
+  if ( !read_next_seq( sr1, fs1, seq_code1 ) ) {
+    if ( (sr2 != sr1) && read_next_seq( sr2, fs2, seq_code2 ) ) {
+      fprintf( stderr, "Second reads go on after the first reads end, at %s\n",
+	       fs2->id );
+      exit( 1 );
+    }
+    return 0;
+  }
+  if ( !read_next_seq( sr2, fs2, seq_code2 ) ) {
+    fprintf( stderr, "No mate found for %s\n", fs1->id );
+    exit( 1 );
+  }
+  strip_mate_suffix( fs1->id );
+  strip_mate_suffix( fs2->id );
+  if ( strcmp( fs1->id, fs2->id ) != 0 ) {
+    fprintf( stderr, "Mates %s and %s do not have the same id\n",
+	     fs1->id, fs2->id );
+    exit( 1 );
+  }
+
+  if ( merge_mates( fs1, fs2 ) ) {
+    return 1;
+  }
+  add_mate_suffix( fs1->id, "/1" );
+  add_mate_suffix( fs2->id, "/2" );
+  return 2;
 }
 
 /* read_fastq
-   Args 1. pointer to file to be read
+   Args 1. SeqReaderP for the file to be read
         2. pointer to FragSeq to put the sequence into
    Returns: TRUE if a sequence was read,
             FALSE if EOF
+   Sequence and quality lines longer than INIT_ALN_SEQ_LEN are
+   cut there
 */
-int read_fastq ( FILE * fastq, FragSeqP frag_seq ) {
+int read_fastq ( SeqReaderP fastq, FragSeqP frag_seq ) {
+  char* line;
+  size_t len, p, i;
+  int has_newline;
   char c;
-  size_t i;
-  c = fgetc( fastq );
+
+  c = peek_seq_reader( fastq );
   if ( c == EOF ) return 0;
   if ( c != '@' ) {
     fprintf( stderr, "While reading fastq file, saw record not beginning with @\n" );
@@ -54,110 +931,49 @@ int read_fastq ( FILE * fastq, FragSeqP frag_seq ) {
     return 0;
   }
 
-  /* get identifier */
-  i = 0;
-  while( (!isspace(c=fgetc( fastq ) ) &&
-	  (i < MAX_ID_LEN) ) ) {
-    if ( c == EOF ) {
-      return 0;
-    }
-    frag_seq->id[i] = c;
-    i++;
-    if ( i == MAX_ID_LEN ) {
-      /* Id is too long - truncate it now */
-      frag_seq->id[i] = '\0';
-    }
-  }
-  frag_seq->id[i] = '\0';
-
-  /* Now, everything else on the line is description (if anything)
-     although fastq does not appear to formally support description */
-  if ( c == '\n' ) {
-    frag_seq->desc[0] = '\0';
-  }
-  else { // some description, uh oh
-    while ( (c != '\n') &&
-	    (isspace(c)) ) {
-      c = fgetc( fastq );
-    }
-    i = 0;
-    while( (c != '\n') &&
-	   (i < MAX_DESC_LEN) ) {
-      frag_seq->desc[i++] = c;
-      c = fgetc( fastq );
-    }
-    frag_seq->desc[i] = '\0';
+  /* get identifier and description (if anything), although
+     fastq does not appear to formally support description */
+  line = next_line( fastq, &len, &has_newline );
+  if ( !has_newline ) {
+    return 0;
   }
+  parse_seq_header( line + 1, len - 1, frag_seq );
 
   /* Now, read the sequence. This should all be on a single line */
   i = 0;
-  c = fgetc( fastq );
-  while ( (c != '\n') &&
-	  (c != EOF) &&
-	  (i < INIT_ALN_SEQ_LEN) ) {
-    if ( isspace(c) ) {
-      ;
-    }
-    else {
-      c = toupper( c );
-      frag_seq->seq[i++] = c;
+  line = next_line( fastq, &len, &has_newline );
+  if ( line != NULL ) {
+    for( p = 0; (p < len) && (i < INIT_ALN_SEQ_LEN); p++ ) {
+      if ( (c = seq_char_tbl[(unsigned char)line[p]]) ) {
+	frag_seq->seq[i++] = c;
+      }
     }
-    c = fgetc( fastq );
   }
   frag_seq->seq[i] = '\0';
   frag_seq->seq_len = i;
-  /* If the reading stopped because the sequence was longer than
-     INIT_ALN_SEQ_LEN, then we need to advance the file pointer
-     past this line */
-  if ( i == INIT_ALN_SEQ_LEN ) {
-    while ( (c != '\n') &&
-	    (c != EOF) ) {
-      c = fgetc( fastq );
-    }
-  }
 
-  /* Now, read the quality score header */
-  c = fgetc( fastq );
-  if ( c != '+' ) {
+  /* Now, read the quality score header; the rest of its line
+     should be the same identifier as before or blank */
+  line = next_line( fastq, &len, &has_newline );
+  if ( (line == NULL) || (len == 0) || (line[0] != '+') ) {
     fprintf( stderr, "Problem reading quality line for %s\n", frag_seq->id );
     return 1;
   }
-  /* Zip through the rest of the line, it should be the same identifier
-     as before or blank */
-  c = fgetc( fastq );
-  while( (c != '\n') &&
-	 (c != EOF) ) {
-    c = fgetc( fastq );
-  }
 
   /* Now, get the quality score line */
-  c = fgetc( fastq );
   i = 0;
-  while( (c != '\n') &&
-	 (c != EOF) &&
-	 (i < INIT_ALN_SEQ_LEN) ) {
-    if ( isspace(c) ) {
-      ;
-    }
-    else {
-      frag_seq->qual[i++] = c;
+  frag_seq->qual_sum = 0;
+  line = next_line( fastq, &len, &has_newline );
+  if ( line != NULL ) {
+    for( p = 0; (p < len) && (i < INIT_ALN_SEQ_LEN); p++ ) {
+      if ( (c = qual_char_tbl[(unsigned char)line[p]]) ) {
+	frag_seq->qual[i++] = c;
+	frag_seq->qual_sum += c - 33;
+      }
     }
-    c = fgetc( fastq );
   }
   frag_seq->qual[i] = '\0';
 
-  frag_seq->qual_sum = calc_qual_sum( frag_seq->qual );
-
-  /* If the reading stopped because the sequence was longer than
-     INIT_ALN_SEQ_LEN, then we need to advance the file pointer
-     past this line */
-  if ( i == INIT_ALN_SEQ_LEN ) {
-    while ( (c != '\n') &&
-	    (c != EOF) ) {
-      c = fgetc( fastq );
-    }
-  }
-
   if ( i != frag_seq->seq_len ) {
     fprintf( stderr, "%s has unequal sequence and qual line lengths\n", 
 	     frag_seq->id );
@@ -166,6 +982,242 @@ int read_fastq ( FILE * fastq, FragSeqP frag_seq ) {
   return 1;
 }
 
+/* set_sam_seq
+   Args: 1. FragSeqP to fill
+         2. read name, not '\0' terminated
+	 3. its length
+	 4. FLAG of the SAM or BAM record
+	 5. the bases kept of its sequence, as in the record
+	 6. their qualities, phred+33, or NULL if there are none
+	 7. number of bases kept, up to INIT_ALN_SEQ_LEN
+	 8. 0-indexed position it is mapped to, -1 if none
+	 9. number of bases soft clipped before the alignment
+	 10. number of reference positions the alignment covers
+	 11. number of bases soft clipped after it
+   The sequence and qualities are turned back to the strand the
+   read was read from. Mates of a pair get /1 and /2 after their
+   name to keep the ids apart. A mapped record sets rc, strand_known,
+   and as and ae to where the whole read, clipped bases and all,
+   should align
+*/
+static void set_sam_seq( FragSeqP frag_seq, const char* name,
+			 size_t name_len, int flag,
+			 const char* seq, const char* qual, size_t len,
+			 int pos, int clip5, int span, int clip3 ) {
+  size_t i;
+  int rc = (flag & 0x10) ? 1 : 0;
+  char c;
+
+  if ( name_len > MAX_ID_LEN - 2 ) {
+    name_len = MAX_ID_LEN - 2;
+  }
+  memcpy( frag_seq->id, name, name_len );
+  frag_seq->id[name_len] = '\0';
+  if ( (flag & 0x1) && (flag & 0xc0) ) {
+    strcat( frag_seq->id, (flag & 0x40) ? "/1" : "/2" );
+  }
+  frag_seq->desc[0] = '\0';
+
+  for( i = 0; i < len; i++ ) {
+    c = seq_char_tbl[(unsigned char)(rc ? seq[len-1-i] : seq[i])];
+    frag_seq->seq[i] = rc ? revcom_char( c ) : c;
+  }
+  frag_seq->seq[len] = '\0';
+  frag_seq->seq_len = len;
+
+  frag_seq->qual_sum = 0;
+  if ( qual == NULL ) {
+    len = 0;
+  }
+  for( i = 0; i < len; i++ ) {
+    frag_seq->qual[i] = rc ? qual[len-1-i] : qual[i];
+    frag_seq->qual_sum += frag_seq->qual[i] - 33;
+  }
+  frag_seq->qual[len] = '\0';
+
+  if ( (flag & 0x4) || (pos < 0) ) {
+    frag_seq->strand_known = 0;
+    return;
+  }
+  frag_seq->strand_known = 1;
+  frag_seq->rc = rc;
+  frag_seq->as = (pos > clip5) ? pos - clip5 : 0;
+  frag_seq->ae = pos + ((span > 0) ? span : 1) - 1 + clip3;
+}
+
+/* sam_on_ref
+   Args: 1. SeqReaderP of the SAM input
+         2. RNAME of a record, not '\0' terminated
+	 3. its length
+   Returns: 1 if a record mapped to rname is mapped to sam->ref_id,
+            that is if it is rname, or no reference was asked for,
+            or the header has just the one; 0 otherwise
+*/
+static int sam_on_ref( SeqReaderP sam, const char* rname, size_t len ) {
+  return ( (sam->ref_id[0] == '\0') || (sam->num_refs == 1) ||
+	   ((len == strlen( sam->ref_id )) &&
+	    (memcmp( rname, sam->ref_id, len ) == 0)) );
+}
+
+int read_sam ( SeqReaderP sam, FragSeqP frag_seq ) {
+  char* line;
+  char* field[11];
+  char* tab;
+  char* cigar;
+  size_t len, seq_len, qual_len, keep, f;
+  int has_newline, flag, pos, n, clip5, clip3, span;
+
+  while( (line = next_line( sam, &len, &has_newline )) != NULL ) {
+    if ( (len >= 4) && (memcmp( line, "@SQ\t", 4 ) == 0) ) {
+      sam->num_refs++;
+    }
+    if ( (len == 0) || (line[0] == '@') ) {
+      continue;
+    }
+
+    /* QNAME FLAG RNAME POS MAPQ CIGAR RNEXT PNEXT TLEN SEQ QUAL */
+    field[0] = line;
+    for( f = 1; f < 11; f++ ) {
+      tab = (char*)memchr( field[f-1], '\t', line + len - field[f-1] );
+      if ( tab == NULL ) {
+	break;
+      }
+      field[f] = tab + 1;
+    }
+    if ( f < 11 ) {
+      fprintf( stderr, "Skipping SAM line with fewer than 11 fields\n" );
+      continue;
+    }
+    flag = atoi( field[1] );
+    seq_len = field[10] - field[9] - 1;
+    if ( (flag & 0x900) || (field[9][0] == '*') ) {
+      continue;
+    }
+    tab = (char*)memchr( field[10], '\t', line + len - field[10] );
+    qual_len = ( (tab == NULL) ? line + len : tab ) - field[10];
+    if ( (field[10][0] != '*') && (qual_len != seq_len) ) {
+      fprintf( stderr, "Skipping SAM record %.*s with unequal SEQ and "
+	       "QUAL lengths\n", (int)(field[1] - line - 1), line );
+      continue;
+    }
+
+    /* Soft clips at either end and the reference positions between */
+    clip5 = clip3 = span = 0;
+    for( cigar = field[5]; (*cigar >= '0') && (*cigar <= '9'); cigar++ ) {
+      n = strtol( cigar, &cigar, 10 );
+      if ( *cigar == 'S' ) {
+	if ( span == 0 ) clip5 += n;
+	else clip3 += n;
+      }
+      else if ( strchr( "MDN=X", *cigar ) != NULL ) {
+	span += n;
+      }
+    }
+    pos = ( field[5][0] == '*' ) ? -1 : atoi( field[3] ) - 1;
+    if ( !sam_on_ref( sam, field[2], field[3] - field[2] - 1 ) ) {
+      pos = -1; // mapped to another reference, so not to this one
+    }
+
+    /* Keep the bases at the start of the read as it was read */
+    keep = (seq_len > INIT_ALN_SEQ_LEN) ? INIT_ALN_SEQ_LEN : seq_len;
+    f = (flag & 0x10) ? seq_len - keep : 0;
+    set_sam_seq( frag_seq, line, field[1] - line - 1, flag,
+		 field[9] + f,
+		 (field[10][0] == '*') ? NULL : field[10] + f,
+		 keep, pos, clip5, span, clip3 );
+    return 1;
+  }
+  return 0;
+}
+
+int read_bam ( SeqReaderP bam, FragSeqP frag_seq ) {
+  static const char* nt16 = "=ACMGRSVTWYHKDBN";
+  char seq[INIT_ALN_SEQ_LEN + 1];
+  char qual[INIT_ALN_SEQ_LEN + 1];
+  const char* rec;
+  const char* cigar;
+  const char* bases;
+  const char* quals;
+  size_t size, seq_len, keep, first, i;
+  unsigned int op;
+  int flag, ref_id, pos, name_len, num_cigar, clip5, clip3, span, j;
+
+  while( want_seq_bytes( bam, 4 ) ) {
+    size = get_le32( bam->buf + bam->pos );
+    if ( !want_seq_bytes( bam, size + 4 ) ) {
+      if ( size + 4 > bam->size ) {
+	fprintf( stderr, "Skipping BAM record of %lu bytes\n",
+		 (unsigned long)size );
+	skip_seq_bytes( bam, size + 4 );
+	continue;
+      }
+      fprintf( stderr, "BAM input ends in the middle of a record\n" );
+      return 0;
+    }
+    rec = bam->buf + bam->pos + 4;
+    bam->pos += size + 4;
+    if ( size < 32 ) {
+      fprintf( stderr, "Skipping BAM record of %lu bytes\n",
+	       (unsigned long)size );
+      continue;
+    }
+
+    ref_id    = (int)get_le32( rec );
+    pos       = (int)get_le32( rec + 4 );
+    name_len  = (unsigned char)rec[8];
+    num_cigar = (unsigned char)rec[12] | ((unsigned char)rec[13] << 8);
+    flag      = (unsigned char)rec[14] | ((unsigned char)rec[15] << 8);
+    seq_len   = get_le32( rec + 16 );
+
+    /* The name, CIGAR, bases and qualities must all be in the record */
+    if ( (name_len == 0) ||
+	 (32 + name_len + 4 * (size_t)num_cigar + (seq_len + 1) / 2 +
+	  seq_len > size) ) {
+      fprintf( stderr, "Skipping BAM record too short for its fields\n" );
+      continue;
+    }
+    if ( (flag & 0x900) || (seq_len == 0) ) {
+      continue;
+    }
+
+    /* Mapped to another reference, so not to this one */
+    if ( (bam->ref_id[0] != '\0') && (ref_id != bam->bam_ref) &&
+	 ((bam->num_refs != 1) || (ref_id != 0)) ) {
+      pos = -1;
+    }
+    cigar = rec + 32 + name_len;
+    bases = cigar + 4 * num_cigar;
+    quals = bases + (seq_len + 1) / 2;
+
+    clip5 = clip3 = span = 0;
+    for( j = 0; j < num_cigar; j++ ) {
+      op = get_le32( cigar + 4 * j );
+      if ( (op & 0xf) == 4 ) {
+	if ( span == 0 ) clip5 += op >> 4;
+	else clip3 += op >> 4;
+      }
+      else if ( ((op & 0xf) == 0) || ((op & 0xf) == 2) ||
+		((op & 0xf) == 3) || ((op & 0xf) >= 7) ) {
+	span += op >> 4; // M, D, N, = or X
+      }
+    }
+
+    /* Keep the bases at the start of the read as it was read */
+    keep = (seq_len > INIT_ALN_SEQ_LEN) ? INIT_ALN_SEQ_LEN : seq_len;
+    first = (flag & 0x10) ? seq_len - keep : 0;
+    for( i = 0; i < keep; i++ ) {
+      seq[i] = nt16[((unsigned char)bases[(first+i)/2] >>
+		     (((first+i) % 2) ? 0 : 4)) & 0xf];
+      qual[i] = quals[first+i] + 33;
+    }
+    set_sam_seq( frag_seq, rec + 32, name_len - 1, flag, seq,
+		 ((unsigned char)quals[0] == 0xff) ? NULL : qual,
+		 keep, (num_cigar > 0) ? pos : -1, clip5, span, clip3 );
+    return 1;
+  }
+  return 0;
+}
+
 /* calc_qual_sum
    Args: 1. pointer to a string of quality scores for this sequence
    Returns: 1. int - the sum of quality scores for this sequence
@@ -186,15 +1238,20 @@ inline int calc_qual_sum( const char* qual_str ) {
 
 
 /* read_fasta
-   args 1. pointer to file to be read
+   args 1. SeqReaderP for the file to be read
         2. pointer to FragSeq to put the sequence
    returns: TRUE if sequence was read,
             FALSE if EOF or not fasta
+   Sequences longer than INIT_ALN_SEQ_LEN are cut there
 */
-int read_fasta ( FILE * fasta, FragSeqP frag_seq ) {
+int read_fasta ( SeqReaderP fasta, FragSeqP frag_seq ) {
+  char* line;
+  char* gt;
+  size_t len, n, p, i;
+  int has_newline;
   char c;
-  size_t i;
-  c = fgetc( fasta );
+
+  c = peek_seq_reader( fasta );
   if ( c == EOF ) return 0;
   if ( c != '>' ) return 0;
 
@@ -202,79 +1259,51 @@ int read_fasta ( FILE * fasta, FragSeqP frag_seq ) {
      stupid valgrind from stupid complaining */
   frag_seq->qual[0] = '\0';
 
-  // get id
-  i = 0;
-  while( (!isspace( c=fgetc( fasta ) ) &&
-	  (i < MAX_ID_LEN) ) ) {
-    if ( c == EOF ) {
-      return 0;
-    }
-    frag_seq->id[i] = c;
-    i++;
-    if ( i == MAX_ID_LEN ) {
-      //id is too long - truncate it
-      frag_seq->id[i] = '\0';
-    }
-  }
-  frag_seq->id[i] = '\0';
-
-  // everything else on this line is description, if there is anything
-  if ( c == '\n' ) {
-    frag_seq->desc[0] = '\0';
-  }
-  else { // not end of line, so skip past the stupid whitespace...
-    while( (c != '\n') &&
-	   (isspace(c)) ) {
-      c = fgetc( fasta );
-    }
-    ///...everthing else is description
-    i = 0;
-    ungetc( c, fasta );
-    while ( (c != '\n') &&
-	    (i < MAX_DESC_LEN) ) {
-      frag_seq->desc[i++] = c;
-      c = fgetc( fasta );
-    }
-    frag_seq->desc[i] = '\0';
+  // get id; everything else on this line is description
+  line = next_line( fasta, &len, &has_newline );
+  if ( !has_newline ) {
+    return 0;
   }
+  parse_seq_header( line + 1, len - 1, frag_seq );
 
-  // read sequence
+  // read sequence, which goes on until the next >, line by line
+  // or not
   i = 0;
-  c = fgetc( fasta );
-  while ( ( c != '>' ) &&
-          ( c != EOF ) &&
-	  (i < INIT_ALN_SEQ_LEN) ) {
-    if ( isspace(c) ) {
-      ;
+  while( (i < INIT_ALN_SEQ_LEN) &&
+	 ((fasta->pos < fasta->end) || fill_seq_reader( fasta )) ) {
+    line = fasta->buf + fasta->pos;
+    gt = (char*)memchr( line, '>', fasta->end - fasta->pos );
+    n = (gt != NULL) ? (size_t)(gt - line) : fasta->end - fasta->pos;
+    for( p = 0; (p < n) && (i < INIT_ALN_SEQ_LEN); p++ ) {
+      if ( (c = seq_char_tbl[(unsigned char)line[p]]) ) {
+	frag_seq->seq[i++] = c;
+      }
     }
-    else {
-      c = toupper( c );
-      frag_seq->seq[i++] = c;
+    fasta->pos += p;
+    if ( gt != NULL ) {
+      break;
     }
-    c = fgetc( fasta );
   }
   frag_seq->seq[i] = '\0';
 
   frag_seq->seq_len = i;
 
-  if ( c == '>' ) {
-    ungetc( '>', fasta );
-    return 1;
-  }
-
   /* Run up against the sequence length limit so truncate it here,
-     wind through the fasta filehandle, and return this guy */
-  if ( i == INIT_ALN_SEQ_LEN ) {
-    while ( (c != '>') &&
-	    (c != EOF) ) {
-      c = fgetc( fasta );
-    }
-    if ( c == '>' ) {
-      ungetc( '>', fasta );
+     wind through the fasta file up to the next >, and return
+     this guy */
+  if ( (i == INIT_ALN_SEQ_LEN) &&
+       (peek_seq_reader( fasta ) != '>') ) {
+    while( (fasta->pos < fasta->end) || fill_seq_reader( fasta ) ) {
+      gt = (char*)memchr( fasta->buf + fasta->pos, '>',
+			  fasta->end - fasta->pos );
+      if ( gt != NULL ) {
+	fasta->pos = gt - fasta->buf;
+	break;
+      }
+      fasta->pos = fasta->end;
     }
     fprintf( stderr, "%s is longer than allowed length: %d\n",
 	     frag_seq->id, INIT_ALN_SEQ_LEN );
-    return 1;
   }
 
   return 1;
@@ -286,10 +1315,13 @@ int read_fasta ( FILE * fasta, FragSeqP frag_seq ) {
  0 failure
  */
 int read_fasta_ref(RefSeqP ref, const char* fn) {
-  int head_done = 0;
+  SeqReaderP sr;
+  char* line;
+  char* gt;
+  size_t len, n, p;
+  int has_newline;
+  int i;
   char c;
-  int len;
-  FILE* ref_f;
 
   ref->seq = (char*)save_malloc(INIT_REF_SEQ_LEN*sizeof(char));
   ref->size = INIT_REF_SEQ_LEN;
@@ -297,81 +1329,62 @@ int read_fasta_ref(RefSeqP ref, const char* fn) {
     return 0;
   }
 
-  ref_f = fileOpen(fn, "r");
-  if (ref_f == NULL)
+  sr = open_seq_reader(fn, 1);
+  if (sr == NULL)
       return 0;
 
-
-  c = fgetc(ref_f);
-  if (c == EOF)
+  if (peek_seq_reader(sr) != '>') {
+    close_seq_reader(sr);
     return 0;
-  if (c != '>')
+  }
+
+  line = next_line(sr, &len, &has_newline);
+  if (!has_newline) {
+    close_seq_reader(sr);
     return 0;
+  }
 
   // get id
-  len = 0;
-  while ( (!isspace( c=fgetc( ref_f ) )) && !head_done) {
-    if (c == EOF) {
-      return 0;
-    }
-    ref->id[len] = c;
-    len++;
-    if (len == MAX_ID_LEN) {
-      //id is too long - truncate it
-      ref->id[len] = '\0';
-      head_done = 1;
-    }
+  p = 1;
+  i = 0;
+  while ((p < len) && !isspace(line[p]) && (i < MAX_ID_LEN)) {
+    ref->id[i++] = line[p++];
   }
-  ref->id[len] = '\0';
-
-  // Reset len and head_done to get description
-  len = 0;
-  head_done = 0;
+  ref->id[i] = '\0';
 
-  /* Check if there is no description */
-  if (c == '\n') {
-    head_done = 1;
+  // Skip the whitespace character after the id, but everything
+  // else is description
+  if ((p < len) && isspace(line[p])) {
+    p++;
   }
-  // If not, don't care about that crappy whitespace we
-  // just got
-  else {
-    c = fgetc(ref_f);
-  }
-  // But everything else is description
-  while ( (c != '\n') && !head_done) {
-    if (c == EOF) {
-      return 0;
-    }
-    ref->desc[len] = c;
-    len++;
-    if (len == MAX_DESC_LEN) {
-      // desc is too long, truncate it
-      ref->desc[len] = '\0';
-      head_done = 1;
-    }
-    c = fgetc(ref_f);
+  i = 0;
+  while ((p < len) && (i < MAX_DESC_LEN)) {
+    ref->desc[i++] = line[p++];
   }
-  ref->desc[len] = '\0';
+  ref->desc[i] = '\0';
 
-  // read sequence
-  len = 0;
-  c = fgetc(ref_f);
-  while ( (c != '>' ) && (c != EOF )) {
-    if ( isspace(c)) {
-      c = fgetc(ref_f);
-    }
-    else {
-      ref->seq[len] = c;
-      len++;
-
-      if ( !(len < ref->size)) {
-	ref->seq = grow_seq(ref->seq, ref->size);
-	ref->size = ref->size * 2;
+  // read sequence, keeping room for the terminating '\0'
+  i = 0;
+  while ((sr->pos < sr->end) || fill_seq_reader(sr)) {
+    line = sr->buf + sr->pos;
+    gt = (char*)memchr(line, '>', sr->end - sr->pos);
+    n = (gt != NULL) ? (size_t)(gt - line) : sr->end - sr->pos;
+    for (p = 0; p < n; p++) {
+      if ((c = qual_char_tbl[(unsigned char)line[p]])) {
+	ref->seq[i++] = c;
+	if (i == ref->size) {
+	  ref->seq = grow_seq(ref->seq, ref->size);
+	  ref->size = ref->size * 2;
+	}
       }
-      c = fgetc(ref_f);
     }
+    if (gt != NULL) {
+      break;
+    }
+    sr->pos = sr->end;
   }
-  fclose(ref_f);
+  close_seq_reader(sr);
+  len = i;
 
   ref->seq[ len ] = '\0';
 
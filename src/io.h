@@ -19,44 +19,120 @@ extern "C" {
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "map_align.h"
 
+/* open_seq_reader
+   Args: 1. name of the sequence file to read
+         2. number of threads for inflating BGZF input
+   Returns: a SeqReaderP for reading it, or NULL if it could
+            not be opened
+   gzip and BGZF compressed files are recognized by their first
+   bytes and inflated as they are read. fn "-" is stdin; since the
+   input is never rewound, it may be a pipe. Other uncompressed files
+   are mmapped and parsed where they are, without being read into
+   a buffer first
+*/
+SeqReaderP open_seq_reader( const char* fn, int num_threads );
+
+/* close_seq_reader
+   Args: 1. SeqReaderP to close
+   Closes its file and frees it
+*/
+void close_seq_reader( SeqReaderP sr );
+
 /* find_input_type
-   Args: 1. FILE* pointer to file to be analyzed
+   Args: 1. SeqReaderP for the file to be analyzed
    Returns: sequence code indicating what kind of sequence file
             this is:
 	    0 => fasta
 	    1 => fastq
-   Resets the input FILE pointer to the beginning of the file
+	    2 => SAM
+	    3 => BAM
+   Only peeks at the start of the input; nothing is parsed, except
+   that the header of a BAM file is skipped, leaving sr at its
+   first record, once its references are counted and the one
+   named sr->ref_id, if any, is found
 */
-  int find_input_type( FILE * FF );
+  int find_input_type( SeqReaderP sr );
 
 /* read_next_seq
-   Args: 1. FILE* pointer to file being read
+   Args: 1. SeqReaderP for the file being read
          2. FragSeqP pointer to FragSeq where the next sequence data will go
 	 3. int code indicating which parser to use
    Returns: TRUE if a sequence was read,
             FALSE if EOF
 */
 
-  int read_next_seq( FILE * FF, FragSeqP frag_seq, int seq_code );
+  int read_next_seq( SeqReaderP sr, FragSeqP frag_seq, int seq_code );
+
+/* read_next_pair
+   Args: 1. SeqReaderP for the first reads of pairs
+         2. SeqReaderP for the second reads; the same as 1. if the
+	    mates are interleaved in one file
+	 3. FragSeqP for the first read, or both merged
+	 4. FragSeqP for the second read
+	 5. int code indicating which parser to use for 1.
+	 6. int code indicating which parser to use for 2.
+   Returns: 0 if EOF,
+            1 if the mates overlapped and were merged into fs1,
+	    2 if they did not, and are in fs1 and fs2
+   Mates are merged into the insert they were read from, which
+   also clips adapter read through past its end. Merged mates
+   keep their id, without any /1 or /2; unmerged ones get /1 and /2
+   after it. Exits if the mates do not have the same id, or one
+   file ends before the other
+*/
+  int read_next_pair( SeqReaderP sr1, SeqReaderP sr2, FragSeqP fs1,
+		      FragSeqP fs2, int seq_code1, int seq_code2 );
 
 /* read_fasta
-   args 1. pointer to file to be read
+   args 1. SeqReaderP for the file to be read
         2. pointer to FragSeq to put the sequence
    returns: TRUE if sequence was read,
             FALSE if EOF or not fasta
+   Sequences longer than INIT_ALN_SEQ_LEN are cut there
 */
-int read_fasta ( FILE * fasta, FragSeqP frag_seq );
+int read_fasta ( SeqReaderP fasta, FragSeqP frag_seq );
 
 /* read_fastq
-   Args 1. pointer to file to be read
+   Args 1. SeqReaderP for the file to be read
         2. pointer to FragSeq to put the sequence into
    Returns: TRUE if a sequence was read,
             FALSE if EOF
+   Sequence and quality lines longer than INIT_ALN_SEQ_LEN are
+   cut there
 */
 
-int read_fastq ( FILE * fastq, FragSeqP frag_seq );
+int read_fastq ( SeqReaderP fastq, FragSeqP frag_seq );
+
+/* read_sam
+   Args 1. SeqReaderP for the SAM file to be read
+        2. pointer to FragSeq to put the sequence into
+   Returns: TRUE if a sequence was read,
+            FALSE if EOF
+   Header lines, secondary and supplementary records and records
+   without a sequence are skipped, as are records whose QUAL is not
+   as long as their SEQ. The sequence is turned back to the strand
+   it was read from. A record mapped to sam->ref_id, or to the only
+   reference of the header, also gives the strand and reference
+   region it was mapped to in the rc, as and ae fields, and sets
+   strand_known; one mapped to another reference is read as if it
+   were unmapped
+*/
+int read_sam ( SeqReaderP sam, FragSeqP frag_seq );
+
+/* read_bam
+   Args 1. SeqReaderP for the BAM file to be read, past its header
+        2. pointer to FragSeq to put the sequence into
+   Returns: TRUE if a sequence was read,
+            FALSE if EOF
+   The same as read_sam, for the records of a BAM file. Records too
+   short for the name, CIGAR, bases and qualities they say they
+   have are skipped
+*/
+int read_bam ( SeqReaderP bam, FragSeqP frag_seq );
 
 /* calc_qual_sum
    Args: 1. pointer to a string of quality scores for this sequence
@@ -47,6 +47,123 @@ int kmer2inx( const char* kmer,
   return 1; // valid!
 }
 
+/* seed2inx
+   Args: (1) a pointer to a character string; the beginning of
+             the stretch of sequence covered by the seed;
+             might not be null-terminated
+         (2) SeedP describing which positions to look at
+         (3) pointer to size_t to put the index
+   Returns: TRUE if the index was set, FALSE if it could not
+            be set because of some non A,C,G,T character at a
+            position that is looked at
+   Like kmer2inx, but only the '1' positions of the seed pattern
+   are used. If seed->ry, each position contributes a single bit:
+   0 for purines (A,G) and 1 for pyrimidines (C,T)
+*/
+int seed2inx( const char* kmer,
+	      const SeedP seed,
+	      size_t* inx ) {
+  size_t l_inx = 0;
+  size_t code;
+  int i;
+
+  for( i = 0; i < seed->span; i++ ) {
+    if ( seed->pattern[i] == '0' ) {
+      continue;
+    }
+    switch( toupper(kmer[i]) ) {
+    case 'A' :
+      code = 0;
+      break;
+    case 'C' :
+      code = 1;
+      break;
+    case 'G' :
+      code = 2;
+      break;
+    case 'T' :
+      code = 3;
+      break;
+    default :
+      return 0; // not valid!
+    }
+    if ( seed->ry ) {
+      l_inx = (l_inx << 1) + (code & 1);
+    }
+    else {
+      l_inx = (l_inx << 2) + code;
+    }
+  }
+  *inx = l_inx;
+  return 1; // valid!
+}
+
+/* init_seed
+   Args: (1) seed pattern of '1' (look at) and '0' (don't care)
+             characters; if NULL, a contiguous kmer is used
+         (2) length of contiguous kmer if pattern is NULL
+         (3) boolean; TRUE => purine/pyrimidine alphabet
+   Returns: pointer to a newly allocated Seed
+   Exits if the pattern is not sensible or the index it implies
+   would be too big
+*/
+SeedP init_seed( const char* pattern, const int kmer_len, const int ry ) {
+  SeedP seed;
+  int i;
+
+  seed = (SeedP)save_malloc(sizeof(Seed));
+  if ( pattern == NULL ) {
+    if ( (kmer_len < 1) || (kmer_len > MAX_SEED_SPAN) ) {
+      fprintf( stderr, "Cannot use kmer length %d\n", kmer_len );
+      exit( 2 );
+    }
+    memset( seed->pattern, '1', kmer_len );
+    seed->pattern[kmer_len] = '\0';
+  }
+  else {
+    if ( strlen( pattern ) > MAX_SEED_SPAN ) {
+      fprintf( stderr, "Cannot use seed pattern longer than %d\n",
+	       MAX_SEED_SPAN );
+      exit( 2 );
+    }
+    strcpy( seed->pattern, pattern );
+  }
+
+  seed->span   = strlen( seed->pattern );
+  seed->weight = 0;
+  for( i = 0; i < seed->span; i++ ) {
+    if ( seed->pattern[i] == '1' ) {
+      seed->weight++;
+    }
+    else if ( seed->pattern[i] != '0' ) {
+      fprintf( stderr, "Seed pattern %s may only contain 0 and 1\n",
+	       seed->pattern );
+      exit( 2 );
+    }
+  }
+  if ( (seed->weight == 0) ||
+       (seed->pattern[0] != '1') ||
+       (seed->pattern[seed->span - 1] != '1') ) {
+    fprintf( stderr, "Seed pattern %s must begin and end with 1\n",
+	     seed->pattern );
+    exit( 2 );
+  }
+
+  seed->ry = ry;
+  if ( ry ) {
+    seed->bits = seed->weight;
+  }
+  else {
+    seed->bits = 2 * seed->weight;
+  }
+  if ( seed->bits > 2*MAX_KMER_LEN ) {
+    fprintf( stderr, "Cannot use seeds looking at more than %d bases\n",
+	     ry ? 2*MAX_KMER_LEN : MAX_KMER_LEN );
+    exit( 2 );
+  }
+  return seed;
+}
+
 
 /* add_kmer
    Args: (1) KPL* kmer array
@@ -58,7 +175,9 @@ int kmer2inx( const char* kmer,
    for this operation, we really do not care. We simply add
    the position to the positions field of this kmer. If this
    kmer has never been seen before, then we have to
-   initialize it, too.
+   initialize it, too. The count field is incremented for
+   every occurrence, even those past MAX_KMER_POS whose
+   positions are dropped.
 */
 void add_kmer( KPL* kpa, const size_t inx, const size_t i ) {
 
@@ -67,9 +186,13 @@ void add_kmer( KPL* kpa, const size_t inx, const size_t i ) {
     /* Never seen this kmer before, so set it up */
     kpa[inx] = (KPL)save_malloc(sizeof(KmerPosList));
     kpa[inx]->num_pos = 0;
+    kpa[inx]->count   = 0;
     kpa[inx]->sorted  = 0;
   }
 
+  /* Always count it, even if we cannot remember where it is */
+  kpa[inx]->count++;
+
   /* Check to make sure we're not over the maximum number
      of allowable positions for this kmer */
   if ( kpa[inx]->num_pos == MAX_KMER_POS ) {
@@ -84,23 +207,19 @@ void add_kmer( KPL* kpa, const size_t inx, const size_t i ) {
   return;
 }
 /* init_kpa
-   Args: (1) length of kmers to use
+   Args: (1) SeedP describing the kmers to use
    Returns: pointer to KPL; an array of pointers to KmerPosList
+            big enough for every index of this seed
 */
-KPL* init_kpa( const int kmer_len ) {
+KPL* init_kpa( const SeedP seed ) {
   KPL* kpa;
-  unsigned int size = 1;
-  if ( kmer_len > MAX_KMER_LEN ) {
-    fprintf( stderr, "Cannot use kmer length greater than %d\n",
-	     MAX_KMER_LEN );
-    exit( 2 );
-  }
-  size = size << (2*kmer_len);
+  size_t size = 1;
+  size = size << seed->bits;
   kpa = (KPL*)calloc(size, sizeof(KPL));
   if ( kpa == NULL ) {
     fprintf( stderr,
-	     "Not enough memories for kmers of length %d\n",
-	     kmer_len );
+	     "Not enough memories for kmers of seed %s\n",
+	     seed->pattern );
     exit( 1 );
   }
   return kpa;
@@ -149,17 +268,27 @@ inline int all_upper( const char* seq, const int kmer_len ) {
 
 
 /* populate_kpa
+   Args: (1) KPL* kmer array made by init_kpa for this seed
+         (2) sequence to index
+         (3) length of sequence
+         (4) SeedP describing the kmers
+         (5) boolean; TRUE => skip kmers with lower-case bases
+   Returns: 1
+   Adds every kmer of seq to kpa
  */
 int populate_kpa( KPL* kpa, const char* seq,
 		  const size_t seq_len,
-		  const int kmer_len,
+		  const SeedP seed,
 		  const int soft_mask ) {
   size_t i, inx;
-  for( i = 0; i <= (seq_len - kmer_len); i++ ) {
+  if ( seq_len < seed->span ) {
+    return 1;
+  }
+  for( i = 0; i <= (seq_len - seed->span); i++ ) {
     /* Add this kmer if we're not check for softmasking or
        if we are and it passes the test */
-    if ( !soft_mask || all_upper(&seq[i], kmer_len) ) {
-      if ( kmer2inx( &seq[i], kmer_len, &inx ) ) {
+    if ( !soft_mask || all_upper(&seq[i], seed->span) ) {
+      if ( seed2inx( &seq[i], seed, &inx ) ) {
 	add_kmer( kpa, inx, i );
       }
     }
@@ -167,6 +296,26 @@ int populate_kpa( KPL* kpa, const char* seq,
   return 1;
 }
 
+/* count_repeat_kmers
+   Args: (1) KPL* kmer array
+         (2) SeedP of the kmers in this array
+         (3) maximum number of occurrences for a kmer to be
+             considered non-repetitive
+   Returns: number of distinct kmers in the array that occur
+            more than max_kmer_freq times
+*/
+size_t count_repeat_kmers( KPL* kpa, const SeedP seed,
+			   const size_t max_kmer_freq ) {
+  size_t inx, size, num_repeat = 0;
+  size = ((size_t)1) << seed->bits;
+  for( inx = 0; inx < size; inx++ ) {
+    if ( (kpa[inx] != NULL) &&
+	 (kpa[inx]->count > max_kmer_freq) ) {
+      num_repeat++;
+    }
+  }
+  return num_repeat;
+}
 
 
 /* pop_kmers
@@ -232,31 +381,356 @@ KmersP pop_kmers( RefSeqP ref, int kmer_filt_len ) {
 }
 
 
-/* Returns: TRUE (1) if we should align this sequence
+/* mask_alignment
+   Args: (1) AlignmentP
+   Returns: void
+   Masks every column of the alignment in constant time by moving
+   on to a new mask_epoch. Only when the epoch counter wraps around
+   does the align_mask array itself have to be cleared
+*/
+void mask_alignment( AlignmentP a ) {
+  a->mask_all = 0;
+  a->mask_epoch++;
+  if ( a->mask_epoch == 0 ) {
+    memset( a->align_mask, 0, a->mask_size * sizeof(unsigned int) );
+    a->mask_epoch = 1;
+  }
+}
+
+/* unmask_alignment
+   Args: (1) AlignmentP
+   Returns: void
+   Lets the alignment go through every column, in constant time
+*/
+void unmask_alignment( AlignmentP a ) {
+  a->mask_all = 1;
+}
+
+/* unmask_align_region
+   Args: (1) AlignmentP
+         (2) first column to unmask
+         (3) last column to unmask
+   Returns: void
+   Stamps columns mask_min to mask_max with the current mask_epoch
+*/
+void unmask_align_region( AlignmentP a, const int mask_min,
+			  const int mask_max ) {
+  int col;
+  for( col = mask_min; col <= mask_max; col++ ) {
+    a->align_mask[col] = a->mask_epoch;
+  }
+}
+
+/* bloom_hash
+   Args: (1) kmer index
+         (2) salt to keep indices of different seeds apart
+   Returns: 64 bit hash of the index; the low and high halves
+            are used as the two hashes for double hashing
+*/
+static uint64_t bloom_hash( const size_t inx, const int salt ) {
+  uint64_t h = ((uint64_t)inx << 1) + salt;
+  h += 0x9E3779B97F4A7C15ULL;
+  h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+  return h ^ (h >> 31);
+}
+
+/* bloom_add
+   Args: (1) KmerFilterP with bloom allocated
+         (2) kmer index
+         (3) salt; 0 for seed indices, 1 for end_seed indices
+   Returns: void
+*/
+static void bloom_add( KmerFilterP kf, const size_t inx, const int salt ) {
+  uint64_t h, h1, h2;
+  size_t bit;
+  int i;
+  h  = bloom_hash( inx, salt );
+  h1 = h & 0xFFFFFFFFULL;
+  h2 = (h >> 32) | 1;
+  for( i = 0; i < kf->bloom_hashes; i++ ) {
+    bit = (h1 + i * h2) % kf->bloom_bits;
+    kf->bloom[bit >> 3] |= (1 << (bit & 7));
+  }
+}
+
+/* bloom_check
+   Args: (1) KmerFilterP with bloom populated
+         (2) kmer index
+         (3) salt; 0 for seed indices, 1 for end_seed indices
+   Returns: FALSE (0) if this index is certainly not in the kmer arrays
+            TRUE (1) if it might be
+*/
+static int bloom_check( const KmerFilterP kf, const size_t inx,
+			const int salt ) {
+  uint64_t h, h1, h2;
+  size_t bit;
+  int i;
+  h  = bloom_hash( inx, salt );
+  h1 = h & 0xFFFFFFFFULL;
+  h2 = (h >> 32) | 1;
+  for( i = 0; i < kf->bloom_hashes; i++ ) {
+    bit = (h1 + i * h2) % kf->bloom_bits;
+    if ( !(kf->bloom[bit >> 3] & (1 << (bit & 7))) ) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* populate_bloom
+   Args: (1) KmerFilterP with bloom allocated
+         (2) sequence to add
+         (3) length of sequence
+         (4) SeedP describing the kmers
+         (5) salt; 0 for seed indices, 1 for end_seed indices
+         (6) boolean; TRUE => skip kmers with lower-case bases
+   Returns: void
+   Adds every kmer of seq that populate_kpa would add to the Bloom filter
+*/
+static void populate_bloom( KmerFilterP kf, const char* seq,
+			    const size_t seq_len, const SeedP seed,
+			    const int salt, const int soft_mask ) {
+  size_t i, inx;
+  if ( seq_len < seed->span ) {
+    return;
+  }
+  for( i = 0; i <= (seq_len - seed->span); i++ ) {
+    if ( !soft_mask || all_upper(&seq[i], seed->span) ) {
+      if ( seed2inx( &seq[i], seed, &inx ) ) {
+	bloom_add( kf, inx, salt );
+      }
+    }
+  }
+}
+
+/* bloom_fp_rate
+   Args: (1) KmerFilterP with bloom populated
+   Returns: expected false positive rate of the Bloom filter, i.e.,
+            the fraction of set bits to the power of the number
+            of hashes
+*/
+double bloom_fp_rate( const KmerFilterP kf ) {
+  size_t i, num_set = 0;
+  for( i = 0; i < kf->bloom_bits; i++ ) {
+    if ( kf->bloom[i >> 3] & (1 << (i & 7)) ) {
+      num_set++;
+    }
+  }
+  return pow( (double)num_set / (double)kf->bloom_bits, kf->bloom_hashes );
+}
+
+/* init_kmer_filter
+   Args: (1) RefSeqP with seq and rcseq (including any wrap-around
+             sequence) set up, but not yet upper-cased
+         (2) SeedP for the kmers to look up
+         (3) boolean; TRUE => also make purine/pyrimidine indices
+             for damage tolerant lookup of fragment ends. Their
+             end_seed is a contiguous kmer of twice the weight of
+             seed, up to 2*MAX_KMER_LEN, so that it has as many
+             index bits as seed and is as unlikely to be found by
+             chance
+         (4) boolean; TRUE => do not use kmers with lower-case bases
+         (5) maximum number of occurrences in the reference for
+             a kmer to be considered non-repetitive
+   Returns: pointer to a newly allocated KmerFilter
+   The Bloom filter is sized for all kmers going into the arrays
+   at BLOOM_BITS_PER_KMER bits each. If ref->rcseq is NULL, only
+   the forward arrays are made; such a filter can be used with
+   kmer_localize, but not with new_kmer_filter
+*/
+KmerFilterP init_kmer_filter( RefSeqP ref, SeedP seed,
+			      const int damage_tolerant,
+			      const int soft_mask,
+			      const size_t max_kmer_freq ) {
+  KmerFilterP kf;
+  size_t num_kmers;
+  int ry_len;
+  kf = (KmerFilterP)save_malloc(sizeof(KmerFilter));
+  kf->seed = seed;
+  kf->max_kmer_freq = max_kmer_freq;
+  kf->end_len = DAMAGE_END_LEN;
+
+  /* Forward and reverse complement kmers, twice if the end_seed
+     arrays are made, too */
+  num_kmers = ref->wrap_seq_len + 1;
+  if ( ref->rcseq != NULL ) {
+    num_kmers *= 2;
+  }
+  if ( damage_tolerant ) {
+    num_kmers *= 2;
+  }
+  kf->bloom_bits = ((num_kmers * BLOOM_BITS_PER_KMER + 63) / 64) * 64;
+  kf->bloom_hashes = (int)(BLOOM_BITS_PER_KMER * M_LN2 + 0.5);
+  kf->bloom = (unsigned char*)calloc(kf->bloom_bits / 8,
+				     sizeof(unsigned char));
+  if ( kf->bloom == NULL ) {
+    fprintf( stderr, "Not enough memories for the kmer Bloom filter\n" );
+    exit( 1 );
+  }
+
+  kf->fkpa = init_kpa( seed );
+  populate_kpa( kf->fkpa, ref->seq, ref->wrap_seq_len,
+		seed, soft_mask );
+  populate_bloom( kf, ref->seq, ref->wrap_seq_len, seed, 0, soft_mask );
+  kf->rkpa = NULL;
+  if ( ref->rcseq != NULL ) {
+    kf->rkpa = init_kpa( seed );
+    populate_kpa( kf->rkpa, ref->rcseq, ref->wrap_seq_len,
+		  seed, soft_mask );
+    populate_bloom( kf, ref->rcseq, ref->wrap_seq_len, seed, 0, soft_mask );
+  }
+
+  if ( damage_tolerant ) {
+    ry_len = 2 * seed->weight;
+    if ( ry_len > 2*MAX_KMER_LEN ) {
+      ry_len = 2*MAX_KMER_LEN;
+    }
+    kf->end_seed = init_seed( NULL, ry_len, 1 );
+    kf->end_fkpa = init_kpa( kf->end_seed );
+    populate_kpa( kf->end_fkpa, ref->seq, ref->wrap_seq_len,
+		  kf->end_seed, soft_mask );
+    populate_bloom( kf, ref->seq, ref->wrap_seq_len,
+		    kf->end_seed, 1, soft_mask );
+    kf->end_rkpa = NULL;
+    if ( ref->rcseq != NULL ) {
+      kf->end_rkpa = init_kpa( kf->end_seed );
+      populate_kpa( kf->end_rkpa, ref->rcseq, ref->wrap_seq_len,
+		    kf->end_seed, soft_mask );
+      populate_bloom( kf, ref->rcseq, ref->wrap_seq_len,
+		      kf->end_seed, 1, soft_mask );
+    }
+  }
+  else {
+    kf->end_seed = NULL;
+    kf->end_fkpa = NULL;
+    kf->end_rkpa = NULL;
+  }
+  return kf;
+}
+
+/* find_kmer_hits
+   Args: (1) fragment sequence
+         (2) position of the kmer in the fragment
+         (3) length of the fragment
+         (4) KmerFilterP
+         (5) pointer to KPL to set to the forward hits or NULL
+         (6) pointer to KPL to set to the reverse hits or NULL
+   Returns: TRUE (1) if any lookup got past the Bloom filter
+            FALSE (0) if the kmer arrays were not touched at all
+   Looks up the kmer at frag_pos. If it has no exact hit, and the
+   longer end_seed kmer at frag_pos fits in the fragment and touches
+   its damage prone ends, the damage tolerant end_seed indices are
+   tried instead. Indices that the Bloom filter rejects are never
+   looked up.
+*/
+static int find_kmer_hits( const char* frag, const size_t frag_pos,
+			   const size_t frag_len, const KmerFilterP kf,
+			   KPL* fkpl, KPL* rkpl ) {
+  size_t inx;
+  int bloom_pass = 0;
+  *fkpl = NULL;
+  *rkpl = NULL;
+  if ( seed2inx( &frag[frag_pos], kf->seed, &inx ) &&
+       bloom_check( kf, inx, 0 ) ) {
+    bloom_pass = 1;
+    *fkpl = kf->fkpa[inx];
+    *rkpl = kf->rkpa[inx];
+  }
+  if ( (kf->end_seed != NULL) &&
+       ((*fkpl == NULL) || (*rkpl == NULL)) &&
+       (frag_pos + kf->end_seed->span <= frag_len) &&
+       ((frag_pos < kf->end_len) ||
+	(frag_pos + kf->end_seed->span + kf->end_len > frag_len)) &&
+       seed2inx( &frag[frag_pos], kf->end_seed, &inx ) &&
+       bloom_check( kf, inx, 1 ) ) {
+    bloom_pass = 1;
+    if ( *fkpl == NULL ) {
+      *fkpl = kf->end_fkpa[inx];
+    }
+    if ( *rkpl == NULL ) {
+      *rkpl = kf->end_rkpa[inx];
+    }
+  }
+  return bloom_pass;
+}
+
+/* unmask_kmer_hits
+   Args: (1) KPL for this kmer; must not be NULL
+         (2) position of the kmer in the fragment
+         (3) length of the fragment
+         (4) AlignmentP whose align_mask should be updated
+         (5) Boolean; TRUE => kpl is from the reverse complement index,
+             whose regions end one position sooner
+   Returns: void
+   Unmasks the region of the reference surrounding every known
+   position of this kmer, padded by ALIGN_MASK_BUFFER on each side
+*/
+static void unmask_kmer_hits( const KPL kpl, const size_t frag_pos,
+			      const size_t frag_len, AlignmentP a,
+			      const int rc ) {
+  size_t i, ref_pos;
+  int mask_min, mask_max; // Sometimes these become negative
+  for( i = 0; i < kpl->num_pos; i++ ) {
+    ref_pos = kpl->positions[i];
+    mask_min = ref_pos - frag_pos - ALIGN_MASK_BUFFER;
+    if ( mask_min < 0 ) {
+      mask_min = 0;
+    }
+    mask_max = ref_pos + (frag_len - frag_pos) + ALIGN_MASK_BUFFER;
+    if ( rc ) {
+      mask_max--;
+    }
+    if ( mask_max >= a->len1 ) {
+      mask_max = (a->len1 - 1);
+    }
+    unmask_align_region( a, mask_min, mask_max );
+  }
+}
+
+/* new_kmer_filter
+   Args: (1) FragSeqP of the sequence to be filtered
+         (2) KmerFilterP with the reference kmer indices;
+             NULL means no kmer filtering
+         (3) AlignmentP for the forward alignment
+         (4) AlignmentP for the reverse complement alignment
+         (5) pointer to int; set to KMER_HITS_UNIQUE, KMER_HITS_REPEAT,
+             KMER_HITS_NONE or KMER_HITS_BLOOM to say what was found
+   Kmers occurring more than kf->max_kmer_freq times in the reference
+   are repetitive and are skipped while unique kmers are around.
+   If a sequence hits nothing but repetitive kmers, they are used
+   after all; if any of them occurs more often than we have
+   positions for, the whole reference is unmasked.
+   Returns: TRUE (1) if we should align this sequence
             FALSE (0) if we should NOT align this sequence because
                       it shares no kmers with the reference
 */
 int new_kmer_filter( FragSeqP fs,
-		     KPL* fkpa,
-		     KPL* rkpa,
-		     int kmer_len,
+		     KmerFilterP kf,
 		     AlignmentP fwa,
-		     AlignmentP rca ) {
-  size_t frag_len, frag_pos, inx, ref_len, ref_pos, i;
-  int mask_min, mask_max; // Sometimes these become negative
+		     AlignmentP rca,
+		     int* hit_type ) {
+  size_t frag_len, frag_pos;
+  KPL fkpl, rkpl;
   unsigned int num_f_kmers_found = 0;
   unsigned int num_r_kmers_found = 0;
+  unsigned int num_repeat_found  = 0;
+  int bloom_pass = 0;
+  int f_overflow = 0;
+  int r_overflow = 0;
+
+  *hit_type = KMER_HITS_UNIQUE;
 
   /* Check for no kmer filtering */
-  if ( kmer_len < 0 ) {
-    memset( fwa->align_mask, 1, fwa->len1 );
-    memset( fwa->align_mask, 1, rca->len1 );
+  if ( kf == NULL ) {
+    unmask_alignment( fwa );
+    unmask_alignment( rca );
     return 1;
   }
 
   /* Reset the alignment masks */
-  memset( fwa->align_mask, 0, fwa->len1 );
-  memset( rca->align_mask, 0, rca->len1 );
+  mask_alignment( fwa );
+  mask_alignment( rca );
 
   /* How long is this fragment? */
   if ( fs->trimmed ) {
@@ -266,68 +740,190 @@ int new_kmer_filter( FragSeqP fs,
     frag_len = fs->seq_len;
   }
 
-  if ( frag_len < kmer_len ) {
+  if ( frag_len < kf->seed->span ) {
+    *hit_type = KMER_HITS_NONE;
     return 0;
   }
 
-  /* Zip through all the kmers in this fragment sequence. If any
-     are present in the forward or reverse kpa's, then we pass
-     the filter, i.e., return 1 */
-  for( frag_pos = 0; frag_pos <= (frag_len - kmer_len); frag_pos++ ) {
-    if ( kmer2inx( &fs->seq[frag_pos], kmer_len, &inx ) ) {
-      if ( fkpa[inx] != NULL ) {
-	ref_len = fwa->len1;
-	/* There are some kmers here. Add them to the total
-	   count and update the align_mask */
-	num_f_kmers_found += fkpa[inx]->num_pos;
+  /* Zip through all the kmers in this fragment sequence. Unique
+     kmers found in the forward or reverse kpa's unmask the
+     region around them. Repetitive ones are just counted for now */
+  for( frag_pos = 0; frag_pos <= (frag_len - kf->seed->span); frag_pos++ ) {
+    bloom_pass |= find_kmer_hits( fs->seq, frag_pos, frag_len, kf,
+				  &fkpl, &rkpl );
+    if ( fkpl != NULL ) {
+      if ( fkpl->count > kf->max_kmer_freq ) {
+	num_repeat_found++;
+      }
+      else if ( num_f_kmers_found < KMER_SATURATE ) {
+	num_f_kmers_found += fkpl->num_pos;
 	if ( num_f_kmers_found >= KMER_SATURATE ) {
-	  memset( fwa->align_mask, 1, fwa->len1 );
+	  unmask_alignment( fwa );
 	}
-
-	for( i = 0; i < fkpa[inx]->num_pos; i++ ) {
-	  /* Unmask the region surrounding this kmer */
-	  ref_pos = fkpa[inx]->positions[i];
-	  mask_min = ref_pos - frag_pos - ALIGN_MASK_BUFFER;
-	  if ( mask_min < 0 ) {
-	    mask_min = 0;
-	  }
-	  mask_max = ref_pos + (frag_len - frag_pos) + ALIGN_MASK_BUFFER;
-	  if ( mask_max >= ref_len ) {
-	    mask_max = (ref_len - 1);
-	  }
-	  memset( &fwa->align_mask[mask_min], 1, (mask_max-mask_min+1) );
+	else {
+	  unmask_kmer_hits( fkpl, frag_pos, frag_len, fwa, 0 );
 	}
       }
+    }
 
-      if ( rkpa[inx] != NULL ) {
-	ref_len = rca->len1;
-	/* There are some kmers here. Add them to the total
-	   count and update the align_mask */
-	num_r_kmers_found += rkpa[inx]->num_pos;
+    if ( rkpl != NULL ) {
+      if ( rkpl->count > kf->max_kmer_freq ) {
+	num_repeat_found++;
+      }
+      else if ( num_r_kmers_found < KMER_SATURATE ) {
+	num_r_kmers_found += rkpl->num_pos;
 	if ( num_r_kmers_found >= KMER_SATURATE ) {
-	  memset( rca->align_mask, 1, rca->len1 );
+	  unmask_alignment( rca );
+	}
+	else {
+	  unmask_kmer_hits( rkpl, frag_pos, frag_len, rca, 1 );
 	}
+      }
+    }
+  }
+
+  if ( (num_f_kmers_found + num_r_kmers_found) > 0 ) {
+    return (num_f_kmers_found + num_r_kmers_found);
+  }
+
+  if ( num_repeat_found == 0 ) {
+    /* Nothing in common with the reference */
+    if ( bloom_pass ) {
+      *hit_type = KMER_HITS_NONE;
+    }
+    else {
+      *hit_type = KMER_HITS_BLOOM;
+    }
+    return 0;
+  }
+
+  /* Only repetitive kmers were found. Fall back to using them,
+     but give up on localizing the alignment on a strand where
+     some of their positions were never recorded */
+  *hit_type = KMER_HITS_REPEAT;
+  for( frag_pos = 0; frag_pos <= (frag_len - kf->seed->span); frag_pos++ ) {
+    find_kmer_hits( fs->seq, frag_pos, frag_len, kf, &fkpl, &rkpl );
+    if ( (fkpl != NULL) && !f_overflow ) {
+      if ( fkpl->count > fkpl->num_pos ) {
+	f_overflow = 1;
+	unmask_alignment( fwa );
+      }
+      else {
+	unmask_kmer_hits( fkpl, frag_pos, frag_len, fwa, 0 );
+      }
+    }
+    if ( (rkpl != NULL) && !r_overflow ) {
+      if ( rkpl->count > rkpl->num_pos ) {
+	r_overflow = 1;
+	unmask_alignment( rca );
+      }
+      else {
+	unmask_kmer_hits( rkpl, frag_pos, frag_len, rca, 1 );
+      }
+    }
+  }
+  return num_repeat_found;
+}
+
+/* kmer_localize
+   Args: (1) sequence to localize
+         (2) length of sequence
+         (3) KmerFilterP; only the forward arrays are used
+         (4) AlignmentP with a->seq1 and a->len1 set to the whole
+             sequence indexed in kf->fkpa
+   Returns: number of kmers found; 0 => sequence shares no kmers
+            with the reference and need not be aligned
+   Sets the align_mask of a to the regions of the reference around
+   kmers shared with seq, the same way new_kmer_filter does for
+   one strand
+*/
+int kmer_localize( const char* seq, const size_t seq_len,
+		   const KmerFilterP kf, AlignmentP a ) {
+  size_t pos, inx;
+  KPL kpl;
+  unsigned int num_kmers_found = 0;
+  unsigned int num_repeat_found = 0;
+
+  mask_alignment( a );
+  if ( seq_len < kf->seed->span ) {
+    return 0;
+  }
 
-	for( i = 0; i < rkpa[inx]->num_pos; i++ ) {
-	  /* Unmask the region surrounding this kmer */
-	  ref_pos = rkpa[inx]->positions[i];
-	  mask_min = ref_pos - frag_pos - ALIGN_MASK_BUFFER;
-	  if ( mask_min < 0 ) {
-	    mask_min = 0;
-	  }
-
-	  mask_max = ref_pos + frag_len - frag_pos - 1 + ALIGN_MASK_BUFFER;
-	  if ( mask_max >= ref_len ) {
-	    mask_max = (ref_len - 1);
-	  }
-	  memset( &rca->align_mask[mask_min], 1, (mask_max-mask_min+1) );
+  for( pos = 0; pos <= (seq_len - kf->seed->span); pos++ ) {
+    if ( seed2inx( &seq[pos], kf->seed, &inx ) &&
+	 bloom_check( kf, inx, 0 ) &&
+	 ((kpl = kf->fkpa[inx]) != NULL) ) {
+      if ( kpl->count > kf->max_kmer_freq ) {
+	num_repeat_found++;
+      }
+      else if ( num_kmers_found < KMER_SATURATE ) {
+	num_kmers_found += kpl->num_pos;
+	if ( num_kmers_found >= KMER_SATURATE ) {
+	  unmask_alignment( a );
+	}
+	else {
+	  unmask_kmer_hits( kpl, pos, seq_len, a, 0 );
 	}
       }
     }
   }
 
-  /* Return 0 if no kmers found; TRUE (not 0) if some kmers found */
-  return (num_f_kmers_found + num_r_kmers_found);
+  if ( (num_kmers_found > 0) || (num_repeat_found == 0) ) {
+    return num_kmers_found;
+  }
+
+  /* Only repetitive kmers; use them after all */
+  for( pos = 0; pos <= (seq_len - kf->seed->span); pos++ ) {
+    if ( seed2inx( &seq[pos], kf->seed, &inx ) &&
+	 bloom_check( kf, inx, 0 ) &&
+	 ((kpl = kf->fkpa[inx]) != NULL) ) {
+      if ( kpl->count > kpl->num_pos ) {
+	unmask_alignment( a );
+	break;
+      }
+      unmask_kmer_hits( kpl, pos, seq_len, a, 0 );
+    }
+  }
+  return num_repeat_found;
+}
+
+/* free_kpa
+   Args: (1) KPL* kmer array made by init_kpa
+         (2) SeedP it was made for
+   Returns: void
+   Frees all KmerPosLists in kpa and kpa itself
+*/
+void free_kpa( KPL* kpa, const SeedP seed ) {
+  size_t inx, size;
+  if ( kpa == NULL ) {
+    return;
+  }
+  size = ((size_t)1) << seed->bits;
+  for( inx = 0; inx < size; inx++ ) {
+    free( kpa[inx] );
+  }
+  free( kpa );
+}
+
+/* free_kmer_filter
+   Args: (1) KmerFilterP made by init_kmer_filter
+   Returns: void
+   Frees the kmer arrays, the Bloom filter and the end_seed; the
+   seed itself belongs to the caller
+*/
+void free_kmer_filter( KmerFilterP kf ) {
+  if ( kf == NULL ) {
+    return;
+  }
+  free_kpa( kf->fkpa, kf->seed );
+  free_kpa( kf->rkpa, kf->seed );
+  if ( kf->end_seed != NULL ) {
+    free_kpa( kf->end_fkpa, kf->end_seed );
+    free_kpa( kf->end_rkpa, kf->end_seed );
+    free( kf->end_seed );
+  }
+  free( kf->bloom );
+  free( kf );
 }
 
 int kmer_filter( int kmer_filt_len, FragSeqP fs, KmersP k ) {
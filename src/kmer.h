@@ -15,8 +15,18 @@ extern "C" {
 #include "types.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <math.h>
 #include "map_align.h"
 
+/* What new_kmer_filter found for a fragment */
+#define KMER_HITS_UNIQUE (0) // unique kmers shared with the reference,
+                             // or no kmer filtering
+#define KMER_HITS_REPEAT (1) // only repetitive kmers shared
+#define KMER_HITS_NONE   (2) // no kmers shared
+#define KMER_HITS_BLOOM  (3) // no kmers shared; every one was rejected by
+                             // the Bloom filter without an index lookup
+
 
 /* add_kmer
    Args: (1) KPL* kmer array
@@ -33,21 +43,40 @@ extern "C" {
 void add_kmer( KPL* kpa, const size_t inx, const size_t i ) ;
 
 /* init_kpa
-   Args: (1) length of kmers to use
+   Args: (1) SeedP describing the kmers to use
    Returns: pointer to KPL; an array of pointers to KmerPosList
+            big enough for every index of this seed
 */
-KPL* init_kpa( const int kmer_len ) ;
+KPL* init_kpa( const SeedP seed ) ;
 
 
 void grow_kmers ( KmersP k ) ;
 
 /* populate_kpa
+   Args: (1) KPL* kmer array made by init_kpa for this seed
+         (2) sequence to index
+         (3) length of sequence
+         (4) SeedP describing the kmers
+         (5) boolean; TRUE => skip kmers with lower-case bases
+   Returns: 1
+   Adds every kmer of seq to kpa
  */
 int populate_kpa( KPL* kpa, const char* seq,
 		  const size_t seq_len,
-		  const int kmer_len,
+		  const SeedP seed,
 		  const int soft_mask ) ;
 
+/* count_repeat_kmers
+   Args: (1) KPL* kmer array
+         (2) SeedP of the kmers in this array
+         (3) maximum number of occurrences for a kmer to be
+             considered non-repetitive
+   Returns: number of distinct kmers in the array that occur
+            more than max_kmer_freq times
+*/
+size_t count_repeat_kmers( KPL* kpa, const SeedP seed,
+			   const size_t max_kmer_freq ) ;
+
 /* pop_kmers
    Args: (1) RefSeqP ref - reference sequence with forward and reverse sequence
          (2) int kmer_filt_len - length of kmers
@@ -76,16 +105,145 @@ int kmer2inx( const char* kmer,
 		     const unsigned int kmer_len,
 		     size_t* inx ) ;
 
-/* Returns: TRUE (1) if we should align this sequence
+/* seed2inx
+   Args: (1) a pointer to a character string; the beginning of
+             the stretch of sequence covered by the seed;
+             might not be null-terminated
+         (2) SeedP describing which positions to look at
+         (3) pointer to size_t to put the index
+   Returns: TRUE if the index was set, FALSE if it could not
+            be set because of some non A,C,G,T character at a
+            position that is looked at
+   Like kmer2inx, but only the '1' positions of the seed pattern
+   are used. If seed->ry, each position contributes a single bit:
+   0 for purines (A,G) and 1 for pyrimidines (C,T)
+*/
+int seed2inx( const char* kmer,
+	      const SeedP seed,
+	      size_t* inx ) ;
+
+/* init_seed
+   Args: (1) seed pattern of '1' (look at) and '0' (don't care)
+             characters; if NULL, a contiguous kmer is used
+         (2) length of contiguous kmer if pattern is NULL
+         (3) boolean; TRUE => purine/pyrimidine alphabet
+   Returns: pointer to a newly allocated Seed
+   Exits if the pattern is not sensible or the index it implies
+   would be too big
+*/
+SeedP init_seed( const char* pattern, const int kmer_len, const int ry ) ;
+
+/* mask_alignment
+   Args: (1) AlignmentP
+   Returns: void
+   Masks every column of the alignment in constant time by moving
+   on to a new mask_epoch. Only when the epoch counter wraps around
+   does the align_mask array itself have to be cleared
+*/
+void mask_alignment( AlignmentP a ) ;
+
+/* unmask_alignment
+   Args: (1) AlignmentP
+   Returns: void
+   Lets the alignment go through every column, in constant time
+*/
+void unmask_alignment( AlignmentP a ) ;
+
+/* unmask_align_region
+   Args: (1) AlignmentP
+         (2) first column to unmask
+         (3) last column to unmask
+   Returns: void
+   Stamps columns mask_min to mask_max with the current mask_epoch
+*/
+void unmask_align_region( AlignmentP a, const int mask_min,
+			  const int mask_max ) ;
+
+/* init_kmer_filter
+   Args: (1) RefSeqP with seq and rcseq (including any wrap-around
+             sequence) set up, but not yet upper-cased
+         (2) SeedP for the kmers to look up
+         (3) boolean; TRUE => also make purine/pyrimidine indices
+             for damage tolerant lookup of fragment ends. Their
+             end_seed is a contiguous kmer of twice the weight of
+             seed, up to 2*MAX_KMER_LEN, so that it has as many
+             index bits as seed and is as unlikely to be found by
+             chance
+         (4) boolean; TRUE => do not use kmers with lower-case bases
+         (5) maximum number of occurrences in the reference for
+             a kmer to be considered non-repetitive
+   Returns: pointer to a newly allocated KmerFilter
+   The Bloom filter is sized for all kmers going into the arrays
+   at BLOOM_BITS_PER_KMER bits each. If ref->rcseq is NULL, only
+   the forward arrays are made; such a filter can be used with
+   kmer_localize, but not with new_kmer_filter
+*/
+KmerFilterP init_kmer_filter( RefSeqP ref, SeedP seed,
+			      const int damage_tolerant,
+			      const int soft_mask,
+			      const size_t max_kmer_freq ) ;
+
+/* bloom_fp_rate
+   Args: (1) KmerFilterP with bloom populated
+   Returns: expected false positive rate of the Bloom filter, i.e.,
+            the fraction of set bits to the power of the number
+            of hashes
+*/
+double bloom_fp_rate( const KmerFilterP kf ) ;
+
+/* new_kmer_filter
+   Args: (1) FragSeqP of the sequence to be filtered
+         (2) KmerFilterP with the reference kmer indices;
+             NULL means no kmer filtering
+         (3) AlignmentP for the forward alignment
+         (4) AlignmentP for the reverse complement alignment
+         (5) pointer to int; set to KMER_HITS_UNIQUE, KMER_HITS_REPEAT,
+             KMER_HITS_NONE or KMER_HITS_BLOOM to say what was found
+   Sets the align_mask of both alignments to the regions of the
+   reference around shared kmers. Repetitive kmers are only used
+   if no unique kmers are shared. Kmers touching the ends of the
+   fragment are also looked up with the damage tolerant end_seed
+   if the filter has one.
+   Returns: TRUE (1) if we should align this sequence
             FALSE (0) if we should NOT align this sequence because
                       it shares no kmers with the reference
 */
 int new_kmer_filter( FragSeqP fs,
-		     KPL* fkpa,
-		     KPL* rkpa,
-		     int kmer_len,
+		     KmerFilterP kf,
 		     AlignmentP fwa,
-		     AlignmentP rca ) ;
+		     AlignmentP rca,
+		     int* hit_type ) ;
+
+/* kmer_localize
+   Args: (1) sequence to localize
+         (2) length of sequence
+         (3) KmerFilterP; only the forward arrays are used
+         (4) AlignmentP with a->seq1 and a->len1 set to the whole
+             sequence indexed in kf->fkpa
+   Returns: number of kmers found; 0 => sequence shares no kmers
+            with the reference and need not be aligned
+   Sets the align_mask of a to the regions of the reference around
+   kmers shared with seq, the same way new_kmer_filter does for
+   one strand
+*/
+int kmer_localize( const char* seq, const size_t seq_len,
+		   const KmerFilterP kf, AlignmentP a ) ;
+
+/* free_kpa
+   Args: (1) KPL* kmer array made by init_kpa
+         (2) SeedP it was made for
+   Returns: void
+   Frees all KmerPosLists in kpa and kpa itself
+*/
+void free_kpa( KPL* kpa, const SeedP seed ) ;
+
+/* free_kmer_filter
+   Args: (1) KmerFilterP made by init_kmer_filter
+   Returns: void
+   Frees the kmer arrays, the Bloom filter and the end_seed; the
+   seed itself belongs to the caller
+*/
+void free_kmer_filter( KmerFilterP kf ) ;
 
 int kmer_filter( int kmer_filt_len, FragSeqP fs, KmersP k ) ;
 
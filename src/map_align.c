@@ -413,6 +413,160 @@ int alnSeqCmp(const void* as1_, const void* as2_) {
 	return 0;
 }
 
+/* int_sort_key
+   Args: (1) int x - a value to sort on
+         (2) int descending - Boolean; TRUE => higher values first
+   Returns: an unsigned int that sorts, as an unsigned number, the
+   way x is to be sorted
+*/
+unsigned int int_sort_key(int x, int descending) {
+	unsigned int key = (unsigned int) x ^ (unsigned int) INT_MIN;
+	return descending ? ~key : key;
+}
+
+/* sort_slice_worker
+   Args: (1) void* pointer to a SortSlice
+   Counts the digits of the keys of the slice into its counts, or
+   scatters its keys into dst at the offsets in its counts
+   Returns NULL
+*/
+static void* sort_slice_worker(void* arg) {
+	SortSliceP ss = (SortSliceP) arg;
+	size_t i;
+	unsigned int d;
+
+	if (!ss->scatter) {
+		memset(ss->counts, 0, SORT_RADIX_SIZE * sizeof(size_t));
+		for (i = ss->start; i < ss->end; i++) {
+			d = (ss->src[i].k[ss->word] >> ss->shift) & (SORT_RADIX_SIZE - 1);
+			ss->counts[d]++;
+		}
+	}
+	else {
+		for (i = ss->start; i < ss->end; i++) {
+			d = (ss->src[i].k[ss->word] >> ss->shift) & (SORT_RADIX_SIZE - 1);
+			ss->dst[ss->counts[d]++] = ss->src[i];
+		}
+	}
+	return NULL;
+}
+
+/* run_sort_slices
+   Args: (1) array of num_threads SortSlices
+         (2) array of num_threads pthread_t to run them on
+         (3) int num_threads
+   Runs sort_slice_worker on every slice, the first on this thread,
+   and waits for all of them
+*/
+static void run_sort_slices(SortSliceP slices, pthread_t* threads,
+		int num_threads) {
+	int t;
+	for (t = 1; t < num_threads; t++) {
+		if (pthread_create(&threads[t], NULL, sort_slice_worker,
+				&slices[t]) != 0) {
+			fprintf(stderr, "Could not start sorting thread %d\n", t);
+			exit(1);
+		}
+	}
+	sort_slice_worker(&slices[0]);
+	for (t = 1; t < num_threads; t++) {
+		pthread_join(threads[t], NULL);
+	}
+}
+
+/* sort_keys
+   Args: (1) SortKeyP keys - array of keys to sort
+         (2) size_t num_keys - how many there are
+         (3) int num_threads - most threads to sort on
+   Sorts the keys by k[0], then k[1], ... with a least significant
+   digit first radix sort. Every pass is stable, so keys that are
+   the same in all words keep the order they came in, just like
+   the merge sort glibc uses for qsort. The sorted order does not
+   depend on num_threads. Passes over a digit that is the same in
+   every key are skipped
+*/
+void sort_keys(SortKeyP keys, size_t num_keys, int num_threads) {
+	SortKeyP tmp, src, dst, swap;
+	SortSliceP slices;
+	pthread_t* threads;
+	size_t* counts;
+	size_t b, sum, count, digit_start;
+	int t, word, shift, constant;
+
+	if (num_keys < 2) {
+		return;
+	}
+	if ((size_t) num_threads > num_keys / SORT_MIN_PER_THREAD) {
+		num_threads = (int) (num_keys / SORT_MIN_PER_THREAD);
+	}
+	if (num_threads < 1) {
+		num_threads = 1;
+	}
+
+	tmp = (SortKeyP) save_malloc(num_keys * sizeof(SortKey));
+	counts = (size_t*) save_malloc(num_threads * SORT_RADIX_SIZE
+			* sizeof(size_t));
+	slices = (SortSliceP) save_malloc(num_threads * sizeof(SortSlice));
+	threads = (pthread_t*) save_malloc(num_threads * sizeof(pthread_t));
+	for (t = 0; t < num_threads; t++) {
+		slices[t].start = num_keys * t / num_threads;
+		slices[t].end = num_keys * (t + 1) / num_threads;
+		slices[t].counts = &counts[t * SORT_RADIX_SIZE];
+	}
+
+	src = keys;
+	dst = tmp;
+	for (word = SORT_KEY_WORDS - 1; word >= 0; word--) {
+		for (shift = 0; shift < (int) (sizeof(unsigned int) * CHAR_BIT);
+				shift += SORT_RADIX_BITS) {
+			for (t = 0; t < num_threads; t++) {
+				slices[t].src = src;
+				slices[t].dst = dst;
+				slices[t].word = word;
+				slices[t].shift = shift;
+				slices[t].scatter = 0;
+			}
+			run_sort_slices(slices, threads, num_threads);
+
+			/* Turn the counts into offsets, digit by digit and
+			   within each digit slice by slice, so keys with the
+			   same digit keep their order */
+			constant = 0;
+			sum = 0;
+			for (b = 0; b < SORT_RADIX_SIZE; b++) {
+				digit_start = sum;
+				for (t = 0; t < num_threads; t++) {
+					count = slices[t].counts[b];
+					slices[t].counts[b] = sum;
+					sum += count;
+				}
+				if (sum - digit_start == num_keys) {
+					constant = 1;
+				}
+			}
+			if (constant) {
+				continue;
+			}
+
+			for (t = 0; t < num_threads; t++) {
+				slices[t].scatter = 1;
+			}
+			run_sort_slices(slices, threads, num_threads);
+			swap = src;
+			src = dst;
+			dst = swap;
+		}
+	}
+
+	if (src != keys) {
+		memcpy(keys, src, num_keys * sizeof(SortKey));
+	}
+	free(tmp);
+	free(counts);
+	free(slices);
+	free(threads);
+}
+
 /* Computes the reverse complement of a single base.  It must support
  * IUPAC ambiguity codes, small case letters, and gap symbols. */
 char revcom_char(const char base) {
@@ -864,13 +1018,6 @@ void col_print_cons(char* consensus, char* aln_ref, int* cov, int* ref_poss,
  0 (FALSE) if failure
  */
 int merge_pwaln_into_maln(PWAlnFragP pwaln, MapAlignmentP maln) {
-  int i, j, aln_len, ref_frag_len, ref_pos, gap_compare, mind_the_gap,
-    seq_pos;
-  char c, f;
-  char* ins_seq;
-  AlnSeqP asp;
-  int this_ref_gaps[(2*INIT_ALN_SEQ_LEN) + 1];
-  
   // Grow array of aligned sequences if necessary
   if (maln->num_aln_seqs >= maln->size) {
     if ( !(grow_alns_map_alignment(maln))) {
@@ -878,8 +1025,32 @@ int merge_pwaln_into_maln(PWAlnFragP pwaln, MapAlignmentP maln) {
     }
   }
   
-  // Get a pointer to this next AlnSeq
-  asp = maln->AlnSeqArray[maln->num_aln_seqs];
+  pwaln_to_aln_seq(pwaln, maln->AlnSeqArray[maln->num_aln_seqs],
+		   maln->ref->gaps);
+  maln->num_aln_seqs++;
+  return 1;
+}
+
+/* Takes a pointer to a populated PWAlnFrag (pwaln), a pointer
+ to the AlnSeq it will become (asp), and an array of the longest
+ gap known before each reference position (gaps)
+ Does:
+ 1. Copies this aligned sequence, without gaps, into asp
+ 2. Populates the ins array of asp with the sequence inserted
+ before each of its positions
+ 3. Lengthens gaps[] wherever this fragment has a longer insert
+ than known before
+ Touches nothing but asp and gaps, so different threads can fill
+ different AlnSeqs each with their own gaps array and take the
+ position by position maximum of those afterwards
+ Returns: void
+ */
+void pwaln_to_aln_seq(PWAlnFragP pwaln, AlnSeqP asp, int* gaps) {
+  int i, j, aln_len, ref_frag_len, ref_pos, gap_compare, mind_the_gap,
+    seq_pos;
+  char c, f;
+  char* ins_seq;
+  int this_ref_gaps[(2*INIT_ALN_SEQ_LEN) + 1];
   
   // Copy over all the details thusfar
   strcpy(asp->id, pwaln->frag_id);
@@ -940,17 +1111,15 @@ int merge_pwaln_into_maln(PWAlnFragP pwaln, MapAlignmentP maln) {
   ref_frag_len = asp->end - asp->start + 1;
   for (i = 0; i < ref_frag_len; i++) {
     ref_pos = asp->start + i;
-    gap_compare = this_ref_gaps[i] - maln->ref->gaps[ref_pos];
+    gap_compare = this_ref_gaps[i] - gaps[ref_pos];
     
     if (gap_compare > 0) {
       /* Longer gap in this fragment than known before so we must
-	 make maln->ref->gaps[ref_pos] longer to accomodate it
+	 make gaps[ref_pos] longer to accomodate it
       */
-      maln->ref->gaps[ref_pos] += gap_compare;
+      gaps[ref_pos] += gap_compare;
     }
   }
-  maln->num_aln_seqs++;
-  return 1;
 }
 
 
@@ -77,6 +77,24 @@ char find_consensus(BaseCountsP bcs, int cons_code) ;
 
 int alnSeqCmp(const void* as1_, const void* as2_) ;
 
+/* int_sort_key
+   Args: (1) int x - a value to sort on
+         (2) int descending - Boolean; TRUE => higher values first
+   Returns: an unsigned int that sorts, as an unsigned number, the
+   way x is to be sorted
+*/
+unsigned int int_sort_key(int x, int descending) ;
+
+/* sort_keys
+   Args: (1) SortKeyP keys - array of keys to sort
+         (2) size_t num_keys - how many there are
+         (3) int num_threads - most threads to sort on
+   Stable sort of the keys by k[0], then k[1], ...; keys that are the
+   same in all words keep their order. The order does not depend on
+   num_threads
+*/
+void sort_keys(SortKeyP keys, size_t num_keys, int num_threads) ;
+
 char revcom_char(const char base) ;
 
 /* Takes a MapAlignmentP and a position where some of
@@ -120,6 +138,22 @@ void col_print_cons(char* consensus, char* aln_ref, int* cov, int* ref_poss,
  */
 int merge_pwaln_into_maln(PWAlnFragP pwaln, MapAlignmentP maln) ;
 
+/* Takes a pointer to a populated PWAlnFrag (pwaln), a pointer
+ to the AlnSeq it will become (asp), and an array of the longest
+ gap known before each reference position (gaps)
+ Does:
+ 1. Copies this aligned sequence, without gaps, into asp
+ 2. Populates the ins array of asp with the sequence inserted
+ before each of its positions
+ 3. Lengthens gaps[] wherever this fragment has a longer insert
+ than known before
+ Touches nothing but asp and gaps, so different threads can fill
+ different AlnSeqs each with their own gaps array and take the
+ position by position maximum of those afterwards
+ Returns: void
+ */
+void pwaln_to_aln_seq(PWAlnFragP pwaln, AlnSeqP asp, int* gaps) ;
+
 
 /* Takes the description from an Udo align aligned sequence
  and puts the start, end, strand, and score information in
@@ -65,13 +65,15 @@ MapAlignmentP init_map_alignment(void) {
 
     aln->size = INIT_NUM_ALN_SEQS;
     aln->num_aln_seqs = 0;
+    aln->num_threads = 1;
 
     return aln;
 }
 
 /* free_map_alignment
  Takes a MapAlignmentP (maln)
- Frees the memory pointed to by its components
+ Frees the memory pointed to by its components; AlnSeqArray entries
+ past num_aln_seqs may be NULL
  Returns nothing
  */
 void free_map_alignment(MapAlignmentP maln) {
@@ -107,82 +109,16 @@ void free_map_alignment(MapAlignmentP maln) {
 void show_consensus(MapAlignmentP maln, int out_format) {
     char* consensus;
     char* aln_ref;
-    char* ins_cons;
-    int j, cons_pos, ref_pos, ref_gaps;
     int* cov;
-    int* ins_cov;
     int* ref_poss;
     int len_consensus = get_consensus_length(maln);
-    AlnSeqP aln_seq;
-    BaseCountsP bcs;
-    PSSMP psm;
-
-    bcs = (BaseCountsP) save_malloc(sizeof (BaseCounts));
-    reset_base_counts(bcs);
 
     consensus = (char*) save_malloc((len_consensus + 1) * sizeof (char));
     aln_ref = (char*) save_malloc((len_consensus + 1) * sizeof (char));
     cov = (int*) save_malloc((len_consensus + 1) * sizeof (int));
     ref_poss = (int*) save_malloc((len_consensus + 1) * sizeof (int));
 
-    ins_cons = (char*) save_malloc(MAX_INS_LEN * sizeof (char));
-    ins_cov = (int*) save_malloc(MAX_INS_LEN * sizeof (int));
-
-    cons_pos = 0;
-    ref_pos = 0;
-    /* Go through each position of the reference sequence */
-    for (ref_pos = 0; ref_pos < maln->ref->seq_len; ref_pos++) {
-        /* How many gaps preceeded this position? */
-        ref_gaps = maln->ref->gaps[ref_pos];
-
-        /* Add these gaps to the reference aligned string */
-        if ((ref_gaps > 0) && (ref_pos > 0)) {
-            find_ins_cons(maln, ref_pos, ins_cons, ins_cov, out_format);
-            for (j = 0; j < ref_gaps; j++) {
-                aln_ref[cons_pos] = '-';
-                consensus[cons_pos] = ins_cons[j];
-                cov[cons_pos] = ins_cov[j];
-                ref_poss[cons_pos] = ref_pos;
-                cons_pos++;
-            }
-        }
-        /* Re-zero all the base counts */
-        reset_base_counts(bcs);
-
-        /* Find all the aligned fragments that include this
-           position and make a consensus from it */
-        for (j = 0; j < maln->num_aln_seqs; j++) {
-            aln_seq = maln->AlnSeqArray[j];
-            /* Does this aligned fragment cover this position? */
-            if ((aln_seq->start <= ref_pos) && // checked
-                    (aln_seq->end >= ref_pos)) {
-
-                if (aln_seq->revcom) {
-                    psm = maln->rpsm;
-                } else {
-                    psm = maln->fpsm;
-                }
-
-                add_base(aln_seq->seq[ref_pos - aln_seq->start], bcs, psm,
-                        aln_seq->smp[ref_pos - aln_seq->start]);
-            }
-        }
-        consensus[cons_pos] = find_consensus(bcs, maln->cons_code);
-        aln_ref[cons_pos] = maln->ref->seq[ref_pos];
-        cov[cons_pos] = bcs->cov;
-        ref_poss[cons_pos] = ref_pos;
-        if ((out_format == 4) && !(aln_ref[cons_pos] == consensus[cons_pos])) {
-            show_single_pos(ref_pos, aln_ref[cons_pos], consensus[cons_pos],
-                    bcs);
-        }
-        if (out_format == 41) {
-            show_single_pos(ref_pos, aln_ref[cons_pos], consensus[cons_pos],
-                    bcs);
-        }
-        cons_pos++;
-    }
-    consensus[cons_pos] = '\0';
-    aln_ref[cons_pos] = '\0';
+    fill_consensus(maln, consensus, aln_ref, cov, ref_poss, 0, out_format);
 
     /* Now, output the reference and consensus sequences and the
        coverage in specified way */
@@ -210,13 +146,10 @@ void show_consensus(MapAlignmentP maln, int out_format) {
     }
 
     /* Free memory! */
-    free(bcs);
     free(consensus);
     free(aln_ref);
     free(cov);
     free(ref_poss);
-    free(ins_cons);
-    free(ins_cov);
 }
 
 int get_consensus_length(MapAlignmentP maln) {
@@ -229,56 +162,233 @@ int get_consensus_length(MapAlignmentP maln) {
 char* get_consensus(MapAlignmentP maln) {
     int len_consensus = get_consensus_length(maln);
     char* consensus = (char*) save_malloc((len_consensus + 1) * sizeof (char));
+    fill_consensus(maln, consensus, NULL, NULL, NULL, 0, 5);
+    return consensus;
+}
+
+/* Takes a pointer to a ConsFill (passed as void* for pthread_create)
+ Claims chunks of CONS_CHUNK_LEN reference positions one at a time
+ and calls the consensus of each of their positions, and of the
+ inserts before them, into the ConsFill's arrays
+ Returns NULL
+ */
+static void* cons_chunk_worker(void* arg) {
+    ConsFillP cf = (ConsFillP) arg;
+    MapAlignmentP maln = cf->maln;
     char* ins_cons = (char*) save_malloc(MAX_INS_LEN * sizeof (char));
-    int j, cons_pos, ref_pos, ref_gaps;    
-    int* ins_cov = (int*) save_malloc(MAX_INS_LEN * sizeof (int));    
+    int* ins_cov = (int*) save_malloc(MAX_INS_LEN * sizeof (int));
+    int c, j, cons_pos, ref_pos, ref_end, ref_gaps;
     AlnSeqP aln_seq;
     BaseCountsP bcs;
     PSSMP psm;
     bcs = (BaseCountsP) save_malloc(sizeof (BaseCounts));
-    reset_base_counts(bcs);
 
+    while (1) {
+        pthread_mutex_lock(&cf->lock);
+        c = cf->next_chunk++;
+        pthread_mutex_unlock(&cf->lock);
+        if (c >= cf->num_chunks) {
+            break;
+        }
+        cons_pos = cf->chunk_starts[c];
+        ref_end = (c + 1) * CONS_CHUNK_LEN;
+        if (ref_end > maln->ref->seq_len) {
+            ref_end = maln->ref->seq_len;
+        }
+        for (ref_pos = c * CONS_CHUNK_LEN; ref_pos < ref_end; ref_pos++) {
+            /* How many gaps preceeded this position? */
+            ref_gaps = maln->ref->gaps[ref_pos];
+
+            /* Add these gaps to the reference aligned string */
+            if ((ref_gaps > 0) && (ref_pos > 0)) {
+                find_ins_cons(maln, ref_pos, ins_cons, ins_cov, cf->out_format);
+                for (j = 0; j < ref_gaps; j++) {
+                    cf->consensus[cons_pos] = ins_cons[j];
+                    if (cf->aln_ref != NULL) {
+                        cf->aln_ref[cons_pos] = '-';
+                    }
+                    if (cf->cov != NULL) {
+                        cf->cov[cons_pos] = ins_cov[j];
+                    }
+                    if (cf->ref_poss != NULL) {
+                        cf->ref_poss[cons_pos] = ref_pos;
+                    }
+                    cons_pos++;
+                }
+            }
+            /* Re-zero all the base counts */
+            reset_base_counts(bcs);
+
+            /* Find all the aligned fragments that include this
+               position and make a consensus from it */
+            for (j = 0; j < maln->num_aln_seqs; j++) {
+                aln_seq = maln->AlnSeqArray[j];
+                /* Does this aligned fragment cover this position? */
+                if ((aln_seq->start <= ref_pos) && // checked
+                        (aln_seq->end >= ref_pos) &&
+                        !(cf->skip_dropped && aln_seq->dropped)) {
+
+                    psm = aln_seq->revcom ? maln->rpsm : maln->fpsm;
+
+                    add_base(aln_seq->seq[ref_pos - aln_seq->start], bcs, psm,
+                            aln_seq->smp[ref_pos - aln_seq->start]);
+                }
+            }
+            cf->consensus[cons_pos] = find_consensus(bcs, maln->cons_code);
+            if (cf->aln_ref != NULL) {
+                cf->aln_ref[cons_pos] = maln->ref->seq[ref_pos];
+            }
+            if (cf->cov != NULL) {
+                cf->cov[cons_pos] = bcs->cov;
+            }
+            if (cf->ref_poss != NULL) {
+                cf->ref_poss[cons_pos] = ref_pos;
+            }
+            if ((cf->out_format == 4) &&
+                    !(maln->ref->seq[ref_pos] == cf->consensus[cons_pos])) {
+                show_single_pos(ref_pos, maln->ref->seq[ref_pos],
+                        cf->consensus[cons_pos], bcs);
+            }
+            if (cf->out_format == 41) {
+                show_single_pos(ref_pos, maln->ref->seq[ref_pos],
+                        cf->consensus[cons_pos], bcs);
+            }
+            cons_pos++;
+        }
+    }
+    free(bcs);
+    free(ins_cons);
+    free(ins_cov);
+    return NULL;
+}
+
+/* Takes a MapAlignmentP (maln), an array for the consensus, and
+ optionally (NULL if not wanted) arrays for the aligned reference,
+ the coverage, and the reference position of each consensus position,
+ all get_consensus_length(maln) + 1 long
+ Fills them in for every reference position and every insert position
+ before it, calling the consensus on maln->num_threads threads, each
+ working on CONS_CHUNK_LEN reference positions at a time
+ If skip_dropped, AlnSeqs marked dropped do not count toward the
+ consensus of reference positions. out_format 4 and 41 print each
+ position as it is called, so those are done on one thread, in order
+ Returns nothing
+ */
+void fill_consensus(MapAlignmentP maln, char* consensus, char* aln_ref,
+        int* cov, int* ref_poss, int skip_dropped, int out_format) {
+    ConsFill cf;
+    pthread_t* threads;
+    int t, ref_pos, cons_pos, num_threads;
+
+    cf.maln = maln;
+    cf.consensus = consensus;
+    cf.aln_ref = aln_ref;
+    cf.cov = cov;
+    cf.ref_poss = ref_poss;
+    cf.skip_dropped = skip_dropped;
+    cf.out_format = out_format;
+    cf.num_chunks = (maln->ref->seq_len + CONS_CHUNK_LEN - 1) / CONS_CHUNK_LEN;
+    cf.next_chunk = 0;
+    pthread_mutex_init(&cf.lock, NULL);
+
+    /* Where does each chunk start in the consensus? Inserts before
+       position 0 are not called, so they take up no room */
+    cf.chunk_starts = (int*) save_malloc((cf.num_chunks + 1) * sizeof (int));
     cons_pos = 0;
-    ref_pos = 0;
-    /* Go through each position of the reference sequence */
     for (ref_pos = 0; ref_pos < maln->ref->seq_len; ref_pos++) {
-        /* How many gaps preceeded this position? */
-        ref_gaps = maln->ref->gaps[ref_pos];
-
-        /* Add these gaps to the reference aligned string */
-        if ((ref_gaps > 0) && (ref_pos > 0)) {
-            find_ins_cons(maln, ref_pos, ins_cons, ins_cov, 5);
-            for (j = 0; j < ref_gaps; j++) {
-                consensus[cons_pos] = ins_cons[j];
-                cons_pos++;
-            }
+        if ((ref_pos % CONS_CHUNK_LEN) == 0) {
+            cf.chunk_starts[ref_pos / CONS_CHUNK_LEN] = cons_pos;
+        }
+        if (ref_pos > 0) {
+            cons_pos += maln->ref->gaps[ref_pos];
         }
-        /* Re-zero all the base counts */
-        reset_base_counts(bcs);
+        cons_pos++;
+    }
+    consensus[cons_pos] = '\0';
+    if (aln_ref != NULL) {
+        aln_ref[cons_pos] = '\0';
+    }
 
-        /* Find all the aligned fragments that include this
-           position and make a consensus from it */
-        for (j = 0; j < maln->num_aln_seqs; j++) {
-            aln_seq = maln->AlnSeqArray[j];
-            /* Does this aligned fragment cover this position? */
-            if ((aln_seq->start <= ref_pos) && // checked
-                    (aln_seq->end >= ref_pos)) {
+    num_threads = maln->num_threads;
+    if ((out_format == 4) || (out_format == 41) || (num_threads < 1)) {
+        num_threads = 1;
+    }
+    if (num_threads > cf.num_chunks) {
+        num_threads = (cf.num_chunks > 0) ? cf.num_chunks : 1;
+    }
 
-                psm = aln_seq->revcom ? maln->rpsm : maln->fpsm;
+    threads = (pthread_t*) save_malloc(num_threads * sizeof (pthread_t));
+    for (t = 1; t < num_threads; t++) {
+        if (pthread_create(&threads[t], NULL, cons_chunk_worker, &cf) != 0) {
+            fprintf(stderr, "Could not start consensus thread %d\n", t);
+            exit(1);
+        }
+    }
+    cons_chunk_worker(&cf);
+    for (t = 1; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    free(cf.chunk_starts);
+    pthread_mutex_destroy(&cf.lock);
+}
 
-                add_base(aln_seq->seq[ref_pos - aln_seq->start], bcs, psm,
-                        aln_seq->smp[ref_pos - aln_seq->start]);
+/* copy_map_alignment
+ Takes a MapAlignmentP (maln)
+ Returns a new MapAlignment with its own copies of the reference,
+ the PSSMs and every AlnSeq, including their inserts, that stays
+ as it is while maln goes on changing; free it with
+ free_map_alignment
+ */
+MapAlignmentP copy_map_alignment(MapAlignmentP maln) {
+    MapAlignmentP copy;
+    AlnSeqP as;
+    int i, j, aln_seq_len;
+
+    copy = (MapAlignmentP) save_malloc(sizeof (MapAlignment));
+    *copy = *maln;
+
+    /* The reference, with only what write_ma shows of it */
+    copy->ref = (RefSeqP) save_malloc(sizeof (RefSeq));
+    *copy->ref = *maln->ref;
+    copy->ref->seq = (char*) save_malloc((maln->ref->seq_len + 1) *
+            sizeof (char));
+    memcpy(copy->ref->seq, maln->ref->seq, maln->ref->seq_len);
+    copy->ref->seq[maln->ref->seq_len] = '\0';
+    copy->ref->rcseq = NULL;
+    copy->ref->gaps = (int*) save_malloc(maln->ref->seq_len * sizeof (int));
+    memcpy(copy->ref->gaps, maln->ref->gaps, maln->ref->seq_len * sizeof (int));
+
+    copy->fpsm = (PSSMP) save_malloc(sizeof (PSSM));
+    *copy->fpsm = *maln->fpsm;
+    copy->rpsm = (PSSMP) save_malloc(sizeof (PSSM));
+    *copy->rpsm = *maln->rpsm;
+
+    /* Just the AlnSeqs in use; the rest of AlnSeqArray may not
+       point to anything, so is left NULL, but keeps its size,
+       which is written to the maln file */
+    copy->AlnSeqArray = (AlnSeqP*) save_malloc(copy->size * sizeof (AlnSeqP));
+    for (i = maln->num_aln_seqs; i < copy->size; i++) {
+        copy->AlnSeqArray[i] = NULL;
+    }
+    for (i = 0; i < maln->num_aln_seqs; i++) {
+        as = (AlnSeqP) save_malloc(sizeof (AlnSeq));
+        *as = *maln->AlnSeqArray[i];
+        aln_seq_len = strlen(as->seq);
+        for (j = 0; j < aln_seq_len; j++) {
+            if (as->ins[j] != NULL) {
+                as->ins[j] = strdup(as->ins[j]);
             }
         }
-        consensus[cons_pos] = find_consensus(bcs, maln->cons_code);
-        cons_pos++;
+        copy->AlnSeqArray[i] = as;
     }
-    consensus[cons_pos] = '\0';
-    return consensus;
+    return copy;
 }
 
 /* Write out the data in a MapAlignment data structure
  to a file
+ Returns 1 if success
+ 0 if the file could not be opened or written
  */
 int write_ma(char* fn, MapAlignmentP maln) {
     int i, j, row;
@@ -290,6 +400,9 @@ int write_ma(char* fn, MapAlignmentP maln) {
     PSSMP fpsm, rpsm;
 
     MAF = fileOpen(fn, "w");
+    if (MAF == NULL) {
+        return 0;
+    }
 
     t = time(NULL);
     //at = (char*) save_malloc(64 * sizeof (char));
@@ -377,8 +490,528 @@ int write_ma(char* fn, MapAlignmentP maln) {
         }
         fprintf(MAF, "\n");
     }
+    if (ferror(MAF)) {
+        fclose(MAF);
+        return 0;
+    }
+    return (fclose(MAF) == 0);
+}
+
+/* Length of s, but no more than max_len, for strings that might not
+   have been terminated where they should be */
+static size_t bin_strlen(const char* s, size_t max_len) {
+    size_t len = 0;
+    while ((len < max_len) && (s[len] != '\0')) {
+        len++;
+    }
+    return len;
+}
+
+/* Padding for binary maln sections */
+static const char zero_pad[8] = {0};
+
+/* Round a binary maln section length up so the next section stays
+   8-byte aligned */
+static uint64_t bin_align(uint64_t len) {
+    return (len + 7) & ~(uint64_t) 7;
+}
+
+/* Write n ints as int32_t, then pad them to 8-byte alignment */
+static void bin_write_ints(FILE* MAF, const int* v, size_t n) {
+    int32_t x;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        x = v[i];
+        fwrite(&x, sizeof (int32_t), 1, MAF);
+    }
+    fwrite(zero_pad, 1, bin_align(n * sizeof (int32_t)) - n * sizeof (int32_t),
+            MAF);
+}
+
+/* Region index bin of reference position pos */
+static int bin_of(int pos) {
+    return (pos < 0) ? 0 : pos / MALN_INDEX_BIN_LEN;
+}
+
+/* First and last reference positions of as, even if it ends before
+   it starts */
+static int min_pos(AlnSeqP as) {
+    return (as->start < as->end) ? as->start : as->end;
+}
+
+static int max_pos(AlnSeqP as) {
+    return (as->start < as->end) ? as->end : as->start;
+}
+
+/* Write len chars of s to the heap of a binary maln, with a '\0' */
+static void bin_write_str(FILE* MAF, const char* s, size_t len) {
+    fwrite(s, 1, len, MAF);
+    fputc('\0', MAF);
+}
+
+/* Write out the data in a MapAlignment data structure
+ to a file in the binary maln format, described by MalnBinHeader
+ Returns 1 if success
+ 0 if the file could not be opened or written
+ */
+int write_ma_bin(char* fn, MapAlignmentP maln) {
+    MalnBinHeader h;
+    MalnBinRec* recs;
+    MalnBinIns* ins;
+    AlnSeqP as;
+    FILE* MAF;
+    uint64_t heap_len, num_ins;
+    uint64_t* bins;
+    uint32_t* bin_recs;
+    size_t psm_len, id_max, aln_max;
+    int i, j, b, aln_seq_len, max_end;
+
+    MAF = fileOpen(fn, "w");
+    if (MAF == NULL) {
+        return 0;
+    }
+    id_max = MAX_ID_LEN;
+    aln_max = 2 * INIT_ALN_SEQ_LEN;
+
+    /* Count the inserts, to lay out their table */
+    num_ins = 0;
+    for (i = 0; i < maln->num_aln_seqs; i++) {
+        as = maln->AlnSeqArray[i];
+        aln_seq_len = bin_strlen(as->seq, aln_max);
+        for (j = 0; j < aln_seq_len; j++) {
+            if (as->ins[j] != NULL) {
+                num_ins++;
+            }
+        }
+    }
+    recs = (MalnBinRec*) save_malloc((maln->num_aln_seqs + 1) *
+            sizeof (MalnBinRec));
+    ins = (MalnBinIns*) save_malloc((num_ins + 1) * sizeof (MalnBinIns));
+
+    memset(&h, 0, sizeof (MalnBinHeader));
+    memcpy(h.magic, MALN_BIN_MAGIC, sizeof (h.magic));
+    h.version = MALN_BIN_VERSION;
+    h.byte_order = MALN_BIN_BYTE_ORDER;
+    h.num_aln_seqs = maln->num_aln_seqs;
+    h.size = maln->size;
+    h.cons_code = maln->cons_code;
+    h.ref_seq_len = maln->ref->seq_len;
+    h.ref_size = maln->ref->size;
+    h.depth = maln->fpsm->depth;
+
+    /* Lay out the heap, in the order the strings are written below */
+    heap_len = 0;
+    h.ref_id = heap_len;
+    heap_len += bin_strlen(maln->ref->id, id_max) + 1;
+    h.ref_desc = heap_len;
+    heap_len += bin_strlen(maln->ref->desc, MAX_DESC_LEN) + 1;
+    h.ref_seq = heap_len;
+    heap_len += maln->ref->seq_len + 1;
+
+    num_ins = 0;
+    for (i = 0; i < maln->num_aln_seqs; i++) {
+        as = maln->AlnSeqArray[i];
+        memset(&recs[i], 0, sizeof (MalnBinRec));
+        recs[i].id = heap_len;
+        heap_len += bin_strlen(as->id, id_max) + 1;
+        recs[i].desc = heap_len;
+        heap_len += bin_strlen(as->desc, MAX_DESC_LEN) + 1;
+        recs[i].seq = heap_len;
+        aln_seq_len = bin_strlen(as->seq, aln_max);
+        heap_len += aln_seq_len + 1;
+        recs[i].smp = heap_len;
+        heap_len += bin_strlen(as->smp, aln_max) + 1;
+        recs[i].first_ins = num_ins;
+        for (j = 0; j < aln_seq_len; j++) {
+            if (as->ins[j] != NULL) {
+                ins[num_ins].str = heap_len;
+                ins[num_ins].pos = j;
+                ins[num_ins].pad = 0;
+                heap_len += bin_strlen(as->ins[j], MAX_INS_LEN - 1) + 1;
+                num_ins++;
+                recs[i].num_ins++;
+            }
+        }
+        recs[i].start = as->start;
+        recs[i].end = as->end;
+        recs[i].score = as->score;
+        recs[i].num_inputs = as->num_inputs;
+        recs[i].segment = as->segment;
+        recs[i].revcom = !!as->revcom;
+        recs[i].trimmed = !!as->trimmed;
+        recs[i].dropped = !!as->dropped;
+    }
+    h.num_ins = num_ins;
+    h.heap_len = heap_len;
+
+    /* Make the region index: count the AlnSeqs overlapping each bin,
+       then list them */
+    max_end = maln->ref->seq_len;
+    for (i = 0; i < maln->num_aln_seqs; i++) {
+        if (max_pos(maln->AlnSeqArray[i]) + 1 > max_end) {
+            max_end = max_pos(maln->AlnSeqArray[i]) + 1;
+        }
+    }
+    h.bin_len = MALN_INDEX_BIN_LEN;
+    h.num_bins = (max_end + MALN_INDEX_BIN_LEN - 1) / MALN_INDEX_BIN_LEN + 1;
+    bins = (uint64_t*) save_malloc((h.num_bins + 1) * sizeof (uint64_t));
+    memset(bins, 0, (h.num_bins + 1) * sizeof (uint64_t));
+    for (i = 0; i < maln->num_aln_seqs; i++) {
+        as = maln->AlnSeqArray[i];
+        for (b = bin_of(min_pos(as)); b <= bin_of(max_pos(as)); b++) {
+            bins[b + 1]++;
+        }
+    }
+    for (b = 0; b < h.num_bins; b++) {
+        bins[b + 1] += bins[b];
+    }
+    bin_recs = (uint32_t*) save_malloc((bins[h.num_bins] + 1) *
+            sizeof (uint32_t));
+    for (i = 0; i < maln->num_aln_seqs; i++) {
+        as = maln->AlnSeqArray[i];
+        for (b = bin_of(min_pos(as)); b <= bin_of(max_pos(as)); b++) {
+            bin_recs[bins[b]++] = i;
+        }
+    }
+    /* Filling moved each bin's start to where the next one starts */
+    for (b = h.num_bins; b > 0; b--) {
+        bins[b] = bins[b - 1];
+    }
+    bins[0] = 0;
+
+    /* Lay out the sections */
+    psm_len = (2 * h.depth + 1) * 5 * 5;
+    h.gaps_off = sizeof (MalnBinHeader);
+    h.fpsm_off = h.gaps_off + bin_align(h.ref_seq_len * sizeof (int32_t));
+    h.rpsm_off = h.fpsm_off + bin_align(psm_len * sizeof (int32_t));
+    h.recs_off = h.rpsm_off + bin_align(psm_len * sizeof (int32_t));
+    h.ins_off = h.recs_off + h.num_aln_seqs * sizeof (MalnBinRec);
+    h.bins_off = h.ins_off + num_ins * sizeof (MalnBinIns);
+    h.bin_recs_off = h.bins_off + (h.num_bins + 1) * sizeof (uint64_t);
+    h.heap_off = h.bin_recs_off +
+            bin_align(bins[h.num_bins] * sizeof (uint32_t));
+
+    fwrite(&h, sizeof (MalnBinHeader), 1, MAF);
+    bin_write_ints(MAF, maln->ref->gaps, h.ref_seq_len);
+    bin_write_ints(MAF, &maln->fpsm->sm[0][0][0], psm_len);
+    bin_write_ints(MAF, &maln->rpsm->sm[0][0][0], psm_len);
+    fwrite(recs, sizeof (MalnBinRec), h.num_aln_seqs, MAF);
+    fwrite(ins, sizeof (MalnBinIns), num_ins, MAF);
+    fwrite(bins, sizeof (uint64_t), h.num_bins + 1, MAF);
+    fwrite(bin_recs, sizeof (uint32_t), bins[h.num_bins], MAF);
+    fwrite(zero_pad, 1, bin_align(bins[h.num_bins] * sizeof (uint32_t)) -
+            bins[h.num_bins] * sizeof (uint32_t), MAF);
+
+    bin_write_str(MAF, maln->ref->id, bin_strlen(maln->ref->id, id_max));
+    bin_write_str(MAF, maln->ref->desc,
+            bin_strlen(maln->ref->desc, MAX_DESC_LEN));
+    bin_write_str(MAF, maln->ref->seq, maln->ref->seq_len);
+    for (i = 0; i < maln->num_aln_seqs; i++) {
+        as = maln->AlnSeqArray[i];
+        aln_seq_len = bin_strlen(as->seq, aln_max);
+        bin_write_str(MAF, as->id, bin_strlen(as->id, id_max));
+        bin_write_str(MAF, as->desc, bin_strlen(as->desc, MAX_DESC_LEN));
+        bin_write_str(MAF, as->seq, aln_seq_len);
+        bin_write_str(MAF, as->smp, bin_strlen(as->smp, aln_max));
+        for (j = 0; j < aln_seq_len; j++) {
+            if (as->ins[j] != NULL) {
+                bin_write_str(MAF, as->ins[j],
+                        bin_strlen(as->ins[j], MAX_INS_LEN - 1));
+            }
+        }
+    }
+
+    free(recs);
+    free(ins);
+    free(bins);
+    free(bin_recs);
+    if (ferror(MAF)) {
+        fclose(MAF);
+        return 0;
+    }
+    return (fclose(MAF) == 0);
+}
+
+/* Exit with a message about a binary maln file that does not hold
+   what its header says it does */
+static void bad_ma_bin(const char* fn) {
+    fprintf(stderr, "%s is not a valid binary maln file\n", fn);
+    exit(1);
+}
+
+/* Check that count items of width bytes at off fit in a file of
+   file_len bytes */
+static int bin_fits(uint64_t off, uint64_t count, uint64_t width,
+        uint64_t file_len) {
+    return (off <= file_len) && (count <= (file_len - off) / width);
+}
+
+/* Returns the string at off in the heap of a binary maln, after
+   checking that it ends in the heap and is no longer than max_len */
+static const char* bin_str(const char* heap, uint64_t heap_len,
+        uint64_t off, size_t max_len, const char* fn) {
+    const char* end;
+    if (off >= heap_len) {
+        bad_ma_bin(fn);
+    }
+    end = (const char*) memchr(heap + off, '\0', heap_len - off);
+    if ((end == NULL) || ((size_t) (end - (heap + off)) > max_len)) {
+        bad_ma_bin(fn);
+    }
+    return heap + off;
+}
+
+/* Check whether fn starts with MALN_BIN_MAGIC, i.e., is a binary maln */
+static int is_ma_bin(const char* fn) {
+    char magic[sizeof (MALN_BIN_MAGIC)];
+    FILE* MAF;
+    int is_bin;
+
+    MAF = fopen(fn, "r");
+    if (MAF == NULL) {
+        return 0;
+    }
+    is_bin = (fread(magic, 1, sizeof (magic), MAF) == sizeof (magic)) &&
+            (memcmp(magic, MALN_BIN_MAGIC, sizeof (magic)) == 0);
     fclose(MAF);
-    return 1;
+    return is_bin;
+}
+
+/* Copy the AlnSeq of record rec of a binary maln into as */
+static void copy_bin_rec(AlnSeqP as, const MalnBinRec* rec,
+        const MalnBinIns* ins, const MalnBinHeader* h, const char* heap,
+        const char* fn) {
+    size_t aln_max = 2 * INIT_ALN_SEQ_LEN;
+    uint64_t k;
+    int j;
+
+    strcpy(as->id, bin_str(heap, h->heap_len, rec->id, MAX_ID_LEN, fn));
+    strcpy(as->desc, bin_str(heap, h->heap_len, rec->desc,
+            MAX_DESC_LEN, fn));
+    strcpy(as->seq, bin_str(heap, h->heap_len, rec->seq, aln_max, fn));
+    strcpy(as->smp, bin_str(heap, h->heap_len, rec->smp, aln_max, fn));
+    as->start = rec->start;
+    as->end = rec->end;
+    as->score = rec->score;
+    as->num_inputs = rec->num_inputs;
+    as->segment = rec->segment;
+    as->revcom = rec->revcom;
+    as->trimmed = rec->trimmed;
+    as->dropped = rec->dropped;
+    if ((rec->num_ins < 0) || (rec->first_ins > h->num_ins) ||
+            ((uint64_t) rec->num_ins > h->num_ins - rec->first_ins)) {
+        bad_ma_bin(fn);
+    }
+    for (j = 0; j < rec->num_ins; j++) {
+        k = rec->first_ins + j;
+        if ((ins[k].pos < 0) || ((size_t) ins[k].pos >= aln_max)) {
+            bad_ma_bin(fn);
+        }
+        as->ins[ins[k].pos] = (char*) save_malloc(MAX_INS_LEN * sizeof (char));
+        strcpy(as->ins[ins[k].pos], bin_str(heap, h->heap_len, ins[k].str,
+                MAX_INS_LEN - 1, fn));
+    }
+}
+
+/* Load a binary maln file into a new MapAlignment, with every AlnSeq
+ if region is FALSE, or, if it is TRUE and the file has a region
+ index, only those in the index bins that reference positions
+ reg_start..reg_end fall in. These are a superset of the AlnSeqs
+ overlapping the region, in the same order as in the file
+ */
+static MapAlignmentP load_ma_bin(const char* fn, int region,
+        int reg_start, int reg_end) {
+    MapAlignmentP maln;
+    MalnBinHeader h;
+    const MalnBinRec* recs;
+    const MalnBinIns* ins;
+    const uint64_t* bins;
+    const uint32_t* bin_recs;
+    const int32_t* v;
+    const char* map;
+    const char* heap;
+    const char* str;
+    char* wanted;
+    struct stat st;
+    FILE* MAF;
+    uint64_t file_len, k, head_len;
+    size_t psm_len;
+    int i, b, first_bin, last_bin, num_wanted;
+
+    MAF = fileOpen(fn, "r");
+    if (MAF == NULL) {
+        exit(1);
+    }
+    if (fstat(fileno(MAF), &st) != 0) {
+        bad_ma_bin(fn);
+    }
+    file_len = st.st_size;
+    head_len = offsetof(MalnBinHeader, bin_len);
+    if (file_len < head_len) {
+        bad_ma_bin(fn);
+    }
+    map = (const char*) mmap(NULL, file_len, PROT_READ, MAP_PRIVATE,
+            fileno(MAF), 0);
+    fclose(MAF);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not mmap %s\n", fn);
+        exit(1);
+    }
+
+    /* Check the header, and that every section is in the file.
+       Version 1 headers end before the region index */
+    memset(&h, 0, sizeof (MalnBinHeader));
+    memcpy(&h, map, head_len);
+    if (h.byte_order != MALN_BIN_BYTE_ORDER) {
+        fprintf(stderr, "%s was written on a machine with another byte order\n",
+                fn);
+        exit(1);
+    }
+    if (h.version > MALN_BIN_VERSION) {
+        fprintf(stderr, "%s is binary maln version %u; only up to %d can be read\n",
+                fn, h.version, MALN_BIN_VERSION);
+        exit(1);
+    }
+    if (h.version >= 2) {
+        head_len = sizeof (MalnBinHeader);
+        if (file_len < head_len) {
+            bad_ma_bin(fn);
+        }
+        memcpy(&h, map, head_len);
+    }
+    psm_len = (2 * h.depth + 1) * 5 * 5;
+    if ((h.num_aln_seqs < 0) || (h.ref_seq_len < 0) ||
+            (h.ref_size <= h.ref_seq_len) ||
+            (h.depth < 0) || (h.depth > PSSM_DEPTH) ||
+            !bin_fits(h.gaps_off, h.ref_seq_len, sizeof (int32_t), file_len) ||
+            !bin_fits(h.fpsm_off, psm_len, sizeof (int32_t), file_len) ||
+            !bin_fits(h.rpsm_off, psm_len, sizeof (int32_t), file_len) ||
+            !bin_fits(h.recs_off, h.num_aln_seqs, sizeof (MalnBinRec),
+            file_len) ||
+            !bin_fits(h.ins_off, h.num_ins, sizeof (MalnBinIns), file_len) ||
+            !bin_fits(h.heap_off, h.heap_len, 1, file_len) ||
+            (h.num_bins < 0) || ((h.num_bins > 0) && (h.bin_len <= 0)) ||
+            !bin_fits(h.bins_off, h.num_bins + 1, sizeof (uint64_t), file_len)) {
+        bad_ma_bin(fn);
+    }
+    heap = map + h.heap_off;
+
+    maln = init_map_alignment();
+    maln->fpsm = (PSSMP) save_malloc(sizeof (PSSM));
+    maln->rpsm = (PSSMP) save_malloc(sizeof (PSSM));
+    maln->cons_code = h.cons_code;
+
+    /* The reference */
+    strcpy(maln->ref->id, bin_str(heap, h.heap_len, h.ref_id,
+            MAX_ID_LEN, fn));
+    strcpy(maln->ref->desc, bin_str(heap, h.heap_len, h.ref_desc,
+            MAX_DESC_LEN, fn));
+    str = bin_str(heap, h.heap_len, h.ref_seq, h.ref_seq_len, fn);
+    if (strlen(str) != (size_t) h.ref_seq_len) {
+        bad_ma_bin(fn);
+    }
+    maln->ref->seq_len = h.ref_seq_len;
+    maln->ref->size = h.ref_size;
+    maln->ref->seq = (char*) save_malloc(maln->ref->size * sizeof (char));
+    memcpy(maln->ref->seq, str, h.ref_seq_len + 1);
+    maln->ref->gaps = (int*) save_malloc((h.ref_seq_len + 1) * sizeof (int));
+    v = (const int32_t*) (map + h.gaps_off);
+    for (i = 0; i < h.ref_seq_len; i++) {
+        maln->ref->gaps[i] = v[i];
+    }
+
+    /* The PSSMs */
+    maln->fpsm->depth = h.depth;
+    maln->rpsm->depth = h.depth;
+    v = (const int32_t*) (map + h.fpsm_off);
+    for (k = 0; k < psm_len; k++) {
+        (&maln->fpsm->sm[0][0][0])[k] = v[k];
+    }
+    v = (const int32_t*) (map + h.rpsm_off);
+    for (k = 0; k < psm_len; k++) {
+        (&maln->rpsm->sm[0][0][0])[k] = v[k];
+    }
+
+    /* The aligned fragments; all of them, or those the region index
+       lists for the bins of the region, marked first so each is
+       copied once and in file order. Only a whole maln needs the
+       AlnSeqArray as big as it was when written */
+    recs = (const MalnBinRec*) (map + h.recs_off);
+    ins = (const MalnBinIns*) (map + h.ins_off);
+    wanted = NULL;
+    num_wanted = h.num_aln_seqs;
+    if (region && (h.num_bins > 0)) {
+        bins = (const uint64_t*) (map + h.bins_off);
+        if (!bin_fits(h.bin_recs_off, bins[h.num_bins], sizeof (uint32_t),
+                file_len)) {
+            bad_ma_bin(fn);
+        }
+        bin_recs = (const uint32_t*) (map + h.bin_recs_off);
+        first_bin = (reg_start < 0) ? 0 : reg_start / h.bin_len;
+        last_bin = (reg_end < 0) ? 0 : reg_end / h.bin_len;
+        if (last_bin >= h.num_bins) {
+            last_bin = h.num_bins - 1;
+        }
+        wanted = (char*) save_malloc(h.num_aln_seqs + 1);
+        memset(wanted, 0, h.num_aln_seqs + 1);
+        for (b = first_bin; b <= last_bin; b++) {
+            if ((bins[b] > bins[b + 1]) || (bins[b + 1] > bins[h.num_bins])) {
+                bad_ma_bin(fn);
+            }
+            for (k = bins[b]; k < bins[b + 1]; k++) {
+                if (bin_recs[k] >= (uint32_t) h.num_aln_seqs) {
+                    bad_ma_bin(fn);
+                }
+                wanted[bin_recs[k]] = 1;
+            }
+        }
+        num_wanted = 0;
+        for (i = 0; i < h.num_aln_seqs; i++) {
+            num_wanted += wanted[i];
+        }
+    }
+    else {
+        while (maln->size < h.size) {
+            grow_alns_map_alignment(maln);
+        }
+    }
+    while (maln->size < num_wanted) {
+        grow_alns_map_alignment(maln);
+    }
+
+    num_wanted = 0;
+    for (i = 0; i < h.num_aln_seqs; i++) {
+        if ((wanted == NULL) || wanted[i]) {
+            copy_bin_rec(maln->AlnSeqArray[num_wanted++], &recs[i],
+                    ins, &h, heap, fn);
+        }
+    }
+    maln->num_aln_seqs = num_wanted;
+    free(wanted);
+
+    munmap((void*) map, file_len);
+    return maln;
+}
+
+/* Read a binary maln file, as written by write_ma_bin, into a new
+ MapAlignment. The file is mmapped, and everything is copied
+ straight out of it; only lengths and offsets are checked
+ */
+MapAlignmentP read_ma_bin(const char* fn) {
+    return load_ma_bin(fn, 0, 0, 0);
+}
+
+/* Read only what is needed to show reference positions
+ reg_start..reg_end (0-indexed) of a maln file: from a binary maln
+ with a region index, the reference and the AlnSeqs in the index
+ bins of the region; otherwise, everything, as read_ma does.
+ The AlnSeqs that overlap the region are the same either way
+ */
+MapAlignmentP read_ma_region(const char* fn, int reg_start, int reg_end) {
+    if (is_ma_bin(fn)) {
+        return load_ma_bin(fn, 1, reg_start, reg_end);
+    }
+    return read_ma(fn);
 }
 
 MapAlignmentP read_ma(const char* fn) {
@@ -391,6 +1024,10 @@ MapAlignmentP read_ma(const char* fn) {
     char c;
     int tmp, i, as_num, ins_pos, depth, row, A, C, G, T, N;
 
+    if (is_ma_bin(fn)) {
+        return read_ma_bin(fn);
+    }
+
     line = (char*) save_malloc((MAX_LINE_LEN + 1) * sizeof (char));
     MAF = fileOpen(fn, "r");
 
@@ -628,8 +1265,26 @@ int count_aln_seqs(MapAlignmentP maln) {
  Note that after this operation, any FragSeqDB pointing
  to this AlnSeqArray will be wrong! */
 void sort_aln_frags(MapAlignmentP maln) {
-    qsort((void*) maln->AlnSeqArray, (size_t) maln->num_aln_seqs,
-            sizeof (AlnSeqP), alnSeqCmp);
+    SortKeyP keys;
+    int i;
+
+    /* Pack start and end into keys; the sort is stable, so AlnSeqs
+       with the same coordinates stay in the order they were in */
+    keys = (SortKeyP) save_malloc(maln->num_aln_seqs * sizeof (SortKey));
+    for (i = 0; i < maln->num_aln_seqs; i++) {
+        keys[i].k[0] = int_sort_key(maln->AlnSeqArray[i]->start, 0);
+        keys[i].k[1] = int_sort_key(maln->AlnSeqArray[i]->end, 0);
+        keys[i].k[2] = 0;
+        keys[i].k[3] = 0;
+        keys[i].item = maln->AlnSeqArray[i];
+    }
+
+    sort_keys(keys, (size_t) maln->num_aln_seqs, maln->num_threads);
+
+    for (i = 0; i < maln->num_aln_seqs; i++) {
+        maln->AlnSeqArray[i] = (AlnSeqP) keys[i].item;
+    }
+    free(keys);
 }
 
 void print_assembly_summary(MapAlignmentP maln) {
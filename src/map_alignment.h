@@ -8,6 +8,7 @@
 #ifndef _MAP_ALIGNMENT_H
 #define	_MAP_ALIGNMENT_H
 
+#include <stddef.h>
 #include "types.h"
 #include "io.h"
 #include "config.h"
@@ -25,19 +26,55 @@ extern "C" {
 
     /* free_map_alignment
      Takes a MapAlignmentP (maln)
-     Frees the memory pointed to by its components
+     Frees the memory pointed to by its components; AlnSeqArray entries
+     past num_aln_seqs may be NULL
      Returns nothing
      */
     void free_map_alignment(MapAlignmentP maln);
 
 
+    /* copy_map_alignment
+     Takes a MapAlignmentP (maln)
+     Returns a new MapAlignment with its own copies of the reference,
+     the PSSMs and every AlnSeq, including their inserts, that stays
+     as it is while maln goes on changing; free it with
+     free_map_alignment
+     */
+    MapAlignmentP copy_map_alignment(MapAlignmentP maln);
+
     /* Write out the data in a MapAlignment data structure
      to a file
+     Returns 1 if success
+     0 if the file could not be opened or written
      */
     int write_ma(char* fn, MapAlignmentP maln);
 
+    /* Write out the data in a MapAlignment data structure
+     to a file in the binary maln format, described by MalnBinHeader
+     Returns 1 if success
+     0 if the file could not be opened or written
+     */
+    int write_ma_bin(char* fn, MapAlignmentP maln);
+
+    /* Read a maln file into a new MapAlignment; binary maln files,
+     which start with MALN_BIN_MAGIC, are handed to read_ma_bin
+     */
     MapAlignmentP read_ma(const char* fn);
 
+    /* Read a binary maln file, as written by write_ma_bin, into a new
+     MapAlignment. The file is mmapped, and everything is copied
+     straight out of it; only lengths and offsets are checked
+     */
+    MapAlignmentP read_ma_bin(const char* fn);
+
+    /* Read only what is needed to show reference positions
+     reg_start..reg_end (0-indexed) of a maln file: from a binary maln
+     with a region index, the reference and the AlnSeqs in the index
+     bins of the region; otherwise, everything, as read_ma does.
+     The AlnSeqs that overlap the region are the same either way
+     */
+    MapAlignmentP read_ma_region(const char* fn, int reg_start, int reg_end);
+
     /* Grow the space for a MapAlignment to twice its current
  size. Actually, just grow the array of aligned sequences.
  Copy the current aligned sequences into the new array
@@ -67,6 +104,21 @@ extern "C" {
     int get_consensus_length(MapAlignmentP maln);
     char* get_consensus(MapAlignmentP maln);
 
+    /* Takes a MapAlignmentP (maln), an array for the consensus, and
+     optionally (NULL if not wanted) arrays for the aligned reference,
+     the coverage, and the reference position of each consensus position,
+     all get_consensus_length(maln) + 1 long
+     Fills them in for every reference position and every insert position
+     before it, calling the consensus on maln->num_threads threads, each
+     working on CONS_CHUNK_LEN reference positions at a time
+     If skip_dropped, AlnSeqs marked dropped do not count toward the
+     consensus of reference positions. out_format 4 and 41 print each
+     position as it is called, so those are done on one thread, in order
+     Returns nothing
+     */
+    void fill_consensus(MapAlignmentP maln, char* consensus, char* aln_ref,
+            int* cov, int* ref_poss, int skip_dropped, int out_format);
+
 
     void print_assembly_summary(MapAlignmentP maln);
 
@@ -4,6 +4,7 @@
 #include "map_align.h"
 #include "map_alignment.h"
 #include "io.h"
+#include "sam.h"
 
 /*
     void * save_malloc(size_t size){
@@ -21,6 +22,11 @@ void help( void ) {
   printf( "   -f <output format>\n" );
   printf( "   -R <REGION_START:REGION_END>\n" );
   printf( "   -I <ID to assign to assembly sequence>\n" );
+  printf( "   -t <number of threads for calling the consensus; default = 1>\n" );
+  printf( "   -m <maln output file>\n" );
+  printf( "   -B write the -m output in the binary maln format\n" );
+  printf( "      (-M reads either format, so -f 0 -m converts between them)\n" );
+  printf( "   -o <SAM output file of the fragments; BAM if it ends in .bam>\n" );
   printf( "ma reports information from a maln assembly file as generated by mia\n" );
   printf( "How the assembly calls each base can be determined by the\n" );
   printf( "consensus code. 1 = highest, positive aggregate score base (if any)\n" );
@@ -84,17 +90,21 @@ void parse_region( char* reg_str, int* reg_start, int* reg_end ) {
 int main( int argc, char* argv[] ) {
   char mafn[MAX_FN_LEN+1];
   char ma_in_fn[MAX_FN_LEN+1];
+  char sam_fn[MAX_FN_LEN+1];
   char assign_id[MAX_ID_LEN+1];
   unsigned int any_arg;
   int id_assigned = 0; // Boolean, set to true if -I is given
   int cons_scheme;
   int out_ma   = 0;
+  int out_bin  = 0;  // Boolean; TRUE => -m output is a binary maln
+  int out_sam  = 0;  // Boolean; TRUE => write the fragments as SAM or BAM
   int in_ma    = 0;
   int no_dups  = 0; // allow duplicate ids by default - the user knows what he's doing
   int out_format = 1;
   int reg_start  = 90;
   int reg_end    = 109;
   int in_color   = 0;  // Output f6 format colored -> bad when you want to pipe it into a file
+  int num_threads = 1; // threads for calling the consensus
   MapAlignmentP maln;
   IDsListP rest_ids_list, // the IDs in the -i argument, if any, will go here
     used_ids_list;        // the IDs seen thusfar; just for this list,
@@ -109,7 +119,7 @@ int main( int argc, char* argv[] ) {
   cons_scheme = cons_scheme_def;
   score_int = -1.0; // Set the score intercept to -1 => not specified (yet)
   score_slo = -1.0; // Set the score intercept to -1 => not specified (yet)
-  while( (ich=getopt( argc, argv, "I:c:i:f:R:s:m:M:Cb:s:d" )) != -1 ) {
+  while( (ich=getopt( argc, argv, "I:c:i:f:R:s:m:M:Cb:s:dt:Bo:" )) != -1 ) {
     switch(ich) {
     case 'h' :
       help();
@@ -153,11 +163,26 @@ int main( int argc, char* argv[] ) {
       out_ma  = 1;
       any_arg = 1;
       break;
+    case 'B' :
+      out_bin = 1;
+      break;
+    case 'o' :
+      strcpy( sam_fn, optarg );
+      out_sam = 1;
+      any_arg = 1;
+      break;
     case 'M' :
       strcpy( ma_in_fn, optarg );
       in_ma   = 1;
       any_arg = 1;
       break;
+    case 't' :
+      num_threads = atoi( optarg );
+      if ( num_threads < 1 ) {
+	fprintf( stderr, "Need at least one thread\n" );
+	exit( 1 );
+      }
+      break;
     case 'd' :
       no_dups = 1;
       used_ids_list = init_ids_list();
@@ -179,7 +204,15 @@ int main( int argc, char* argv[] ) {
   /* Initialize maln, either from specified input file or 
      brand new */
   if ( in_ma ) {
-    maln = read_ma( ma_in_fn );
+    /* A region only needs the fragments overlapping it, which a
+       binary maln's region index finds without reading the rest */
+    if ( ((out_format == 6) || (out_format == 61)) &&
+	 !out_ma && !out_sam ) {
+      maln = read_ma_region( ma_in_fn, reg_start - 1, reg_end - 1 );
+    }
+    else {
+      maln = read_ma( ma_in_fn );
+    }
   }
 
   else {
@@ -189,6 +222,7 @@ int main( int argc, char* argv[] ) {
 
   /* Set the maln->cons_code to something reasonable */
   maln->cons_code = cons_scheme;
+  maln->num_threads = num_threads;
 
   /* Now input from all sources has been dealt with, we turn our 
      attention to output...*/
@@ -213,7 +247,18 @@ int main( int argc, char* argv[] ) {
 
   /* Write MapAlignment output to a file */
   if ( out_ma ) {
-    write_ma( mafn, maln );
+    if ( !(out_bin ? write_ma_bin( mafn, maln ) : write_ma( mafn, maln )) ) {
+      fprintf( stderr, "Could not write maln file %s\n", mafn );
+      exit( 1 );
+    }
+  }
+
+  /* Write the fragments as SAM or BAM */
+  if ( out_sam ) {
+    if ( !write_sam( sam_fn, maln, is_bam_fn( sam_fn ) ) ) {
+      fprintf( stderr, "Could not write alignments to %s\n", sam_fn );
+      exit( 1 );
+    }
   }
 
   exit( 0 );
@@ -54,6 +54,7 @@ MapAlignmentP init_culled_map_alignment( MapAlignmentP src_maln ) {
   culled_maln->size = src_maln->num_aln_seqs;
   culled_maln->cons_code = src_maln->cons_code;
   culled_maln->distant_ref = src_maln->distant_ref;
+  culled_maln->num_threads = src_maln->num_threads;
   return culled_maln;
 }
 
@@ -509,96 +510,35 @@ void cull_maln_from_fsdb( MapAlignmentP culled_maln,
    Takes a maln object
    Generates the consensus sequence string using the aligned data
    within the maln according to the maln->cons_code and puts it
-   in char* cons
+   in char* cons; calls it on maln->num_threads threads
    Returns char* pointer to consensus string
 */
 char* consensus_assembly_string ( MapAlignmentP maln ) {
 
-  int cons_pos, ref_pos, ref_gaps, j, num_gaps;
-  char ins_cons[MAX_INS_LEN + 1];
-  int  ins_cov[MAX_INS_LEN + 1];
-  char cons_base;
+  int cons_pos, i;
   char* cons;
-  AlnSeqP aln_seq; // pointer to currently considered aligned sequence
-  BaseCountsP bcs;
-  PSSMP psm;
-  
-  num_gaps = 0;
-
-  for( j = 0; j < maln->ref->seq_len; j++ ) {
-    num_gaps += maln->ref->gaps[j];
-  }
 
-  cons = (char*)save_malloc((maln->ref->seq_len + num_gaps +1) *
-		       sizeof(char));
+  cons = (char*)save_malloc((get_consensus_length( maln ) + 1) *
+			    sizeof(char));
   if ( cons == NULL){
       fprintf( stderr, "Not enough memory for cons\n" );
       exit(1);
   }
 
-  bcs = (BaseCountsP)save_malloc(sizeof(BaseCounts));
-  if ( bcs == NULL ) {
-    fprintf( stderr, "Not enough memories for bcs\n" );
-    exit( 1 );
-  }
-  reset_base_counts(bcs);
+  /* Call the consensus at every position of the reference sequence,
+     as it currently is, and the inserts before them, ignoring
+     dropped sequences */
+  fill_consensus( maln, cons, NULL, NULL, NULL, 1, 0 );
 
+  /* Where the consensus is a gap, i.e., nothing, do not write
+     this to the consensus assembly */
   cons_pos = 0;
-  ref_pos = 0;
-
-  /* Go through each position of the reference sequence, as it
-     currently is */
-  for ( ref_pos = 0; ref_pos < maln->ref->seq_len; ref_pos++ ) {
-    /* How many gaps preceed this position? */
-    ref_gaps = maln->ref->gaps[ref_pos];
-    if ( (ref_gaps > 0) &&
-	 (ref_pos  > 0) ) {
-      find_ins_cons( maln, ref_pos, ins_cons, ins_cov, 0 );
-      for ( j = 0; j < ref_gaps; j++ ) {
-	/* Consensus is a gap, i.e., nothing. So, do not write this
-	   to the consensus assembly */
-	if ( (ins_cons[j] == '-') ||
-	     (ins_cons[j] == ' ') ) {
-	  ;
-	}
-	else {
-	  cons[cons_pos] = ins_cons[j];
-	  cons_pos++;
-	}
-      }
+  for( i = 0; cons[i] != '\0'; i++ ) {
+    if ( (cons[i] != '-') && (cons[i] != ' ') ) {
+      cons[cons_pos++] = cons[i];
     }
-
-    /* Re-zero all base counts */
-    reset_base_counts(bcs);
-
-    /* Find all the aligned fragments that include this
-       position and make a consensus from it */
-    for( j = 0; j < maln->num_aln_seqs; j++ ) {
-      aln_seq = maln->AlnSeqArray[j];
-
-      /* Does this aligned fragment cover this position */
-      if ( (aln_seq->start <= ref_pos) &&
-	   (aln_seq->end   >= ref_pos) &&
-           !aln_seq->dropped ) {
-
-	if ( aln_seq->revcom ) {
-	  psm = maln->rpsm;
-	}
-	else {
-	  psm = maln->fpsm;
-	}
-
-	add_base( aln_seq->seq[ref_pos - aln_seq->start], 
-		  bcs, psm,
-		  aln_seq->smp[ref_pos - aln_seq->start] );
-      }
-    }
-    cons_base = find_consensus( bcs, maln->cons_code );
-    if ( (cons_base != '-') && (cons_base != ' ') ) 
-      cons[cons_pos++] = cons_base; 
   }
   cons[cons_pos] = '\0';
-  free( bcs );
   return cons;
 }
 
@@ -752,6 +692,9 @@ void dyn_prog( AlignmentP a ) {
   //is useful to avoid underflow from subtracting from the
   // smallest possible int
   int row_sm[5]; // row substitution matrix
+  const unsigned int* mask = a->align_mask;
+  const unsigned int epoch = a->mask_epoch;
+  const int mask_all = a->mask_all;
   
   /* Initialize */
   row = 0;
@@ -767,7 +710,7 @@ void dyn_prog( AlignmentP a ) {
 
   // First row, no penalty whether sg or not
   for( col = 0; col < a->len1; col++ ) {
-    if ( a->align_mask[col] ) {
+    if ( mask_all || (mask[col] == epoch) ) {
       a->m->mat[row][col].score =
 	row_sm[a->s1c[col]];
 
@@ -802,7 +745,7 @@ void dyn_prog( AlignmentP a ) {
       assert( 0 <= row && row < a->len2 ) ;
       assert( 0 <= col && col < a->len1 ) ;
     */
-    if ( a->align_mask[col] ) {
+    if ( mask_all || (mask[col] == epoch) ) {
       /* a->m->mat[row][col].score = 
 	sub_mat_score(a->s1c[col], a->s2c[row],
 	a->submat->sm, row, a->len2); */
@@ -824,7 +767,7 @@ void dyn_prog( AlignmentP a ) {
     // Subsequent columns
     a->best_gap_col = 0;
     for( col = 1; col < a->len1; col++ ) {
-      if ( a->align_mask[col] ) {
+      if ( mask_all || (mask[col] == epoch) ) {
 	/*	a->m->mat[row][col].score = 
 	  sub_mat_score(a->s1c[col], a->s2c[row],
 	  a->submat->sm, row, a->len2); */
@@ -996,15 +939,17 @@ AlignmentP init_alignment( int size1, int size2,
     return NULL;
   }
 
-  /* Allocate memories for the alignment masks */
+  /* Allocate memories for the alignment masks; no column carries
+     a valid stamp yet */
   al->align_mask = 
-    (unsigned char*)save_malloc(size2 * 
-			   sizeof(unsigned char));
+    (unsigned int*)calloc(size2, sizeof(unsigned int));
   if ( al->align_mask == NULL ) {
     return NULL;
   }
+  al->mask_size = size2;
+  al->mask_epoch = 1;
   /* Set it up to be all unmasked by default */
-  memset( al->align_mask, 1, size2 );
+  al->mask_all = 1;
 
   al->s1c = (short int*)save_malloc(size2 * sizeof(short int));
   al->best_gap_row = (int*)save_malloc(size2 * sizeof(int));
@@ -1497,14 +1442,24 @@ int populate_pwaln_to_begin( AlignmentP a, PWAlnFragP pwaln ) {
 }
 
 
-int sg_align ( MapAlignmentP maln, FragSeqP fs, FSDB fsdb, 
-	       AlignmentP fw_a, AlignmentP rc_a, 
-	       PWAlnFragP front_pwaln, 
-	       PWAlnFragP back_pwaln) {
+/* sg_align_frag
+   Args: (1) RefSeqP rs - the reference fw_a and rc_a are set up for
+         (2) FragSeqP fs - the sequence to align
+         (3) AlignmentP fw_a - forward alignment, with mask set
+         (4) AlignmentP rc_a - reverse complement alignment, with
+             mask set
+         (5) PWAlnFragP front_pwaln - where the best alignment goes
+   Returns: 1
+   Aligns fs to both strands of the reference and puts the better
+   alignment in front_pwaln. Sets the score, rc, as and ae fields of
+   fs. Nothing shared is changed, so different threads may call this
+   at the same time with their own fs, fw_a, rc_a and front_pwaln
+*/
+int sg_align_frag ( const RefSeqP rs, FragSeqP fs,
+		    AlignmentP fw_a, AlignmentP rc_a,
+		    PWAlnFragP front_pwaln ) {
   int max_fw_score = INT_MIN;
   int max_rc_score = INT_MIN;
-  RefSeqP rs;
-  rs = maln->ref;
   AlignmentP best_a;
 
   fw_a->seq2 = fs->seq;
@@ -1608,6 +1563,25 @@ int sg_align ( MapAlignmentP maln, FragSeqP fs, FSDB fsdb,
        demonstrate this for split_maln check */
     front_pwaln->end = front_pwaln->end - rs->seq_len;
   }
+  return 1;
+}
+
+/* merge_sg_align
+   Args: (1) MapAlignmentP maln - where alignments are merged
+         (2) FragSeqP fs - sequence aligned by sg_align_frag
+         (3) FSDB fsdb - where good sequences are kept
+         (4) PWAlnFragP front_pwaln - alignment from sg_align_frag
+         (5) PWAlnFragP back_pwaln - space for the part of the
+             alignment behind the wrap point
+   Returns: 1 if success; 0 if failure
+   If the alignment is good enough (or maln->distant_ref), splits it
+   at the wrap point, merges it into maln and adds fs to fsdb
+*/
+int merge_sg_align ( MapAlignmentP maln, FragSeqP fs, FSDB fsdb,
+		     PWAlnFragP front_pwaln,
+		     PWAlnFragP back_pwaln ) {
+  RefSeqP rs;
+  rs = maln->ref;
 
   /* Quit now if score is not good enough and distant_ref is not
      true */
@@ -1664,3 +1638,11 @@ int sg_align ( MapAlignmentP maln, FragSeqP fs, FSDB fsdb,
   return 1;
 }
 
+int sg_align ( MapAlignmentP maln, FragSeqP fs, FSDB fsdb, 
+	       AlignmentP fw_a, AlignmentP rc_a, 
+	       PWAlnFragP front_pwaln, 
+	       PWAlnFragP back_pwaln) {
+  sg_align_frag( maln->ref, fs, fw_a, rc_a, front_pwaln );
+  return merge_sg_align( maln, fs, fsdb, front_pwaln, back_pwaln );
+}
+
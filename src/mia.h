@@ -7,6 +7,7 @@
 #include "fsdb.h"
 #include "pssm.h"
 #include "kmer.h"
+#include "sam.h"
 #include "assert.h"
 #include "params.h"
 
@@ -68,7 +69,7 @@ void cull_maln_from_fsdb( MapAlignmentP culled_maln,
    Takes a maln object
    Generates the consensus sequence string using the aligned data
    within the maln according to the maln->cons_code and puts it
-   in char* cons
+   in char* cons; calls it on maln->num_threads threads
    Returns char* pointer to consensus string
 */
 char* consensus_assembly_string ( MapAlignmentP maln ) ;
@@ -209,6 +210,43 @@ void split_pwaln (PWAlnFragP front_pwaln, PWAlnFragP back_pwaln,
 int populate_pwaln_to_begin( AlignmentP a, PWAlnFragP pwaln ) ;
 
 
+/* sg_align_frag
+   Args: (1) RefSeqP rs - the reference fw_a and rc_a are set up for
+         (2) FragSeqP fs - the sequence to align
+         (3) AlignmentP fw_a - forward alignment, with mask set
+         (4) AlignmentP rc_a - reverse complement alignment, with
+             mask set
+         (5) PWAlnFragP front_pwaln - where the best alignment goes
+   Returns: 1
+   Aligns fs to both strands of the reference and puts the better
+   alignment in front_pwaln. Sets the score, rc, as and ae fields of
+   fs. Nothing shared is changed, so different threads may call this
+   at the same time with their own fs, fw_a, rc_a and front_pwaln
+*/
+int sg_align_frag ( const RefSeqP rs, FragSeqP fs,
+		    AlignmentP fw_a, AlignmentP rc_a,
+		    PWAlnFragP front_pwaln ) ;
+
+/* merge_sg_align
+   Args: (1) MapAlignmentP maln - where alignments are merged
+         (2) FragSeqP fs - sequence aligned by sg_align_frag
+         (3) FSDB fsdb - where good sequences are kept
+         (4) PWAlnFragP front_pwaln - alignment from sg_align_frag
+         (5) PWAlnFragP back_pwaln - space for the part of the
+             alignment behind the wrap point
+   Returns: 1 if success; 0 if failure
+   If the alignment is good enough (or maln->distant_ref), splits it
+   at the wrap point, merges it into maln and adds fs to fsdb
+*/
+int merge_sg_align ( MapAlignmentP maln, FragSeqP fs, FSDB fsdb,
+		     PWAlnFragP front_pwaln,
+		     PWAlnFragP back_pwaln ) ;
+
+/* sg_align
+   Aligns fs with sg_align_frag and merges the result with
+   merge_sg_align
+   Returns: 1 if success; 0 if failure
+*/
 int sg_align ( MapAlignmentP maln, FragSeqP fs, FSDB fsdb,
 	       AlignmentP fw_a, AlignmentP rc_a,
 	       PWAlnFragP front_pwaln,
@@ -4,40 +4,530 @@
 #include <dirent.h>
 #include <libgen.h>
 #include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 
 
 
+/* realign_frag
+   Args: (1) RealignP with the new reference and how to align to it
+         (2) FragSeqP to realign
+	 (3) AlignmentP big enough for the alignment; not shared
+	 (4) PWAlnFragP to write the alignment into
+   Aligns fs to the new reference, using the as and ae fields to
+   narrow down where the alignment happens, and updates the fs
+   alignment stats. Touches nothing but fs, a, and front_pwaln
+   Returns: 1 if fs was aligned and front_pwaln is valid, 0 if not
+*/
+static int realign_frag( RealignP rp, FragSeqP fs, AlignmentP a,
+			 PWAlnFragP front_pwaln ) {
+  int j,
+    ref_start,
+    ref_end,
+    ref_frag_len,
+    max_score,
+    aln_seq_len;
+  char tmp_rc[INIT_ALN_SEQ_LEN + 1];
+
+  /* Special case of distant reference and 
+     !fs->strand_known => try to realign both strands
+     against the entire reference to learn the 
+     strand and alignment region
+  */
+  if ( rp->distant_ref &&
+       (fs->strand_known == 0 ) &&
+       (rp->iter_num > 1) ) {
+    ref_start = 0;
+    ref_end = rp->ref->wrap_seq_len;
+    ref_frag_len = ref_end - ref_start;
+    a->seq1 = &rp->ref->seq[0];
+    a->len1 = ref_frag_len;
+    pop_s1c_in_a( a );
+    a->submat = rp->ancsubmat;
+    a->seq2 = fs->seq;
+    a->len2 = strlen( a->seq2 );
+    if ( (rp->loc_filt == NULL) ||
+	 kmer_localize( a->seq2, a->len2, rp->loc_filt, a ) ) {
+      pop_s2c_in_a( a );
+      if ( a->hp ) {
+	pop_hpl_and_hps( a->seq2, a->len2, a->hprl, a->hprs );
+	pop_hpl_and_hps( a->seq1, a->len1, a->hpcl, a->hpcs );
+      }
+      /* Align it! */
+      dyn_prog( a );
+      /* Find the best forward score */
+      max_score = max_sg_score( a );
+      if ( max_score > FIRST_ROUND_SCORE_CUTOFF ) {
+	fs->strand_known = 1;
+	fs->rc = 0;
+	find_align_begin( a );
+	fs->as = a->abc;
+	fs->ae = a->aec;
+	fs->score = max_score;
+      }
+    }
+
+    /* Now, try reverse complement */
+    aln_seq_len = strlen( fs->seq );
+    a->submat = rp->rcancsubmat;
+    for ( j = 0; j < aln_seq_len; j++ ) {
+      tmp_rc[j] = revcom_char(fs->seq[aln_seq_len-(j+1)]);
+    }
+    tmp_rc[aln_seq_len] = '\0';
+    a->seq2 = tmp_rc;
+    if ( (rp->loc_filt == NULL) ||
+	 kmer_localize( a->seq2, a->len2, rp->loc_filt, a ) ) {
+      pop_s2c_in_a( a );
+      if ( a->hp ) {
+	pop_hpl_and_hps( a->seq2, a->len2, a->hprl, a->hprs );
+	pop_hpl_and_hps( a->seq1, a->len1, a->hpcl, a->hpcs );
+      }
+      dyn_prog( a );
+      max_score = max_sg_score( a );
+      if ( (max_score > FIRST_ROUND_SCORE_CUTOFF) &&
+	   (max_score > fs->score) ) {
+	fs->strand_known = 1;
+	fs->rc = 1;
+	find_align_begin( a );
+	fs->as = a->abc;
+	fs->ae = a->aec;
+	fs->score = max_score;
+	strcpy( fs->seq, tmp_rc );
+      }
+    }
+
+    /* Realignment below is always unmasked */
+    unmask_alignment( a );
+  }
+
+  /* Do we know the strand (either because we've always
+     known it or we just learned it, doesn't matter) */
+  if ( fs->strand_known ) {
+    if ( fs->rc ) {
+      a->submat = rp->rcancsubmat;
+    }
+    else {
+      a->submat = rp->ancsubmat;
+    }
+
+    a->seq2 = fs->seq;
+    a->len2 = strlen( a->seq2 );
+    pop_s2c_in_a( a );
+
+    /* Set up the alignment limits on the reference */
+    if ( ((fs->as - REALIGN_BUFFER) < 0 ) ) {
+      ref_start = 0;
+    }
+    else {
+      ref_start = (fs->as - REALIGN_BUFFER);
+    }
+    if ( (fs->ae + REALIGN_BUFFER + 1) > 
+	 rp->ref->wrap_seq_len ) {
+      ref_end = rp->ref->wrap_seq_len;
+    }
+    else {
+      ref_end = fs->ae + REALIGN_BUFFER;
+    }
+
+    /* Check to make sure the regions encompassed by ref_start to
+       ref_end is reasonable given how long this fragment is. If
+       not, just realign this whole mofo again because the reference
+       has probably changed a lot between iterations */
+    if ( (ref_start + a->len2) > ref_end ) {
+      ref_start = 0;
+      ref_end = rp->ref->wrap_seq_len;
+    }
+
+    ref_frag_len = ref_end - ref_start;
+    a->seq1 = &rp->ref->seq[ref_start];
+    a->len1 = ref_frag_len;
+    pop_s1c_in_a( a );
+
+    /* If we want the homopolymer discount, the necessary arrays of
+       hp starts and lengths must be set up anew */
+    if ( a->hp ) {
+      pop_hpl_and_hps( a->seq2, a->len2, a->hprl, a->hprs );
+      pop_hpl_and_hps( a->seq1, a->len1, a->hpcl, a->hpcs );
+    }
+
+    /* Align it! */
+    dyn_prog( a );
+
+    /* Find the best score */
+    max_score = max_sg_score( a );
+
+    find_align_begin( a );
+
+    /* First, put all alignment in front_pwaln */
+    populate_pwaln_to_begin( a, front_pwaln );
+
+    /* Load up front_pwaln */
+    strcpy( front_pwaln->ref_id, rp->ref->id );
+    strcpy( front_pwaln->ref_desc, rp->ref->desc );
+
+    strcpy( front_pwaln->frag_id, fs->id );
+    strcpy( front_pwaln->frag_desc, fs->desc );
+
+    front_pwaln->trimmed = fs->trimmed;
+    front_pwaln->revcom  = fs->rc;
+    front_pwaln->num_inputs = fs->num_inputs;
+    front_pwaln->segment = 'a';
+    front_pwaln->score = a->best_score;
+
+    front_pwaln->start = a->abc + ref_start;
+    front_pwaln->end   = a->aec + ref_start;
+
+    /* Update stats for this FragSeq */
+    fs->as = a->abc + ref_start;
+    fs->ae = a->aec + ref_start;
+    fs->unique_best = 1;
+    fs->score = a->best_score;
+
+    if ( front_pwaln->end > rp->ref->seq_len ) {
+      /* This alignment wraps around - adjust the end to
+	 demonstrate this for split_maln check */
+      front_pwaln->end = front_pwaln->end - rp->ref->seq_len;
+    }
+  }
+  return fs->strand_known;
+}
+
+/* realign_cost
+   Args: (1) RealignP with the new reference and how to align to it
+         (2) FragSeqP to estimate for
+   Returns: the number of dynamic programming cells realign_frag
+            will fill for fs, as far as can be told beforehand
+   A sequence of unknown strand is aligned both ways against the
+   entire reference; one of known strand only against the window
+   around where it was last time. With rp->loc_filt, where the
+   sequence of unknown strand shares kmers is not known until it is
+   localized, so it is taken to be one window on each strand, with
+   the masked rest of each row MASKED_CELL_RATIO times cheaper
+*/
+static size_t realign_cost( RealignP rp, FragSeqP fs ) {
+  size_t len, ref_start, ref_end;
+
+  len = strlen( fs->seq );
+  if ( !fs->strand_known ) {
+    if ( !rp->distant_ref || (rp->iter_num <= 1) ) {
+      return 0;
+    }
+    if ( rp->loc_filt != NULL ) {
+      return 2 * len * ( len + 2 * ALIGN_MASK_BUFFER +
+			 rp->ref->wrap_seq_len / MASKED_CELL_RATIO );
+    }
+    return 2 * len * rp->ref->wrap_seq_len;
+  }
+
+  ref_start = (fs->as > REALIGN_BUFFER) ? (fs->as - REALIGN_BUFFER) : 0;
+  ref_end = fs->ae + REALIGN_BUFFER;
+  if ( ref_end >= (size_t)rp->ref->wrap_seq_len ) {
+    ref_end = rp->ref->wrap_seq_len;
+  }
+  if ( (ref_start + len) > ref_end ) {
+    return len * rp->ref->wrap_seq_len;
+  }
+  return len * (ref_end - ref_start);
+}
+
+/* read_cost_cmp
+   Args: (1) two ReadCostPs, passed as void* for qsort
+   Returns: negative if the first should be claimed first, positive
+            if the second, ordering by cost, most expensive first,
+	    then by index so the order is always the same
+*/
+static int read_cost_cmp( const void* rc1_, const void* rc2_ ) {
+  const ReadCost* rc1 = (const ReadCost*)rc1_;
+  const ReadCost* rc2 = (const ReadCost*)rc2_;
+  if ( rc1->cost != rc2->cost ) {
+    return (rc1->cost > rc2->cost) ? -1 : 1;
+  }
+  if ( rc1->inx != rc2->inx ) {
+    return (rc1->inx < rc2->inx) ? -1 : 1;
+  }
+  return 0;
+}
+
+/* realign_seq
+   Args: (1) AlnWorkerP
+         (2) RealignBatchP being aligned
+         (3) index in b->fss of the sequence to realign
+   Returns: void
+   Realigns one sequence with the worker's own fw_align, leaving
+   the result in the batch for merging
+*/
+static void realign_seq( AlnWorkerP w, RealignBatchP b, size_t i ) {
+  RealignP rp = w->rp;
+
+  b->aligned[i] = realign_frag( rp, b->fss[i], w->fw_align,
+				&b->pwalns[i] );
+  if ( b->aligned[i] &&
+       (b->pwalns[i].start > b->pwalns[i].end) ) {
+    /* Move wrapped bit to back_pwalns */
+    split_pwaln( &b->pwalns[i], &b->back_pwalns[i],
+		 rp->ref->seq_len );
+    b->aligned[i] = 2;
+  }
+}
+
+/* merge_seq
+   Args: (1) AlnWorkerP
+         (2) RealignBatchP given its AlnSeqs by give_aln_seqs
+         (3) index in b->fss of the sequence to merge
+   Returns: void
+   Fills the sequence's AlnSeqs, lengthening the worker's own gaps
+   array. Touches nothing shared except those AlnSeqs and the
+   sequence's FragSeq, so it is safe while rp->maln grows
+*/
+static void merge_seq( AlnWorkerP w, RealignBatchP b, size_t i ) {
+  FragSeqP fs;
+
+  if ( b->aligned[i] == 0 ) {
+    return;
+  }
+  fs = b->fss[i];
+  pwaln_to_aln_seq( &b->pwalns[i], b->front_asps[i], w->gaps );
+  fs->front_asp = b->front_asps[i];
+  if ( b->aligned[i] == 2 ) {
+    pwaln_to_aln_seq( &b->back_pwalns[i], b->back_asps[i], w->gaps );
+    fs->back_asp = b->back_asps[i];
+  }
+}
+
+/* reduce_gaps
+   Args: (1) RealignP whose workers are all done merging
+         (2) number of the gaps merging job
+   Returns: Boolean; FALSE => there is no such job
+   Sets rp->maln->ref->gaps in the job's GAP_REDUCE_CHUNK reference
+   positions to the longest insert any worker saw there. This is
+   the same as every worker having lengthened the one gaps array
+   in turn
+*/
+static int reduce_gaps( RealignP rp, size_t i ) {
+  int* gaps = rp->maln->ref->gaps;
+  size_t pos, end;
+  int t;
+
+  pos = i * GAP_REDUCE_CHUNK;
+  if ( pos > (size_t)rp->maln->ref->wrap_seq_len ) {
+    return 0;
+  }
+  end = pos + GAP_REDUCE_CHUNK;
+  if ( end > (size_t)rp->maln->ref->wrap_seq_len + 1 ) {
+    end = rp->maln->ref->wrap_seq_len + 1;
+  }
+  for( ; pos < end; pos++ ) {
+    for( t = 0; t < rp->num_workers; t++ ) {
+      if ( rp->workers[t].gaps[pos] > gaps[pos] ) {
+	gaps[pos] = rp->workers[t].gaps[pos];
+      }
+    }
+  }
+  return 1;
+}
+
+/* load_realign_batch
+   Args: (1) RealignP
+         (2) number of the batch of rp->fsdb to set up
+   Returns: void
+   Sets up the batch in its place in rp->batches, which no worker is
+   using any more, sorting it so the most expensive sequences are
+   claimed first and no thread is left with a long one when the
+   others are done
+*/
+static void load_realign_batch( RealignP rp, size_t n ) {
+  RealignBatchP b = &rp->batches[n % REALIGN_BATCHES];
+  size_t k;
+
+  b->fss = &rp->fsdb->fss[n * REALIGN_BATCH];
+  b->num_seqs = rp->fsdb->num_fss - n * REALIGN_BATCH;
+  if ( b->num_seqs > REALIGN_BATCH ) {
+    b->num_seqs = REALIGN_BATCH;
+  }
+  for( k = 0; k < b->num_seqs; k++ ) {
+    b->order[k].cost = realign_cost( rp, b->fss[k] );
+    b->order[k].inx = k;
+  }
+  qsort( b->order, b->num_seqs, sizeof(ReadCost), read_cost_cmp );
+  b->next_align = 0;
+  b->num_aligned = 0;
+  b->next_merge = 0;
+  b->num_merged = 0;
+}
+
+/* give_aln_seqs
+   Args: (1) RealignP all of whose earlier batches have their AlnSeqs
+         (2) RealignBatchP whose sequences are all aligned
+   Returns: void
+   Gives each alignment in the batch the AlnSeqs it would have had if
+   merged in fsdb order, growing rp->maln as needed. Nothing else
+   touches rp->maln meanwhile; the AlnSeqs themselves never move, so
+   earlier batches can go on being merged
+*/
+static void give_aln_seqs( RealignP rp, RealignBatchP b ) {
+  MapAlignmentP maln = rp->maln;
+  size_t k;
+  int slot;
+
+  slot = maln->num_aln_seqs;
+  for( k = 0; k < b->num_seqs; k++ ) {
+    maln->num_aln_seqs += b->aligned[k];
+  }
+  while( maln->num_aln_seqs > maln->size ) {
+    if ( !grow_alns_map_alignment( maln ) ) {
+      exit( 1 );
+    }
+  }
+  for( k = 0; k < b->num_seqs; k++ ) {
+    if ( b->aligned[k] > 0 ) {
+      b->front_asps[k] = maln->AlnSeqArray[slot];
+    }
+    if ( b->aligned[k] == 2 ) {
+      b->back_asps[k] = maln->AlnSeqArray[slot + 1];
+    }
+    slot += b->aligned[k];
+  }
+}
+
+/* realign_worker
+   Args: (1) AlnWorkerP, passed as void* for pthread_create
+   Returns: NULL
+   One of the threads realigning the worker's Realign, from start to
+   finish. Under rp->lock, takes the first thing there is to do of:
+   giving the oldest aligned batch its AlnSeqs, merging a sequence,
+   setting up the next batch if there is room for it, or aligning
+   a sequence; does it without the lock, and waits on rp->changed
+   if there is nothing yet. So one batch is merged while the next
+   is aligned. Once every batch is merged, claims gaps merging jobs
+   until there are none left
+*/
+static void* realign_worker( void* arg ) {
+  AlnWorkerP w = (AlnWorkerP)arg;
+  RealignP rp = w->rp;
+  RealignBatchP b;
+  size_t i;
+
+  pthread_mutex_lock( &rp->lock );
+  while( 1 ) {
+    if ( !rp->assigning && (rp->slot_batch < rp->num_loaded) ) {
+      b = &rp->batches[rp->slot_batch % REALIGN_BATCHES];
+      if ( b->num_aligned == b->num_seqs ) {
+	rp->assigning = 1;
+	pthread_mutex_unlock( &rp->lock );
+	give_aln_seqs( rp, b );
+	pthread_mutex_lock( &rp->lock );
+	rp->assigning = 0;
+	rp->slot_batch++;
+	pthread_cond_broadcast( &rp->changed );
+	continue;
+      }
+    }
+
+    if ( rp->merge_batch < rp->slot_batch ) {
+      b = &rp->batches[rp->merge_batch % REALIGN_BATCHES];
+      i = b->next_merge++;
+      if ( b->next_merge == b->num_seqs ) {
+	rp->merge_batch++;
+      }
+      pthread_mutex_unlock( &rp->lock );
+      merge_seq( w, b, i );
+      pthread_mutex_lock( &rp->lock );
+      b->num_merged++;
+      /* Batches done merging make room for the next ones */
+      while( rp->done_batch < rp->merge_batch ) {
+	b = &rp->batches[rp->done_batch % REALIGN_BATCHES];
+	if ( b->num_merged < b->num_seqs ) {
+	  break;
+	}
+	rp->done_batch++;
+	pthread_cond_broadcast( &rp->changed );
+      }
+      continue;
+    }
+
+    if ( !rp->loading && (rp->num_loaded < rp->num_batches) &&
+	 (rp->num_loaded < rp->done_batch + REALIGN_BATCHES) ) {
+      rp->loading = 1;
+      i = rp->num_loaded;
+      pthread_mutex_unlock( &rp->lock );
+      load_realign_batch( rp, i );
+      pthread_mutex_lock( &rp->lock );
+      rp->loading = 0;
+      rp->num_loaded++;
+      pthread_cond_broadcast( &rp->changed );
+      continue;
+    }
+
+    if ( rp->align_batch < rp->num_loaded ) {
+      b = &rp->batches[rp->align_batch % REALIGN_BATCHES];
+      i = b->order[b->next_align++].inx;
+      if ( b->next_align == b->num_seqs ) {
+	rp->align_batch++;
+      }
+      pthread_mutex_unlock( &rp->lock );
+      realign_seq( w, b, i );
+      pthread_mutex_lock( &rp->lock );
+      b->num_aligned++;
+      continue;
+    }
+
+    if ( rp->done_batch == rp->num_batches ) {
+      i = rp->next_chunk++;
+      pthread_mutex_unlock( &rp->lock );
+      if ( !reduce_gaps( rp, i ) ) {
+	return NULL;
+      }
+      pthread_mutex_lock( &rp->lock );
+      continue;
+    }
+
+    pthread_cond_wait( &rp->changed, &rp->lock );
+  }
+}
+
 /* reiterate_assembly
    Args: (1) a pointer to a sequence to be used as the new reference
-         (2) a MapAlignmentP big enough to store all the alignments
-	 (3) a FSDB with sequences to be realigned
-	 (4) a AlignmentP big enough for the alignments
-	 (5) a front PWAlnFragP for storing front alignments
-	 (6) a back PWAlnFragP for storing back alignments
+         (2) iteration number
+         (3) a MapAlignmentP big enough to store all the alignments
+	 (4) a FSDB with sequences to be realigned
+	 (5) array of num_threads AlnWorkers, each with a fw_align
+	     big enough for the alignments
+	 (6) number of threads to realign with
 	 (7) a PSSMP with the forward substitution matrices
 	 (8) a PSSMP with the revcom substitution matrices
+	 (9) a SeedP for indexing the new reference to localize
+	     sequences of unknown strand with; NULL => align those
+	     to the entire reference
+	 (10) kmers occurring more often than this in the new
+	      reference are repetitive when localizing
    Aligns all the FragSeqs from fsdb to the new reference, using the
    as and ae fields to narrow down where the alignment happens
+   The same num_threads threads, this one among them, align batches
+   of sequences and merge them into the maln, merging one batch
+   while aligning the next, and only wait for each other once all
+   are merged. Each alignment goes
+   into the AlnSeqArray slot it would have had if merged in fsdb
+   order, and the ref gaps are the maximum over what each thread
+   saw, so the result does not depend on the number of threads
    Resets the maln and writes all the results there
    Returns void
 */
 void reiterate_assembly( char* new_ref_seq, int iter_num,
 			 MapAlignmentP maln,
-			 FSDB fsdb, AlignmentP a, 
-			 PWAlnFragP front_pwaln,
-			 PWAlnFragP back_pwaln, 
+			 FSDB fsdb, AlnWorkerP workers,
+			 int num_threads,
 			 PSSMP ancsubmat,
-			 PSSMP rcancsubmat ) {
-  int i, j,
+			 PSSMP rcancsubmat,
+			 SeedP loc_seed,
+			 int max_kmer_freq ) {
+  int i, j, t,
     ref_len,
-    ref_start, 
-    ref_end,
-    ref_frag_len, 
-    max_score,
     aln_seq_len;
-  FragSeqP fs;
+  pthread_t* threads;
+  AlignmentP a;
+  Realign realign;
+  RealignBatchP b;
   char iter_ref_id[MAX_ID_LEN + 1];
-  char tmp_rc[INIT_ALN_SEQ_LEN + 1];
   char iter_ref_desc[] = "iteration assembly";
 
   /* Set up maln->ref
@@ -92,193 +582,558 @@ void reiterate_assembly( char* new_ref_seq, int iter_num,
   }
 
   /* Now, remake the hpcl and hprl arrays if hp_special */
-  if ( a->hp ) {
-    free( a->hpcl );
-    free( a->hpcs );
-    a->hpcl = (int*)save_malloc(maln->ref->wrap_seq_len*sizeof(int));
-    a->hpcs = (int*)save_malloc(maln->ref->wrap_seq_len*sizeof(int));
-    pop_hpl_and_hps( maln->ref->seq, 
-		     maln->ref->wrap_seq_len,
-		     a->hpcl, a->hpcs );     
+  for( t = 0; t < num_threads; t++ ) {
+    a = workers[t].fw_align;
+    if ( a->hp ) {
+      free( a->hpcl );
+      free( a->hpcs );
+      a->hpcl = (int*)save_malloc(maln->ref->wrap_seq_len*sizeof(int));
+      a->hpcs = (int*)save_malloc(maln->ref->wrap_seq_len*sizeof(int));
+      pop_hpl_and_hps( maln->ref->seq, 
+		       maln->ref->wrap_seq_len,
+		       a->hpcl, a->hpcs );     
+    }
   }
 
   /* Reset the number of aligned sequences in the maln */
   maln->num_aln_seqs = 0;
 
+  /* If sequences of unknown strand will be tried against the
+     whole reference, index it so they only have to be aligned
+     where they share kmers with it */
+  realign.loc_filt = NULL;
+  if ( maln->distant_ref && (iter_num > 1) && (loc_seed != NULL) ) {
+    realign.loc_filt = init_kmer_filter( maln->ref, loc_seed, 0, 0,
+					 max_kmer_freq );
+  }
+
+  realign.batches = (RealignBatch*)save_malloc(REALIGN_BATCHES * sizeof(RealignBatch));
+  for( i = 0; i < REALIGN_BATCHES; i++ ) {
+    b = &realign.batches[i];
+    b->pwalns = (PWAlnFrag*)save_malloc(REALIGN_BATCH * sizeof(PWAlnFrag));
+    b->back_pwalns = (PWAlnFrag*)save_malloc(REALIGN_BATCH * sizeof(PWAlnFrag));
+    b->aligned = (int*)save_malloc(REALIGN_BATCH * sizeof(int));
+    b->front_asps = (AlnSeqP*)save_malloc(REALIGN_BATCH * sizeof(AlnSeqP));
+    b->back_asps = (AlnSeqP*)save_malloc(REALIGN_BATCH * sizeof(AlnSeqP));
+    b->order = (ReadCost*)save_malloc(REALIGN_BATCH * sizeof(ReadCost));
+  }
+  pthread_mutex_init( &realign.lock, NULL );
+  pthread_cond_init( &realign.changed, NULL );
+  realign.fsdb = fsdb;
+  realign.maln = maln;
+  realign.workers = workers;
+  realign.num_workers = num_threads;
+  realign.ref = maln->ref;
+  realign.ancsubmat = ancsubmat;
+  realign.rcancsubmat = rcancsubmat;
+  realign.distant_ref = maln->distant_ref;
+  realign.iter_num = iter_num;
+  for( t = 0; t < num_threads; t++ ) {
+    workers[t].rp = &realign;
+    workers[t].gaps = 
+      (int*)save_malloc((maln->ref->wrap_seq_len+1) * sizeof(int));
+    for( i = 0; i <= maln->ref->wrap_seq_len; i++ ) {
+      workers[t].gaps[i] = 0;
+    }
+  }
+
   /* OK, ref is set up. Let's go through all the sequences in fsdb
-     and re-align them to the new reference. 
+     a batch at a time and re-align them to the new reference. 
      If it's a revcom alignment,
      just use the rcancsubmat */
-  for( i = 0; i < fsdb->num_fss; i++ ) {
-    fs = fsdb->fss[i];
+  realign.num_batches = (fsdb->num_fss + REALIGN_BATCH - 1) / REALIGN_BATCH;
+  realign.num_loaded = 0;
+  realign.align_batch = 0;
+  realign.slot_batch = 0;
+  realign.merge_batch = 0;
+  realign.done_batch = 0;
+  realign.next_chunk = 0;
+  realign.loading = 0;
+  realign.assigning = 0;
+  threads = (pthread_t*)save_malloc(num_threads * sizeof(pthread_t));
+  for( t = 1; t < num_threads; t++ ) {
+    if ( pthread_create( &threads[t], NULL,
+			 realign_worker, &workers[t] ) != 0 ) {
+      fprintf( stderr, "Could not start alignment thread %d\n", t );
+      exit( 1 );
+    }
+  }
+  realign_worker( &workers[0] );
+  for( t = 1; t < num_threads; t++ ) {
+    pthread_join( threads[t], NULL );
+  }
+  free( threads );
 
-    /* Special case of distant reference and 
-       !fs->strand_known => try to realign both strands
-       against the entire reference to learn the 
-       strand and alignment region
-    */
-    if ( maln->distant_ref &&
-	 (fs->strand_known == 0 ) &&
-	 (iter_num > 1) ) {
-      ref_start = 0;
-      ref_end = maln->ref->wrap_seq_len;
-      ref_frag_len = ref_end - ref_start;
-      a->seq1 = &maln->ref->seq[0];
-      a->len1 = ref_frag_len;
-      pop_s1c_in_a( a );
-      a->seq2 = fs->seq;
-      a->len2 = strlen( a->seq2 );
-      pop_s2c_in_a( a );
-      if ( a->hp ) {
-	pop_hpl_and_hps( a->seq2, a->len2, a->hprl, a->hprs );
-	pop_hpl_and_hps( a->seq1, a->len1, a->hpcl, a->hpcs );
-      }
-      /* Align it! */
-      dyn_prog( a );
-      /* Find the best forward score */
-      max_score = max_sg_score( a );
-      if ( max_score > FIRST_ROUND_SCORE_CUTOFF ) {
-	fs->strand_known = 1;
-	fs->rc = 0;
-	find_align_begin( a );
-	fs->as = a->abc;
-	fs->ae = a->aec;
-	fs->score = max_score;
-      }
+  for( t = 0; t < num_threads; t++ ) {
+    free( workers[t].gaps );
+    workers[t].gaps = NULL;
+  }
+  for( i = 0; i < REALIGN_BATCHES; i++ ) {
+    b = &realign.batches[i];
+    free( b->pwalns );
+    free( b->back_pwalns );
+    free( b->aligned );
+    free( b->front_asps );
+    free( b->back_asps );
+    free( b->order );
+  }
+  free( realign.batches );
+  pthread_mutex_destroy( &realign.lock );
+  pthread_cond_destroy( &realign.changed );
+  free_kmer_filter( realign.loc_filt );
+  return;
+}
 
-      /* Now, try reverse complement */
-      aln_seq_len = strlen( fs->seq );
-      a->submat = rcancsubmat;
-      for ( j = 0; j < aln_seq_len; j++ ) {
-	tmp_rc[j] = revcom_char(fs->seq[aln_seq_len-(j+1)]);
-      }
-      tmp_rc[aln_seq_len] = '\0';
-      a->seq2 = tmp_rc;
-      pop_s2c_in_a( a );
-      if ( a->hp ) {
-	pop_hpl_and_hps( a->seq2, a->len2, a->hprl, a->hprs );
-	pop_hpl_and_hps( a->seq1, a->len1, a->hpcl, a->hpcs );
-      }
-      dyn_prog( a );
-      max_score = max_sg_score( a );
-      if ( (max_score > FIRST_ROUND_SCORE_CUTOFF) &&
-	   (max_score > fs->score) ) {
-	fs->strand_known = 1;
-	fs->rc = 1;
-	find_align_begin( a );
-	fs->as = a->abc;
-	fs->ae = a->aec;
-	fs->score = max_score;
-	strcpy( fs->seq, tmp_rc );
-      }
-    }
 
-    /* Do we know the strand (either because we've always
-       known it or we just learned it, doesn't matter) */
-    if ( fs->strand_known ) {
-      if ( fs->rc ) {
-	a->submat = rcancsubmat;
-      }
-      else {
-	a->submat = ancsubmat;
-      }
+/* init_ref_alignment
+   Args: (1) RefSeqP ref - with seq and rcseq ready
+         (2) boolean; TRUE => align to ref->rcseq
+         (3) boolean; TRUE => reference is circular
+         (4) boolean; TRUE => homopolymer gap discount
+   Returns: AlignmentP for aligning sequences to the whole reference
+*/
+static AlignmentP init_ref_alignment( RefSeqP ref, int rc,
+				      int circular, int hp_special ) {
+  AlignmentP a;
+  a = (AlignmentP)init_alignment( INIT_ALN_SEQ_LEN,
+				  (ref->wrap_seq_len + 
+				   (2*INIT_ALN_SEQ_LEN)),
+				  rc, hp_special );
+  if ( a == NULL ) {
+    fprintf( stderr, "Not enough memories for aligning to the reference\n" );
+    exit( 1 );
+  }
+  if ( rc ) {
+    a->seq1 = ref->rcseq;
+  }
+  else {
+    a->seq1 = ref->seq;
+  }
+  if ( circular ) {
+    a->len1 = ref->wrap_seq_len;
+  }
+  else {
+    a->len1 = ref->seq_len;
+  }
 
-      a->seq2 = fs->seq;
-      a->len2 = strlen( a->seq2 );
-      pop_s2c_in_a( a );
+  /* Now the reference sequence is prepared, put the s1c
+     lookup codes in */
+  pop_s1c_in_a( a );
+  if ( hp_special ) {
+    pop_hpl_and_hps( a->seq1, a->len1, a->hpcl, a->hpcs );
+  }
+  return a;
+}
+
+/* init_adapt_alignment
+   Args: (1) adapter sequence
+         (2) boolean; TRUE => homopolymer gap discount
+         (3) PSSMP flat substitution matrix
+   Returns: AlignmentP for finding the adapter in sequences
+*/
+static AlignmentP init_adapt_alignment( char* adapter, int hp_special,
+					PSSMP flatsubmat ) {
+  AlignmentP adapt_align;
+  adapt_align = (AlignmentP)init_alignment( INIT_ALN_SEQ_LEN,
+					    INIT_ALN_SEQ_LEN,
+					    0, hp_special );
+  adapt_align->submat = flatsubmat;
+
+  adapt_align->seq2   = adapter;
+  adapt_align->len2   = strlen( adapt_align->seq2 );
+  pop_s2c_in_a( adapt_align );
+  if ( hp_special ) {
+    pop_hpl_and_hps( adapt_align->seq2, adapt_align->len2,
+		     adapt_align->hprl, adapt_align->hprs );
+  }
+  /* Set for a semi-global that pays a penalty for unaligning the
+     beginning of the adapter, but not for the end of the adapter.
+     This is because if the sequence read (align->seq1) ends, then
+     we won't see any more of the adapter. When we search for the
+     best alignment, we'll only look in the last column, requiring that
+     all of align->seq1 is accounted for */
+  adapt_align->sg5    = 1;
+  adapt_align->sg3    = 0;
+  return adapt_align;
+}
+
+/* now_secs
+   Returns: the current time in seconds, for timing pipeline stages
+*/
+static double now_secs( void ) {
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return tv.tv_sec + (tv.tv_usec / 1e6);
+}
+
+/* init_batch_queue
+   Args: (1) BatchQueueP to set up
+         (2) number of batches that will ever be in the pipeline
+   Returns: void
+*/
+static void init_batch_queue( BatchQueueP q, size_t size ) {
+  size_t i;
+  q->slots = (SeqBatchP*)save_malloc(size * sizeof(SeqBatchP));
+  for( i = 0; i < size; i++ ) {
+    q->slots[i] = NULL;
+  }
+  q->size = size;
+  q->next = 0;
+  pthread_mutex_init( &q->lock, NULL );
+  pthread_cond_init( &q->ready, NULL );
+}
+
+/* free_batch_queue
+   Args: (1) BatchQueueP to tear down
+   Returns: void
+*/
+static void free_batch_queue( BatchQueueP q ) {
+  free( q->slots );
+  pthread_mutex_destroy( &q->lock );
+  pthread_cond_destroy( &q->ready );
+}
+
+/* push_batch
+   Args: (1) BatchQueueP to add to
+         (2) SeqBatchP to add
+   Returns: void
+*/
+static void push_batch( BatchQueueP q, SeqBatchP b ) {
+  pthread_mutex_lock( &q->lock );
+  q->slots[b->batch_num % q->size] = b;
+  pthread_cond_broadcast( &q->ready );
+  pthread_mutex_unlock( &q->lock );
+}
+
+/* pop_batch
+   Args: (1) BatchQueueP to take from
+   Returns: SeqBatchP next in batch_num order, waiting for it
+            to be pushed if need be
+*/
+static SeqBatchP pop_batch( BatchQueueP q ) {
+  SeqBatchP b;
+  size_t slot;
+  pthread_mutex_lock( &q->lock );
+  slot = q->next % q->size;
+  while( q->slots[slot] == NULL ) {
+    pthread_cond_wait( &q->ready, &q->lock );
+  }
+  b = q->slots[slot];
+  q->slots[slot] = NULL;
+  q->next++;
+  pthread_mutex_unlock( &q->lock );
+  return b;
+}
+
+/* init_pipe_stage
+   Args: (1) PipeStageP to set up
+         (2) BatchQueueP to take batches from
+	 (3) BatchQueueP to pass finished batches to
+	 (4) function doing this stage's work on one sequence
+	 (5) number of threads for this stage
+   Returns: void
+*/
+static void init_pipe_stage( PipeStageP st, BatchQueueP in, BatchQueueP out,
+			     void (*work)( AlnWorkerP, SeqBatchP, size_t ),
+			     int num_threads ) {
+  st->in = in;
+  st->out = out;
+  st->cur = NULL;
+  st->next_seq = 0;
+  st->done = 0;
+  st->fetching = 0;
+  pthread_mutex_init( &st->lock, NULL );
+  pthread_cond_init( &st->fetched, NULL );
+  st->work = work;
+  st->num_threads = num_threads;
+  st->busy = 0.0;
+}
 
-      /* Set up the alignment limits on the reference */
-      if ( ((fs->as - REALIGN_BUFFER) < 0 ) ) {
-	ref_start = 0;
+/* trim_seq
+   Args: (1) AlnWorkerP with an adapt_align
+         (2) SeqBatchP
+	 (3) index of the sequence in the batch to trim
+   Returns: void
+   Trimmer stage work: sets fs->trimmed and fs->trim_point
+*/
+static void trim_seq( AlnWorkerP w, SeqBatchP b, size_t i ) {
+  trim_frag( &b->seqs[i], w->pl->adapter, w->adapt_align );
+}
+
+/* align_mapped_seq
+   Args: (1) AlnWorkerP with a fw_align and an rp for the reference
+         (2) FragSeqP mapped in SAM or BAM input, with its strand
+	     and region in the rc, as and ae fields
+	 (3) PWAlnFragP to write the alignment into
+   Returns: void
+   Aligns fs the way reiterate_assembly would: trimmed and turned to
+   the strand it was mapped to, and only to the window around where
+   it was mapped. fs itself is left on its own strand for merging,
+   with the new alignment stats. This narrows w->fw_align to the
+   window; reset_ref_alignment undoes that
+*/
+static void align_mapped_seq( AlnWorkerP w, FragSeqP fs,
+			      PWAlnFragP front_pwaln ) {
+  FragSeq mfs;
+  int j, len;
+
+  len = fs->trimmed ? fs->trim_point + 1 : fs->seq_len;
+  for( j = 0; j < len; j++ ) {
+    mfs.seq[j] = fs->rc ? revcom_char( fs->seq[len-(j+1)] ) : fs->seq[j];
+  }
+  mfs.seq[len] = '\0';
+  strcpy( mfs.id, fs->id );
+  strcpy( mfs.desc, fs->desc );
+  mfs.trimmed = fs->trimmed;
+  mfs.rc = fs->rc;
+  mfs.strand_known = 1;
+  mfs.as = fs->as;
+  mfs.ae = fs->ae;
+  mfs.num_inputs = 1;
+
+  unmask_alignment( w->fw_align );
+  w->fw_align->sg5 = 1;
+  w->fw_align->sg3 = 1;
+  realign_frag( w->rp, &mfs, w->fw_align, front_pwaln );
+  fs->as = mfs.as;
+  fs->ae = mfs.ae;
+  fs->score = mfs.score;
+}
+
+/* reset_ref_alignment
+   Args: (1) AlignmentP made by init_ref_alignment for the forward
+             strand of ref
+	 (2) RefSeqP
+   Returns: void
+   Points a at the whole reference again if align_mapped_seq left
+   it narrowed to a window
+*/
+static void reset_ref_alignment( AlignmentP a, RefSeqP ref ) {
+  if ( (a->seq1 == ref->seq) && (a->len1 == ref->wrap_seq_len) ) {
+    return;
+  }
+  a->seq1 = ref->seq;
+  a->len1 = ref->wrap_seq_len;
+  pop_s1c_in_a( a );
+  if ( a->hp ) {
+    pop_hpl_and_hps( a->seq1, a->len1, a->hpcl, a->hpcs );
+  }
+}
+
+/* align_seq
+   Args: (1) AlnWorkerP with a fw_align and rc_align
+         (2) SeqBatchP
+	 (3) index of the sequence in the batch to align
+   Returns: void
+   Aligner stage work: kmer filters the sequence, which sets up the
+   masks of the worker's alignments, then aligns it where they allow.
+   A sequence mapped in SAM or BAM input skips that and is aligned
+   only where it was mapped
+*/
+static void align_seq( AlnWorkerP w, SeqBatchP b, size_t i ) {
+  PipelineP pl = w->pl;
+  FragSeqP fs = &b->seqs[i];
+
+  if ( pl->adapter == NULL ) {
+    fs->trimmed = 0;
+  }
+
+  if ( fs->strand_known ) {
+    b->kmer_hits[i] = KMER_HITS_UNIQUE;
+    align_mapped_seq( w, fs, &b->pwalns[i] );
+    b->aligned[i] = 1;
+    return;
+  }
+  reset_ref_alignment( w->fw_align, pl->ref );
+
+  /* Check if kmer filtering. If so, filter */
+  b->aligned[i] = 0;
+  if ( new_kmer_filter( fs, pl->kmer_filt, w->fw_align, w->rc_align,
+			&b->kmer_hits[i] ) ) {
+    /* Align this fragment to the reference and write 
+       the result into pwaln; use the ancsubmat, not the reverse
+       complemented rcsancsubmat during this first iteration because
+       all sequence is forward strand
+    */
+    w->fw_align->submat = pl->submat;
+    w->rc_align->submat = pl->submat;
+    sg_align_frag( pl->ref, fs, w->fw_align, w->rc_align,
+		   &b->pwalns[i] );
+    b->aligned[i] = 1;
+  }
+}
+
+/* stage_worker
+   Args: (1) AlnWorkerP, passed as void* for pthread_create
+   Returns: NULL
+   Claims sequences from the worker's stage one at a time and does
+   the stage's work on them until the end of input reaches the stage.
+   Only one thread waits for the next batch at a time, and without
+   the stage lock, so the others can still finish and pass on the
+   current one. The end of input batch is passed on as soon as it is
+   taken; the next queue hands it out only after every batch before it
+*/
+static void* stage_worker( void* arg ) {
+  AlnWorkerP w = (AlnWorkerP)arg;
+  PipeStageP st = w->stage;
+  SeqBatchP b;
+  size_t i;
+  double start;
+
+  pthread_mutex_lock( &st->lock );
+  while( 1 ) {
+    while( (st->cur == NULL) || (st->next_seq >= st->cur->num_seqs) ) {
+      if ( st->done ) {
+	pthread_mutex_unlock( &st->lock );
+	return NULL;
       }
-      else {
-	ref_start = (fs->as - REALIGN_BUFFER);
+      if ( st->fetching ) {
+	/* Another thread is already waiting for the next batch */
+	pthread_cond_wait( &st->fetched, &st->lock );
+	continue;
       }
-      if ( (fs->ae + REALIGN_BUFFER + 1) > 
-	   maln->ref->wrap_seq_len ) {
-	ref_end = maln->ref->wrap_seq_len;
+      st->fetching = 1;
+      pthread_mutex_unlock( &st->lock );
+      b = pop_batch( st->in );
+      pthread_mutex_lock( &st->lock );
+      st->fetching = 0;
+      if ( b->num_seqs == 0 ) {
+	st->done = 1;
+	st->cur = NULL;
+	push_batch( st->out, b );
       }
       else {
-	ref_end = fs->ae + REALIGN_BUFFER;
-      }
-
-      /* Check to make sure the regions encompassed by ref_start to
-	 ref_end is reasonable given how long this fragment is. If
-	 not, just realign this whole mofo again because the reference
-	 has probably changed a lot between iterations */
-      if ( (ref_start + a->len2) > ref_end ) {
-	ref_start = 0;
-	ref_end = maln->ref->wrap_seq_len;
-      }
-    
-      ref_frag_len = ref_end - ref_start;
-      a->seq1 = &maln->ref->seq[ref_start];
-      a->len1 = ref_frag_len;
-      pop_s1c_in_a( a );
-      
-      /* If we want the homopolymer discount, the necessary arrays of
-	 hp starts and lengths must be set up anew */
-      if ( a->hp ) {
-	pop_hpl_and_hps( a->seq2, a->len2, a->hprl, a->hprs );
-	pop_hpl_and_hps( a->seq1, a->len1, a->hpcl, a->hpcs );
+	b->num_done = 0;
+	st->cur = b;
+	st->next_seq = 0;
       }
+      pthread_cond_broadcast( &st->fetched );
+    }
+    b = st->cur;
+    i = st->next_seq++;
+    pthread_mutex_unlock( &st->lock );
 
-      /* Align it! */
-      dyn_prog( a );
-    
-      /* Find the best score */
-      max_score = max_sg_score( a );
+    start = now_secs();
+    st->work( w, b, i );
 
-      find_align_begin( a );
+    pthread_mutex_lock( &st->lock );
+    st->busy += now_secs() - start;
+    if ( ++b->num_done == b->num_seqs ) {
+      push_batch( st->out, b );
+    }
+  }
+}
 
-      /* First, put all alignment in front_pwaln */
-      populate_pwaln_to_begin( a, front_pwaln );
-      
-      /* Load up front_pwaln */
-      strcpy( front_pwaln->ref_id, maln->ref->id );
-      strcpy( front_pwaln->ref_desc, maln->ref->desc );
-      
-      strcpy( front_pwaln->frag_id, fs->id );
-      strcpy( front_pwaln->frag_desc, fs->desc );
-      
-      front_pwaln->trimmed = fs->trimmed;
-      front_pwaln->revcom  = fs->rc;
-      front_pwaln->num_inputs = fs->num_inputs;
-      front_pwaln->segment = 'a';
-      front_pwaln->score = a->best_score;
-  
-      front_pwaln->start = a->abc + ref_start;
-      front_pwaln->end   = a->aec + ref_start;
+/* read_worker
+   Args: (1) PipelineP, passed as void* for pthread_create
+   Returns: NULL
+   Reader stage: fills free batches with sequences from pl->reader,
+   keeping only those in pl->good_ids if that is set, and passes
+   them on in order. Paired reads are merged here, if they overlap,
+   before anything else sees them. Ends with an empty batch to mark
+   the end of input
+*/
+static void* read_worker( void* arg ) {
+  PipelineP pl = (PipelineP)arg;
+  BatchQueueP out = (pl->adapter != NULL) ? &pl->trim_q : &pl->align_q;
+  SeqBatchP b;
+  FragSeqP frag_seq;
+  char* test_id;
+  int more_seqs = 1;
+  int num_read, j;
+  size_t last_num_seqs, first_slot;
+  size_t room = (pl->mate_reader != NULL) ? FIRST_PASS_BATCH - 1
+                                          : FIRST_PASS_BATCH;
+  double start;
 
-      /* Update stats for this FragSeq */
-      fs->as = a->abc + ref_start;
-      fs->ae = a->aec + ref_start;
-      fs->unique_best = 1;
-      fs->score = a->best_score;
+  /* Give some space to remember the IDs as we see them */
+  test_id = (char*)save_malloc((MAX_ID_LEN + 1) * sizeof(char));
 
-      if ( front_pwaln->end > maln->ref->seq_len ) {
-	/* This alignment wraps around - adjust the end to
-	   demonstrate this for split_maln check */
-	front_pwaln->end = front_pwaln->end - maln->ref->seq_len;
+  while( more_seqs ) {
+    b = pop_batch( &pl->free_q );
+    start = now_secs();
+    b->num_seqs = 0;
+    while( b->num_seqs < room ) {
+      first_slot = b->num_seqs;
+      if ( pl->mate_reader == NULL ) {
+	num_read = read_next_seq( pl->reader, &b->seqs[first_slot],
+				  pl->seq_code );
       }
-
-      if ( front_pwaln->start > front_pwaln->end ) {
-	/* Move wrapped bit to back_pwaln */
-	split_pwaln( front_pwaln, back_pwaln, maln->ref->seq_len );
-	merge_pwaln_into_maln( front_pwaln, maln );
-	fs->front_asp = maln->AlnSeqArray[maln->num_aln_seqs - 1];
-	merge_pwaln_into_maln( back_pwaln, maln );
-	fs->back_asp = maln->AlnSeqArray[maln->num_aln_seqs - 1];
+      else {
+	num_read = read_next_pair( pl->reader, pl->mate_reader,
+				   &b->seqs[first_slot],
+				   &b->seqs[first_slot + 1],
+				   pl->seq_code, pl->mate_seq_code );
+	if ( num_read > 0 ) {
+	  pl->seen_pairs++;
+	}
+	if ( num_read == 1 ) {
+	  pl->merged_pairs++;
+	}
+      }
+      if ( num_read == 0 ) {
+	more_seqs = 0;
+	break;
       }
-      else { 
-	merge_pwaln_into_maln( front_pwaln, maln );
-	fs->front_asp = maln->AlnSeqArray[maln->num_aln_seqs - 1];
+      for( j = 0; j < num_read; j++ ) {
+	frag_seq = &b->seqs[first_slot + j];
+	pl->seen_seqs++;
+	strncpy( test_id, frag_seq->id, MAX_ID_LEN + 1);
+	if ( DEBUG ) {
+	  fprintf( stderr, "%s\n", frag_seq->id );
+	}
+	if ( (pl->good_ids == NULL) ||
+	     ( bsearch( &test_id, pl->good_ids->ids, 
+			pl->good_ids->num_ids,
+			sizeof(char*), idCmp ) 
+	       != NULL ) ) {
+	  /* The second mate moves up if the first was left out */
+	  if ( frag_seq != &b->seqs[b->num_seqs] ) {
+	    b->seqs[b->num_seqs] = *frag_seq;
+	  }
+	  b->num_seqs++;
+	}
+	if ( pl->seen_seqs % 1000 == 0 ) {
+	  fprintf( stderr, "." );
+	}
+	if ( pl->seen_seqs % 80000 == 0 ) {
+	  fprintf( stderr, "\n" );
+	}
       }
     }
+    pl->read_busy += now_secs() - start;
+    last_num_seqs = b->num_seqs;
+    push_batch( out, b );
   }
-  return;
+
+  /* Mark the end of input, unless the last batch already did */
+  if ( last_num_seqs > 0 ) {
+    b = pop_batch( &pl->free_q );
+    b->num_seqs = 0;
+    push_batch( out, b );
+  }
+  free( test_id );
+  return NULL;
 }
 
+/* start_stage
+   Args: (1) PipeStageP to start
+         (2) array of st->num_threads AlnWorkers for it
+	 (3) array of st->num_threads pthread_t to start them on
+   Returns: void
+*/
+static void start_stage( PipeStageP st, AlnWorkerP workers,
+			 pthread_t* threads ) {
+  int t;
+  for( t = 0; t < st->num_threads; t++ ) {
+    workers[t].stage = st;
+    if ( pthread_create( &threads[t], NULL,
+			 stage_worker, &workers[t] ) != 0 ) {
+      fprintf( stderr, "Could not start pipeline thread %d\n", t );
+      exit( 1 );
+    }
+  }
+}
 
 /* all_lower
    Args: (1) Pointer to char array (seq)
@@ -327,6 +1182,163 @@ PSSMP find_read_pssm( const char* fn )
   }
 }
 
+/* maln_writer_thread
+   Args: (1) MalnWriterP, passed as void* for pthread_create
+   Returns: NULL
+   Writes mw->snap to mw->fn, then frees mw->snap
+*/
+static void* maln_writer_thread( void* arg ) {
+  MalnWriterP mw = (MalnWriterP)arg;
+  mw->ok = write_ma( mw->fn, mw->snap );
+  free_map_alignment( mw->snap );
+  mw->snap = NULL;
+  return NULL;
+}
+
+/* finish_maln_write
+   Args: (1) MalnWriterP
+   Returns: void
+   Waits for the maln file being written, if any, to be done. Exits
+   if it could not be written
+*/
+static void finish_maln_write( MalnWriterP mw ) {
+  if ( !mw->busy ) {
+    return;
+  }
+  pthread_join( mw->thread, NULL );
+  mw->busy = 0;
+  if ( !mw->ok ) {
+    fprintf( stderr, "Could not write maln file %s\n", mw->fn );
+    exit( 1 );
+  }
+}
+
+/* start_maln_write
+   Args: (1) MalnWriterP
+         (2) char* fn - name of the maln file to write
+         (3) MapAlignmentP maln - to write, as it is now
+   Returns: void
+   Waits for the last maln file to be written, then starts writing
+   a copy of maln to fn in the background, so maln can be changed
+   as soon as this returns
+*/
+static void start_maln_write( MalnWriterP mw, const char* fn,
+			      MapAlignmentP maln ) {
+  finish_maln_write( mw );
+  strncpy( mw->fn, fn, MAX_FN_LEN );
+  mw->fn[MAX_FN_LEN] = '\0';
+  mw->snap = copy_map_alignment( maln );
+  mw->ok = 0;
+  if ( pthread_create( &mw->thread, NULL, maln_writer_thread, mw ) != 0 ) {
+    fprintf( stderr, "Could not start maln writer thread\n" );
+    exit( 1 );
+  }
+  mw->busy = 1;
+}
+
+/* same_output_file
+   Args: (1) char* fn1 - name of an output file of this run
+         (2) char* fn2 - name of the same output file of the one
+             thread self-check run
+         (3) int skip_header - Boolean; TRUE => do not compare the first
+             line, where write_ma stamps the time
+   Returns: 1 if neither file is there or both are and their contents
+            are the same; 0 otherwise
+*/
+static int same_output_file( const char* fn1, const char* fn2,
+			     int skip_header ) {
+  FILE* F1;
+  FILE* F2;
+  int c1, c2;
+
+  F1 = fopen( fn1, "r" );
+  F2 = fopen( fn2, "r" );
+  if ( (F1 == NULL) || (F2 == NULL) ) {
+    if ( F1 != NULL ) fclose( F1 );
+    if ( F2 != NULL ) fclose( F2 );
+    return ( (F1 == NULL) && (F2 == NULL) );
+  }
+
+  if ( skip_header ) {
+    while( ((c1 = fgetc( F1 )) != EOF) && (c1 != '\n') ) ;
+    while( ((c2 = fgetc( F2 )) != EOF) && (c2 != '\n') ) ;
+  }
+  do {
+    c1 = fgetc( F1 );
+    c2 = fgetc( F2 );
+  } while( (c1 == c2) && (c1 != EOF) );
+
+  fclose( F1 );
+  fclose( F2 );
+  return ( c1 == c2 );
+}
+
+/* self_check_outputs
+   Args: (1) char* maln_root - root of the maln file names of this run
+         (2) int iter_num - last iteration this run wrote
+         (3) int make_fastq - Boolean; TRUE => a fastq file was written
+         (4) char* fastq_out_fn - its name
+         (5) int make_sam - Boolean; TRUE => a SAM or BAM file was written
+         (6) char* sam_fn - its name
+   Compares every maln file (but their time stamps), the fastq file
+   and the SAM or BAM file of this run with those the one thread run wrote under the same
+   names plus SELF_CHECK_SUFFIX. Reports each one that differs and
+   removes the one thread run's files if none does
+   Returns: the number of output files that differ
+*/
+static int self_check_outputs( const char* maln_root, int iter_num,
+			       int make_fastq, const char* fastq_out_fn,
+			       int make_sam, const char* sam_fn ) {
+  char fn[MAX_FN_LEN+1];
+  char check_fn[MAX_FN_LEN+1];
+  int i;
+  int diffs = 0;
+
+  /* One more than the last iteration, in case the one thread run
+     took more iterations */
+  for( i = 0; i <= iter_num + 1; i++ ) {
+    sprintf( fn, "%s.%d", maln_root, i );
+    sprintf( check_fn, "%s%s.%d", maln_root, SELF_CHECK_SUFFIX, i );
+    if ( !same_output_file( fn, check_fn, 1 ) ) {
+      fprintf( stderr, "Self-check: %s differs from %s\n", fn, check_fn );
+      diffs++;
+    }
+  }
+  if ( make_fastq ) {
+    sprintf( check_fn, "%s%s", fastq_out_fn, SELF_CHECK_SUFFIX );
+    if ( !same_output_file( fastq_out_fn, check_fn, 0 ) ) {
+      fprintf( stderr, "Self-check: %s differs from %s\n",
+	       fastq_out_fn, check_fn );
+      diffs++;
+    }
+  }
+  if ( make_sam ) {
+    sprintf( check_fn, "%s%s", sam_fn, SELF_CHECK_SUFFIX );
+    if ( !same_output_file( sam_fn, check_fn, 0 ) ) {
+      fprintf( stderr, "Self-check: %s differs from %s\n",
+	       sam_fn, check_fn );
+      diffs++;
+    }
+  }
+
+  if ( diffs == 0 ) {
+    for( i = 0; i <= iter_num + 1; i++ ) {
+      sprintf( check_fn, "%s%s.%d", maln_root, SELF_CHECK_SUFFIX, i );
+      remove( check_fn );
+    }
+    if ( make_fastq ) {
+      sprintf( check_fn, "%s%s", fastq_out_fn, SELF_CHECK_SUFFIX );
+      remove( check_fn );
+    }
+    if ( make_sam ) {
+      sprintf( check_fn, "%s%s", sam_fn, SELF_CHECK_SUFFIX );
+      remove( check_fn );
+    }
+    fprintf( stderr, "Self-check: output is the same on 1 thread\n" );
+  }
+  return diffs;
+}
+
 void help( void ) {
   printf( "\n\n%s -- Mapping Iterativ Assembler V %s\n",PACKAGE_NAME, PACKAGE_VERSION);
   printf( "       A tool for creating short read assemblies.\n\n");
@@ -335,9 +1347,14 @@ void help( void ) {
   printf( "===============================+++++++++++++==\n");
   printf( "\nUsage:\n");
   printf( "mia -r <reference sequence>\n" );
-  printf( "    -f <fasta or fastq file of fragments to align>\n" );
+  printf( "    -f <fasta, fastq, SAM or BAM file of fragments to align, may be gzip or BGZF;\n" );
+  printf( "       - for stdin; mapped SAM/BAM records are only aligned where they were mapped>\n" );
+  printf( "    -2 <fasta or fastq file of the second reads of pairs whose first reads are in -f;\n" );
+  printf( "       overlapping mates are merged, and adapter read through clipped>\n" );
+  printf( "    -j the -f file has paired reads, each first read followed by its mate\n" );
   printf( "    -s <substitution matrix file> (if not supplied an default matrix is used)\n" );
   printf( "    -m <root file name for maln output file(s)> (assembly.maln.iter)\n" );
+  printf( "    -o <also write the final alignments to this SAM file; BAM if it ends in .bam>\n" );
   printf( "    \nFILTER parameters:\n" );
   printf( "    -u fasta database has repeat sequences, keep one based on alignment score\n" );
   printf( "    -U fasta database has repeat sequences, keep one based on sum of q-scores\n" );
@@ -350,6 +1367,12 @@ void help( void ) {
   printf( "    -T fasta database has adapters, trim these\n" );
   printf( "    -a <adapter sequence or code>\n" );
   printf( "    -k <use kmer filter with kmers of this length>\n" );
+  printf( "    -P <use kmer filter with this spaced seed pattern of 1 (look) and 0\n" );
+  printf( "       (don't care) positions, e.g. 11011011011011011 instead of -k>\n" );
+  printf( "    -Y use damage tolerant purine/pyrimidine kmers at the ends of sequences;\n" );
+  printf( "       needs -k or -P\n" );
+  printf( "    -K <kmers occurring more often than this in the reference are\n" );
+  printf( "       repetitive and only used if no others are found; default = %d>\n", DEF_MAX_KMER_FREQ );
   printf( "    -I <filename of list of sequence IDs to use, ignoring all others>\n" );
   printf( "    \nALIGNMENT parameters:\n" );
   printf( "    -p <consensus calling code; default = 1>\n" );
@@ -357,7 +1380,12 @@ void help( void ) {
   printf( "    -i iterate assembly until convergence (default)\n" );
   printf( "    -n do not iterate assembly until convergence\n" );
   printf( "    -F <only output the FINAL assembly, not each iteration>\n" );
+  printf( "    -t <number of threads for aligning sequences[,adapter trimming threads];\n" );
+  printf( "       default = 1, with one trimming thread per %d aligning threads>\n", TRIM_THREAD_RATIO );
+  printf( "    -V self-check: also assemble on 1 thread and compare the output\n" );
   printf( "    -D <distantly related reference sequence>\n" );
+  printf( "    -L <with -D, kmer length for finding where sequences of unknown strand\n" );
+  printf( "       might align to each new assembly; 0 => try everywhere; default = %d>\n", DEF_LOCALIZE_KMER_LEN );
   printf( "    -h give special discount for homopolymer gaps\n" );
   printf( "    -M <use lower-case soft-masking of kmers>\n" );
   printf( "    -H <do not do dynamic score cutoff, instead use this Hard score cutoff>\n" );
@@ -395,17 +1423,23 @@ int main( int argc, char* argv[] ) {
 
   char maln_fn[MAX_FN_LEN+1];
   char fastq_out_fn[MAX_FN_LEN+1];
+  char sam_fn[MAX_FN_LEN+1];
   char maln_root[MAX_FN_LEN+1];
   char ref_fn[MAX_FN_LEN+1];
   char frag_fn[MAX_FN_LEN+1];
-  char* test_id;
+  char mate_fn[MAX_FN_LEN+1]; // second reads of pairs, if paired
 
   int ich;
   int any_arg = 0;
   int Hard_cut = 0; // If 0 => use dynamic score cutoff, if > 0 use this instead
   int circular = 0; // Boolean, TRUE if reference sequence is circular
   int make_fastq = 0; // Boolean, TRUE if we should also output fastq database of seqs in assembly
+  int make_sam = 0; // Boolean, TRUE if we should also output the final alignments as SAM or BAM
+  int sam_bam = 0; // Boolean, TRUE if that output is BAM
   int seq_code = 0; // code to indicate sequence input format; 0 => fasta; 1 => fastq
+  int mate_seq_code; // input format of the second reads of pairs
+  int paired = 0; // Boolean; TRUE => second reads of pairs are in mate_fn
+  int interleaved = 0; // Boolean; TRUE => mates follow each other in frag_fn
   int do_adapter_trimming = 0; // Boolean, TRUE if we should try to trim
                                // adapter from input sequences
   int iterate = 1; //Boolean, TRUE means interate the assembly until convergence
@@ -425,8 +1459,20 @@ int main( int argc, char* argv[] ) {
   int distant_ref = 0; // Boolean, TRUE means the initial reference sequence is
                        // known to be distantly related so keep trying to align all
                        // sequences each round
+  int loc_kmer_len = DEF_LOCALIZE_KMER_LEN; // kmer length for localizing
+                                           // sequences of unknown strand
+  SeedP loc_seed = NULL;
   int kmer_filt_len = -1; // length of kmer filtering, if user wants it; otherwise
                           // special value of -1 indicates this is unset
+  char* seed_pattern = NULL; // spaced seed pattern, if user wants one
+  int damage_seeds = 0; // Boolean; TRUE => also use purine/pyrimidine kmers
+                        // at the damage prone ends of sequences
+  int max_kmer_freq = DEF_MAX_KMER_FREQ; // kmers occurring more often than this
+                                         // in the reference are repetitive
+  int repeat_only_seqs = 0; // number of sequences that hit only repetitive kmers
+  int bloom_rejects = 0; // number of sequences rejected by the Bloom filter
+  int kmer_rejects = 0; // number of sequences that passed the Bloom filter
+                        // but shared no kmers
   int soft_mask = 0; //Boolean; TRUE => do not use kmers that are all lower-case
                      //        FALSE => DO use all kmers, regardless of case
   int iter_num; // Number of iterations of assembly done
@@ -446,13 +1492,14 @@ int main( int argc, char* argv[] ) {
   PSSMP rcancsubmat = revcom_submat(ancsubmat);
   const PSSMP flatsubmat  = init_flatsubmat();
 
-  KPL* fkpa; // Place to keep forward kmer array if user requested kmer 
-  KPL* rkpa; // Place to keep reverse kmer array if user requested kmer 
-  IDsListP good_ids;
+  KmerFilterP kmer_filt = NULL; // reference kmer indices if user requested
+                                // kmer filtering
+  IDsListP good_ids = NULL;
   FragSeqP frag_seq;
-  PWAlnFragP front_pwaln, back_pwaln;
+  PWAlnFragP back_pwaln;
   FSDB fsdb; // Database to hold sequences to iterate over
-  FILE* FF;
+  SeqReaderP reader;
+  SeqReaderP mate_reader; // second reads of pairs; NULL => single reads
   time_t curr_time;
 
 
@@ -468,17 +1515,41 @@ int main( int argc, char* argv[] ) {
   char* last_assembly_cons;
   int cc = 1; // consensus code for calling consensus base
   int i;
+  int num_threads = 1; // number of threads for aligning and realigning
+  int trim_threads = 0; // adapter trimmer threads; 0 => one per
+                        // TRIM_THREAD_RATIO aligner threads
+  char* comma;
+  int self_check = 0; // Boolean; TRUE => also run on 1 thread and compare
+  pid_t check_pid; // process doing the 1 thread run of a self-check
+  int check_status;
+  int self_check_diffs = 0; // output files that differ from the 1 thread run
+  Pipeline pipeline;
+  Realign map_realign; // how the workers align sequences mapped in SAM or BAM input
+  MalnWriter maln_writer; // writes maln files while the next iteration runs
+  SeqBatch* batches; // the PIPE_BATCHES batches going through pipeline
+  SeqBatchP batch;
+  AlnWorkerP workers; // aligner threads, later realigner threads
+  AlnWorkerP trimmers = NULL;
+  int num_trim_threads;
+  pthread_t* pipe_threads;
+  double pipe_start, pipe_secs, merge_start;
+  double merge_busy = 0.0;
 
   /* Set the default output filename until the user overrides it */
   strcpy( maln_root, maln_root_def );
 
 
   /* Process command line arguments */
-  while( (ich=getopt( argc, argv, "s:r:f:m:a:p:H:I:S:N:k:q:FTcinuhDMUAC::" )) != -1 ) {
+  while( (ich=getopt( argc, argv, "s:r:f:2:m:o:a:p:H:I:S:N:k:K:P:L:t:q:FTcijnuhDMUYAVC::" )) != -1 ) {
     switch(ich) {
     case 'c' :
       circular = 1;
       break;
+    case 'o' :
+      make_sam = 1;
+      strcpy( sam_fn, optarg );
+      sam_bam = is_bam_fn( sam_fn );
+      break;
     case 'q' :
       make_fastq = 1;
       strcpy( fastq_out_fn, optarg );
@@ -544,10 +1615,35 @@ int main( int argc, char* argv[] ) {
       kmer_filt_len = atoi( optarg );
       any_arg = 1;
       break;
+    case 'L' :
+      loc_kmer_len = atoi( optarg );
+      break;
+    case 'P' :
+      seed_pattern = optarg;
+      any_arg = 1;
+      break;
+    case 'Y' :
+      damage_seeds = 1;
+      break;
+    case 'K' :
+      max_kmer_freq = atoi( optarg );
+      if ( max_kmer_freq <= 0 ) {
+	fprintf( stderr, "Maximum kmer frequency (-K) must be positive\n" );
+	help();
+	exit( 0 );
+      }
+      break;
     case 'f' :
       strcpy( frag_fn, optarg );
       any_arg = 1;
       break;
+    case '2' :
+      paired = 1;
+      strcpy( mate_fn, optarg );
+      break;
+    case 'j' :
+      interleaved = 1;
+      break;
     case 'm' :
       strcpy( maln_root, optarg );
       any_arg = 1;
@@ -587,6 +1683,21 @@ int main( int argc, char* argv[] ) {
     case 'F' :
       FINAL_ONLY = 1;
       break;
+    case 't' :
+      num_threads = atoi( optarg );
+      comma = strchr( optarg, ',' );
+      if ( comma != NULL ) {
+	trim_threads = atoi( comma + 1 );
+      }
+      if ( (num_threads < 1) || ((comma != NULL) && (trim_threads < 1)) ) {
+	fprintf( stderr, "Number of threads (-t) must be positive\n" );
+	help();
+	exit( 0 );
+      }
+      break;
+    case 'V' :
+      self_check = 1;
+      break;
     default :
       help();
       exit( 0 );
@@ -603,6 +1714,56 @@ int main( int argc, char* argv[] ) {
     exit(0);
   }
 
+  if ( paired && interleaved ) {
+    fprintf( stderr, "-2 and -j can not be used together\n" );
+    exit( 1 );
+  }
+  if ( damage_seeds && (kmer_filt_len <= 0) && (seed_pattern == NULL) ) {
+    fprintf( stderr, "-Y needs kmer filtering, with -k or -P\n" );
+    exit( 1 );
+  }
+
+  /* For a self-check, first do the whole assembly on 1 thread in
+     another process, writing its files under other names, so this
+     run's output can be compared with it at the end */
+  if ( self_check && ((strcmp( frag_fn, "-" ) == 0) ||
+		      (paired && (strcmp( mate_fn, "-" ) == 0))) ) {
+    fprintf( stderr, "-V can not be used with sequences read from stdin\n" );
+    exit( 1 );
+  }
+  if ( self_check ) {
+    fprintf( stderr, "Self-check: assembling on 1 thread first\n" );
+    fflush( NULL );
+    check_pid = fork();
+    if ( check_pid < 0 ) {
+      fprintf( stderr, "Could not start the self-check run\n" );
+      exit( 1 );
+    }
+    if ( check_pid == 0 ) {
+      self_check = 0;
+      num_threads = 1;
+      trim_threads = 0;
+      strcat( maln_root, SELF_CHECK_SUFFIX );
+      if ( make_fastq ) {
+	strcat( fastq_out_fn, SELF_CHECK_SUFFIX );
+      }
+      if ( make_sam ) {
+	strcat( sam_fn, SELF_CHECK_SUFFIX );
+      }
+      if ( freopen( "/dev/null", "w", stderr ) == NULL ) {
+	exit( 1 );
+      }
+    }
+    else {
+      if ( (waitpid( check_pid, &check_status, 0 ) != check_pid) ||
+	   !WIFEXITED( check_status ) ||
+	   (WEXITSTATUS( check_status ) != 0) ) {
+	fprintf( stderr, "Self-check: the 1 thread run failed\n" );
+	exit( 1 );
+      }
+    }
+  }
+
   /* Start the clock... */
   curr_time = time(NULL);
   //  c_time = (char*)save_malloc(64*sizeof(char));
@@ -625,6 +1786,10 @@ int main( int argc, char* argv[] ) {
 
   /* Set the distant_ref flag */
   maln->distant_ref = distant_ref;
+  maln->num_threads = num_threads;
+  if ( distant_ref && (loc_kmer_len > 0) ) {
+    loc_seed = init_seed( NULL, loc_kmer_len, 0 );
+  }
 
   /* Set up the FSDB for keeping good-scoring sequence in memory */
   fsdb = init_FSDB();
@@ -632,6 +1797,7 @@ int main( int argc, char* argv[] ) {
     fprintf( stderr, "Not enough memories for holding sequences\n" );
     exit( 1 );
   }
+  fsdb->num_threads = num_threads;
 
   /* Read in the reference sequence and make reverse complement, too*/
   if ( read_fasta_ref( maln->ref, ref_fn ) != 1 ) {
@@ -654,155 +1820,238 @@ int main( int argc, char* argv[] ) {
     maln->ref->gaps[i] = 0;
   }
 
-  /* Set up fkpa and rkpa for list of kmers in the reference (forward and
-     revcom strand) if user wants kmer filtering */
-  if ( kmer_filt_len > 0 ) {
+  /* Set up the kmer indices of the reference (forward and revcom
+     strand) if user wants kmer filtering */
+  if ( (kmer_filt_len > 0) || (seed_pattern != NULL) ) {
     fprintf( stderr, "Making kmer list for k-mer filtering...\n" );
-    fkpa = init_kpa(kmer_filt_len);
-    rkpa = init_kpa(kmer_filt_len);
-    /* 
-    kmer_list = (KmersP)pop_kmers( maln->ref, kmer_filt_len );
-    */
-    populate_kpa( fkpa, maln->ref->seq, 
-		  maln->ref->wrap_seq_len, kmer_filt_len, 
-		  soft_mask );
-    populate_kpa( rkpa, maln->ref->rcseq, 
-		  maln->ref->wrap_seq_len, kmer_filt_len,
-		  soft_mask );
+    kmer_filt = init_kmer_filter( maln->ref,
+				  init_seed( seed_pattern, kmer_filt_len, 0 ),
+				  damage_seeds, soft_mask, max_kmer_freq );
+    fprintf( stderr, "%lu kmers occur more than %d times in the reference\n",
+	     (unsigned long)count_repeat_kmers( kmer_filt->fkpa,
+						kmer_filt->seed,
+						max_kmer_freq ),
+	     max_kmer_freq );
+    fprintf( stderr, "kmer Bloom filter uses %lu bytes; expected false positive rate %.4f\n",
+	     (unsigned long)(kmer_filt->bloom_bits / 8),
+	     bloom_fp_rate( kmer_filt ) );
   }
 
   /* Now kmer arrays have been made if requested. We can upper case
      the reference sequences. */
   make_ref_upper( maln->ref );
 
-  /* Set up FragSeqP to point to a FragSeq */
-  frag_seq = (FragSeqP)save_malloc(sizeof(FragSeq));
-
   /* Set up the alignment structures for forward and reverse
      complement alignments */
-  fw_align = (AlignmentP)init_alignment( INIT_ALN_SEQ_LEN,
-					 (maln->ref->wrap_seq_len + 
-					  (2*INIT_ALN_SEQ_LEN)),
-					 0, hp_special );
-  rc_align = (AlignmentP)init_alignment( INIT_ALN_SEQ_LEN,
-					 (maln->ref->wrap_seq_len + 
-					  (2*INIT_ALN_SEQ_LEN)),
-					 1, hp_special );
+  fw_align = init_ref_alignment( maln->ref, 0, circular, hp_special );
+  rc_align = init_ref_alignment( maln->ref, 1, circular, hp_special );
 
   /* Set up the alignment structure for adapter trimming, if user
      wants that */
   if ( do_adapter_trimming ) {
-    adapt_align = (AlignmentP)init_alignment( INIT_ALN_SEQ_LEN,
-					      INIT_ALN_SEQ_LEN,
-					      0, hp_special );
-    /* Setup the flatsubmat */
-    //flatsubmat = init_flatsubmat();
-    adapt_align->submat = flatsubmat;
-
-    adapt_align->seq2   = adapter;
-    adapt_align->len2   = strlen( adapt_align->seq2 );
-    pop_s2c_in_a( adapt_align );
-    if ( hp_special ) {
-      pop_hpl_and_hps( adapt_align->seq2, adapt_align->len2,
-		       adapt_align->hprl, adapt_align->hprs );
-    }
-    /* Set for a semi-global that pays a penalty for unaligning the
-       beginning of the adapter, but not for the end of the adapter.
-       This is because if the sequence read (align->seq1) ends, then
-       we won't see any more of the adapter. When we search for the
-       best alignment, we'll only look in the last column, requiring that
-       all of align->seq1 is accounted for */
-    adapt_align->sg5    = 1;
-    adapt_align->sg3    = 0;
-  }
-
-  fw_align->seq1 = maln->ref->seq;
-  rc_align->seq1 = maln->ref->rcseq;
-  if ( circular ) {
-    fw_align->len1 = maln->ref->wrap_seq_len;
-    rc_align->len1 = maln->ref->wrap_seq_len;
-  }
-  else {
-    fw_align->len1 = maln->ref->seq_len;
-    rc_align->len1 = maln->ref->seq_len;
+    adapt_align = init_adapt_alignment( adapter, hp_special, flatsubmat );
   }
 
-  /* Now the reference sequence and its reverse complement are
-     prepared, put the s1c lookup codes in */
-  pop_s1c_in_a( fw_align );
-  pop_s1c_in_a( rc_align );
+  /* Sequences mapped in SAM or BAM input are aligned as if being
+     realigned to the reference, where they were mapped */
+  map_realign.ref = maln->ref;
+  map_realign.ancsubmat = ancsubmat;
+  map_realign.rcancsubmat = rcancsubmat;
+  map_realign.distant_ref = 0;
+  map_realign.iter_num = 1;
+  map_realign.loc_filt = NULL;
+
+  /* No maln file is being written yet */
+  maln_writer.busy = 0;
+
+  /* Set up a worker for each aligner thread; the first one uses the
+     alignment structures above. They are kept for realigning */
+  workers = (AlnWorkerP)save_malloc(num_threads * sizeof(AlnWorker));
+  for( i = 0; i < num_threads; i++ ) {
+    workers[i].pl = &pipeline;
+    workers[i].rp = &map_realign;
+    workers[i].adapt_align = NULL;
+    if ( i == 0 ) {
+      workers[i].fw_align = fw_align;
+      workers[i].rc_align = rc_align;
+    }
+    else {
+      workers[i].fw_align = init_ref_alignment( maln->ref, 0, circular,
+						hp_special );
+      workers[i].rc_align = init_ref_alignment( maln->ref, 1, circular,
+						hp_special );
+    }
+  }
 
-  if ( hp_special ) {
-    pop_hpl_and_hps( fw_align->seq1, fw_align->len1,
-		     fw_align->hpcl, fw_align->hpcs );
-    pop_hpl_and_hps( rc_align->seq1, rc_align->len1,
-		     rc_align->hpcl, rc_align->hpcs );
+  /* And a worker for each trimmer thread */
+  num_trim_threads = 0;
+  if ( do_adapter_trimming ) {
+    num_trim_threads = (trim_threads > 0) ? trim_threads :
+      (num_threads + TRIM_THREAD_RATIO - 1) / TRIM_THREAD_RATIO;
+    trimmers = (AlnWorkerP)save_malloc(num_trim_threads * sizeof(AlnWorker));
+    for( i = 0; i < num_trim_threads; i++ ) {
+      trimmers[i].pl = &pipeline;
+      trimmers[i].fw_align = NULL;
+      trimmers[i].rc_align = NULL;
+      trimmers[i].adapt_align = (i == 0) ? adapt_align :
+	init_adapt_alignment( adapter, hp_special, flatsubmat );
+    }
   }
 
   /* One by one, go through the input file of fragments to be aligned.
      Align them to the reference. For each fragment generating an
      alignment score better than the cutoff, merge it into the maln
      alignment. Keep track of those that don't, too. */
-  FF = fileOpen( frag_fn, "r" );
-  seq_code = find_input_type( FF );
+  reader = open_seq_reader( frag_fn, num_threads );
+  if ( reader == NULL ) {
+    exit( 1 );
+  }
+  strcpy( reader->ref_id, maln->ref->id );
+  seq_code = find_input_type( reader );
+
+  /* Paired reads come from a second file, or from the same one,
+     one mate after the other */
+  mate_reader = NULL;
+  mate_seq_code = seq_code;
+  if ( paired ) {
+    mate_reader = open_seq_reader( mate_fn, num_threads );
+    if ( mate_reader == NULL ) {
+      exit( 1 );
+    }
+    mate_seq_code = find_input_type( mate_reader );
+  }
+  else if ( interleaved ) {
+    mate_reader = reader;
+  }
+  if ( (mate_reader != NULL) &&
+       ((seq_code > 1) || (mate_seq_code > 1)) ) {
+    fprintf( stderr, "Paired reads must be fasta or fastq\n" );
+    exit( 1 );
+  }
+  if ( (mate_reader != NULL) && (seq_code != mate_seq_code) ) {
+    fprintf( stderr, "Mates must both be fasta or both be fastq\n" );
+    exit( 1 );
+  }
 
   //LOG = fileOpen( log_fn, "w" );
-  front_pwaln = (PWAlnFragP)save_malloc( sizeof(PWAlnFrag));
   back_pwaln  = (PWAlnFragP)save_malloc( sizeof(PWAlnFrag));
 
-  /* Give some space to remember the IDs as we see them */
-  test_id = (char*)save_malloc((MAX_ID_LEN + 1) * sizeof(char));
+  /* Set up the first pass pipeline: a reader thread, trimmer and
+     aligner threads, and this thread merging the alignments into
+     maln in input order */
+  init_batch_queue( &pipeline.free_q, PIPE_BATCHES );
+  init_batch_queue( &pipeline.trim_q, PIPE_BATCHES );
+  init_batch_queue( &pipeline.align_q, PIPE_BATCHES );
+  init_batch_queue( &pipeline.merge_q, PIPE_BATCHES );
+  init_pipe_stage( &pipeline.trim, &pipeline.trim_q, &pipeline.align_q,
+		   trim_seq, num_trim_threads );
+  init_pipe_stage( &pipeline.align, &pipeline.align_q, &pipeline.merge_q,
+		   align_seq, num_threads );
+  pipeline.reader = reader;
+  pipeline.seq_code = seq_code;
+  pipeline.mate_reader = mate_reader;
+  pipeline.mate_seq_code = mate_seq_code;
+  pipeline.seen_pairs = 0;
+  pipeline.merged_pairs = 0;
+  pipeline.good_ids = ids_rest ? good_ids : NULL;
+  pipeline.seen_seqs = 0;
+  pipeline.read_busy = 0.0;
+  pipeline.ref = maln->ref;
+  pipeline.kmer_filt = kmer_filt;
+  pipeline.submat = ancsubmat;
+  pipeline.adapter = do_adapter_trimming ? adapter : NULL;
+  batches = (SeqBatch*)save_malloc(PIPE_BATCHES * sizeof(SeqBatch));
+  for( i = 0; i < PIPE_BATCHES; i++ ) {
+    batches[i].seqs = (FragSeq*)save_malloc(FIRST_PASS_BATCH * sizeof(FragSeq));
+    batches[i].pwalns = (PWAlnFrag*)save_malloc(FIRST_PASS_BATCH * sizeof(PWAlnFrag));
+    batches[i].kmer_hits = (int*)save_malloc(FIRST_PASS_BATCH * sizeof(int));
+    batches[i].aligned   = (int*)save_malloc(FIRST_PASS_BATCH * sizeof(int));
+    batches[i].batch_num = i;
+    push_batch( &pipeline.free_q, &batches[i] );
+  }
 
   /* Announce we're strarting alignment of fragments */
   fprintf( stderr, "Starting to align sequences to the reference...\n" );
 
-  while( read_next_seq( FF, frag_seq, seq_code ) ) {
-    seen_seqs++;
-    strncpy( test_id, frag_seq->id, MAX_ID_LEN + 1);
-    if ( DEBUG ) {
-      fprintf( stderr, "%s\n", frag_seq->id );
-    }
-    if ( !ids_rest ||
-	 ( bsearch( &test_id, good_ids->ids, 
-		    good_ids->num_ids,
-		    sizeof(char*), idCmp ) 
-	   != NULL ) ) {
-
-      if ( do_adapter_trimming ) {
-	/* Trim sequence (set frag_seg->trimmed and 
-	   frag_seg->trim_point field) */
-	trim_frag( frag_seq, adapter, adapt_align );
-      }
-      else {
-	frag_seq->trimmed = 0;
-      }
-
-      /* Check if kmer filtering. If so, filter */
-      if ( new_kmer_filter( frag_seq, fkpa, rkpa, kmer_filt_len,
-			    fw_align, rc_align ) ) {
-	/* Align this fragment to the reference and write 
-	   the result into pwaln; use the ancsubmat, not the reverse
-	   complemented rcsancsubmat during this first iteration because
-	   all sequence is forward strand
-	*/
-	fw_align->submat = ancsubmat;
-	rc_align->submat = ancsubmat;
-	
-	if ( sg_align( maln, frag_seq, fsdb, 
-		       fw_align, rc_align,
-		       front_pwaln, 
-		       back_pwaln ) == 0 ) {
+  pipe_start = now_secs();
+  pipe_threads = (pthread_t*)save_malloc((1 + num_trim_threads + num_threads) *
+					 sizeof(pthread_t));
+  if ( pthread_create( &pipe_threads[0], NULL, read_worker, &pipeline ) != 0 ) {
+    fprintf( stderr, "Could not start pipeline reader thread\n" );
+    exit( 1 );
+  }
+  if ( do_adapter_trimming ) {
+    start_stage( &pipeline.trim, trimmers, &pipe_threads[1] );
+  }
+  start_stage( &pipeline.align, workers, &pipe_threads[1 + num_trim_threads] );
+
+  /* Merge the alignments into maln in input order */
+  while( (batch = pop_batch( &pipeline.merge_q ))->num_seqs > 0 ) {
+    merge_start = now_secs();
+    for( i = 0; (size_t)i < batch->num_seqs; i++ ) {
+      frag_seq = &batch->seqs[i];
+      if ( batch->aligned[i] ) {
+	if ( batch->kmer_hits[i] == KMER_HITS_REPEAT ) {
+	  repeat_only_seqs++;
+	}
+	if ( merge_sg_align( maln, frag_seq, fsdb,
+			     &batch->pwalns[i],
+			     back_pwaln ) == 0 ) {
 	  fprintf( stderr, "Problem handling %s\n", frag_seq->id );
 	}
-      }  
-    }
-    if ( seen_seqs % 1000 == 0 ) {
-      fprintf( stderr, "." );
-    }
-    if ( seen_seqs % 80000 == 0 ) {
-      fprintf( stderr, "\n" );
+      }
+      else if ( batch->kmer_hits[i] == KMER_HITS_BLOOM ) {
+	bloom_rejects++;
+      }
+      else {
+	kmer_rejects++;
+      }
     }
+    merge_busy += now_secs() - merge_start;
+    batch->batch_num += PIPE_BATCHES;
+    push_batch( &pipeline.free_q, batch );
+  }
+
+  for( i = 0; i < 1 + num_trim_threads + num_threads; i++ ) {
+    pthread_join( pipe_threads[i], NULL );
+  }
+  pipe_secs = now_secs() - pipe_start;
+  seen_seqs = pipeline.seen_seqs;
+
+  /* Tell which stage limited the first pass */
+  fprintf( stderr, "\nPipeline utilization: reader %.0f%%",
+	   100.0 * pipeline.read_busy / pipe_secs );
+  if ( do_adapter_trimming ) {
+    fprintf( stderr, ", trimmer %.0f%% of %d threads",
+	     100.0 * pipeline.trim.busy / (pipe_secs * num_trim_threads),
+	     num_trim_threads );
+  }
+  fprintf( stderr, ", aligner %.0f%% of %d threads, merger %.0f%%",
+	   100.0 * pipeline.align.busy / (pipe_secs * num_threads),
+	   num_threads, 100.0 * merge_busy / pipe_secs );
+
+  /* Done with the pipeline; the aligner workers stay around for
+     realigning */
+  for( i = 0; i < PIPE_BATCHES; i++ ) {
+    free( batches[i].seqs );
+    free( batches[i].pwalns );
+    free( batches[i].kmer_hits );
+    free( batches[i].aligned );
   }
+  free( batches );
+  free( pipe_threads );
+  for( i = 0; i < num_trim_threads; i++ ) {
+    free_alignment( trimmers[i].adapt_align );
+  }
+  free( trimmers );
+  free_batch_queue( &pipeline.free_q );
+  free_batch_queue( &pipeline.trim_q );
+  free_batch_queue( &pipeline.align_q );
+  free_batch_queue( &pipeline.merge_q );
+  pthread_mutex_destroy( &pipeline.trim.lock );
+  pthread_cond_destroy( &pipeline.trim.fetched );
+  pthread_mutex_destroy( &pipeline.align.lock );
+  pthread_cond_destroy( &pipeline.align.fetched );
 
   /* Now, fsdb is complete and points to all the things in maln.
      So we can fill in the AlnSeqP->smp array for everything in the 
@@ -814,6 +2063,16 @@ int main( int argc, char* argv[] ) {
   //fprintf( LOG, "__Finished with initial alignments__" );
   //fflush( LOG );
   fprintf( stderr, "\n" );
+  if ( mate_reader != NULL ) {
+    fprintf( stderr, "%d of %d read pairs overlapped and were merged\n",
+	     pipeline.merged_pairs, pipeline.seen_pairs );
+  }
+  if ( kmer_filt != NULL ) {
+    fprintf( stderr, "%d of %d sequences shared only repetitive kmers with the reference\n",
+	     repeat_only_seqs, seen_seqs );
+    fprintf( stderr, "%d sequences rejected by the kmer Bloom filter, %d more shared no kmers\n",
+	     bloom_rejects, kmer_rejects );
+  }
   iter_num = 1;
 
   /* Now, we need a new MapAlignment, culled_maln, that is big
@@ -848,7 +2107,10 @@ int main( int argc, char* argv[] ) {
   cull_maln_from_fsdb( culled_maln, fsdb, Hard_cut, 
 		       SCORE_CUT_SET, slope, intercept );
 
-  fclose(FF);
+  close_seq_reader( reader );
+  if ( paired ) {
+    close_seq_reader( mate_reader );
+  }
 
   /* Tell the culled_maln which matrices to use for assembly */
   culled_maln->fpsm = ancsubmat;
@@ -856,9 +2118,11 @@ int main( int argc, char* argv[] ) {
 
   sort_aln_frags( culled_maln ); //invalidates fsdb->front|back_asp fields!
 
-  fw_align->submat = ancsubmat;
-  fw_align->sg5 = 1;
-  fw_align->sg3 = 1;
+  for( i = 0; i < num_threads; i++ ) {
+    workers[i].fw_align->submat = ancsubmat;
+    workers[i].fw_align->sg5 = 1;
+    workers[i].fw_align->sg3 = 1;
+  }
 
   last_assembly_cons = (char*)save_malloc((maln->ref->seq_len +1) * 
 				     sizeof(char));
@@ -871,13 +2135,15 @@ int main( int argc, char* argv[] ) {
      unmask all alignment positions and collapse sequences
      if requested
   */
-  memset(fw_align->align_mask, 1, fw_align->len1);
+  for( i = 0; i < num_threads; i++ ) {
+    unmask_alignment( workers[i].fw_align );
+  }
   clean_FSDB( fsdb );
   if ( collapse ) collapse_FSDB( fsdb, Hard_cut, SCORE_CUT_SET, slope, intercept );
 
   reiterate_assembly( last_assembly_cons, iter_num, maln, fsdb,
-		      fw_align, front_pwaln, back_pwaln, 
-		      ancsubmat, rcancsubmat );
+		      workers, num_threads,
+		      ancsubmat, rcancsubmat, loc_seed, max_kmer_freq );
   pop_smp_from_FSDB( fsdb, PSSM_DEPTH );
   fprintf( stderr, "Repeat and score filtering\n" );
   if ( repeat_filt ) {
@@ -900,7 +2166,7 @@ int main( int argc, char* argv[] ) {
   sort_aln_frags( culled_maln );
   sprintf( maln_fn, "%s.%d", maln_root, iter_num );
   if ( !iterate || !FINAL_ONLY ) {
-    write_ma( maln_fn, culled_maln );
+    start_maln_write( &maln_writer, maln_fn, culled_maln );
     if ( make_fastq ) {
       write_fastq( fastq_out_fn, fsdb );
     }
@@ -929,8 +2195,9 @@ int main( int argc, char* argv[] ) {
       }
 
       reiterate_assembly( assembly_cons, iter_num, maln, fsdb, 
-			  fw_align, front_pwaln, back_pwaln,
-			  ancsubmat, rcancsubmat );
+			  workers, num_threads,
+			  ancsubmat, rcancsubmat, loc_seed,
+			  max_kmer_freq );
 
       pop_smp_from_FSDB( fsdb, PSSM_DEPTH );
 
@@ -958,7 +2225,7 @@ int main( int argc, char* argv[] ) {
       if ( !FINAL_ONLY ) {
 	fprintf( stderr, "Writing maln file for iteration %d\n", 
 		 iter_num );
-	write_ma( maln_fn, culled_maln );
+	start_maln_write( &maln_writer, maln_fn, culled_maln );
       }
       assembly_cons = consensus_assembly_string( culled_maln );
     }
@@ -971,7 +2238,7 @@ int main( int argc, char* argv[] ) {
       fprintf( stderr, "Assembly did not converge after %d rounds, quitting\n", iter_num );
     }
     sprintf( maln_fn, "%s.%d", maln_root, iter_num );
-    if( FINAL_ONLY ) write_ma( maln_fn, culled_maln );
+    if( FINAL_ONLY ) start_maln_write( &maln_writer, maln_fn, culled_maln );
     if ( make_fastq ) write_fastq( fastq_out_fn, fsdb );
   }
 
@@ -979,11 +2246,29 @@ int main( int argc, char* argv[] ) {
      sequence and substitution matrices to keep scores comparable to what
      they would have been had we iterated */
 
+  /* The final alignments, for tools that read SAM or BAM */
+  if ( make_sam ) {
+    if ( !write_sam( sam_fn, culled_maln, sam_bam ) ) {
+      fprintf( stderr, "Could not write alignments to %s\n", sam_fn );
+      exit( 1 );
+    }
+  }
+
+  /* The last maln file must be out before we check or exit */
+  finish_maln_write( &maln_writer );
+
+  /* Compare the output with that of the 1 thread run */
+  if ( self_check ) {
+    self_check_diffs = self_check_outputs( maln_root, iter_num,
+					   make_fastq, fastq_out_fn,
+					   make_sam, sam_fn );
+  }
+
   /* Announce we're finished */
   curr_time = time(NULL);
   //  c_time    = asctime(localtime(&curr_time));
   fprintf( stderr, "Assembly finished at %s\n",
 	   asctime(localtime(&curr_time)) );
 
-  exit( 0 );
+  exit( self_check_diffs > 0 );
 }
@@ -31,8 +31,47 @@ extern "C" {
 #define NR_SCORE (-10) // score for N in reference
 #define TRIM_SCORE_CUT (1000)
 #define MAX_ITER (30) // maximum number of assembly iterations to do
+#define FIRST_PASS_BATCH (4096) // number of sequences read and aligned
+                                // at a time in the first pass
+#define PIPE_BATCHES (4) // number of batches in the first pass pipeline
+#define REALIGN_BATCH (16384) // number of sequences realigned and merged
+                              // at a time in later iterations
+#define REALIGN_BATCHES (2) // number of batches being realigned at once
+#define TRIM_THREAD_RATIO (4) // aligner threads per adapter trimmer thread
+#define CONS_CHUNK_LEN (1024) // reference positions per consensus calling job
+#define GAP_REDUCE_CHUNK (4096) // reference positions per gaps merging job
+#define READ_BUF_LEN (1 << 20) // bytes of sequence input read at a time
+#define SEQ_INPUT_PLAIN (0) // kinds of compression of sequence input
+#define SEQ_INPUT_GZIP (1)
+#define SEQ_INPUT_BGZF (2)
+#define BGZF_MAX_BLOCK (65536) // most bytes in a BGZF block, before or after inflating
+#define BGZF_BLOCKS_PER_THREAD (16) // BGZF blocks per thread in a batch
+#define MALN_BIN_MAGIC "MIAMALN" // first 8 bytes, with its '\0', of a binary maln
+#define MALN_BIN_VERSION (2) // layout of binary maln files written now
+#define MALN_INDEX_BIN_LEN (1024) // reference positions per region index bin
+#define MALN_BIN_BYTE_ORDER (0x01020304) // as written by the machine that wrote it
+#define BGZF_BLOCK_DATA (0xff00) // bytes of BAM data deflated into each BGZF block
+#define SAM_MAPQ (255) // mapping quality of SAM/BAM records; 255 => not available
+#define SAM_MAX_SEQ (4*INIT_ALN_SEQ_LEN) // bases of a SAM record, both segments
+#define SAM_MAX_CIGAR (4*INIT_ALN_SEQ_LEN+4) // CIGAR operations of a SAM record
+#define SAM_MAX_MD (10*INIT_ALN_SEQ_LEN) // length of an MD tag
+#define SAM_MAX_SA (MAX_ID_LEN+12*SAM_MAX_CIGAR) // length of an SA tag
+#define SORT_KEY_WORDS (4) // unsigned words in a packed sort key
+#define SORT_RADIX_BITS (16) // bits of a sort key per radix sort pass
+#define SORT_RADIX_SIZE (1 << SORT_RADIX_BITS)
+#define SORT_MIN_PER_THREAD (65536) // fewest sort keys worth a thread
+#define FRAG_CHUNK (64) // fragments per job in ccheck's passes over a maln
+#define SELF_CHECK_SUFFIX ".1thread" // added to the output file names of
+                                     // the one thread run of a self-check
 #define REALIGN_BUFFER (50) // amount of sequence padding to add in realignment
 #define QUAL_ASCII_OFFSET (33) // ascii code of lowest quality score, i.e. 0
+#define PE_MIN_OVERLAP (11) // fewest bases the mates of a pair must overlap by
+                           // to be merged into one sequence
+#define PE_MAX_MISMATCH_PCT (10) // most mismatches in the overlap of merged
+                                 // mates, in percent of its length
+#define PE_MISMATCH_PENALTY (4) // matches one mismatch in an overlap costs
+                                // when picking the best one
+#define PE_MAX_QUAL (41) // highest quality score of a merged base
 #define DEF_S 200.0
 #define DEF_N 0.0
 #define MIN_ALIGNABLE_LEN (15) // when distant reference is used, minimum amount of
@@ -75,7 +114,19 @@ extern "C" {
 #define MAX_KMER_POS (128)
 #define MAX_KMER_LEN (14)
 #define KMER_SATURATE (128)
+#define MAX_SEED_SPAN (32) // longest spaced seed pattern
+#define DAMAGE_END_LEN (5) // bases at each end of a fragment where damage
+                           // tolerant seeds are used
+#define BLOOM_BITS_PER_KMER (10) // Bloom filter size per reference kmer;
+                                 // about 1% false positives
+#define DEF_MAX_KMER_FREQ (16) // kmers occurring more often than this in the
+                               // reference are considered repetitive
+#define DEF_LOCALIZE_KMER_LEN (10) // kmer length for localizing sequences of
+                                   // unknown strand on each new assembly
+                                   // when the reference is distant
 #define ALIGN_MASK_BUFFER (10)
+#define MASKED_CELL_RATIO (10) // times faster a masked dynamic programming
+                               // cell is filled than an unmasked one
 
 
 
@@ -0,0 +1,619 @@
+#include "sam.h"
+
+/* The last, empty BGZF block that ends every BAM file */
+static const unsigned char bgzf_eof[28] = {
+  0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff,
+  0x06, 0x00, 0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+int is_bam_fn( const char* fn ) {
+  size_t len = strlen( fn );
+  return ( (len >= 4) && (strcmp( &fn[len-4], ".bam" ) == 0) );
+}
+
+/* put_le
+   Args: 1. where to write
+         2. value
+         3. number of bytes
+   Returns: void
+   Writes the low n bytes of v little-endian, as BAM and BGZF
+   want them whatever the byte order of this machine
+*/
+static void put_le( unsigned char* p, unsigned int v, int n ) {
+  int i;
+  for( i = 0; i < n; i++ ) {
+    p[i] = (unsigned char)( v >> (8*i) );
+  }
+}
+
+/* flush_bgzf_block
+   Args: 1. SamWriterP with BAM data in its block
+   Returns: void
+   Deflates the data waiting in sw->block into one BGZF block and
+   writes it out. Exits if it cannot be deflated
+*/
+static void flush_bgzf_block( SamWriterP sw ) {
+  z_stream zs;
+  size_t bsize;
+  unsigned long crc;
+  if ( sw->block_len == 0 ) {
+    return;
+  }
+  memset( &zs, 0, sizeof( z_stream ) );
+  if ( deflateInit2( &zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15,
+		     8, Z_DEFAULT_STRATEGY ) != Z_OK ) {
+    fprintf( stderr, "Could not start deflating BAM output\n" );
+    exit( 1 );
+  }
+  zs.next_in   = (Bytef*)sw->block;
+  zs.avail_in  = sw->block_len;
+  zs.next_out  = sw->cblock + 18;
+  zs.avail_out = BGZF_MAX_BLOCK - 18 - 8;
+  if ( deflate( &zs, Z_FINISH ) != Z_STREAM_END ) {
+    fprintf( stderr, "Could not deflate BAM output\n" );
+    exit( 1 );
+  }
+  bsize = 18 + zs.total_out + 8;
+  deflateEnd( &zs );
+
+  /* gzip header with the BC extra field giving the block size */
+  memcpy( sw->cblock, bgzf_eof, 16 );
+  put_le( &sw->cblock[16], bsize - 1, 2 );
+  crc = crc32( 0L, Z_NULL, 0 );
+  crc = crc32( crc, (Bytef*)sw->block, sw->block_len );
+  put_le( &sw->cblock[bsize-8], crc, 4 );
+  put_le( &sw->cblock[bsize-4], sw->block_len, 4 );
+  fwrite( sw->cblock, 1, bsize, sw->f );
+  sw->block_len = 0;
+}
+
+/* sam_write
+   Args: 1. SamWriterP to write to
+         2. data to write
+         3. its length
+   Returns: void
+   Writes SAM text straight out; BAM data goes into BGZF blocks of
+   BGZF_BLOCK_DATA bytes, which are written out as they fill
+*/
+static void sam_write( SamWriterP sw, const void* data, size_t len ) {
+  const char* p = (const char*)data;
+  size_t n;
+  if ( !sw->bam ) {
+    fwrite( data, 1, len, sw->f );
+    return;
+  }
+  while( len > 0 ) {
+    n = BGZF_BLOCK_DATA - sw->block_len;
+    if ( n > len ) {
+      n = len;
+    }
+    memcpy( &sw->block[sw->block_len], p, n );
+    sw->block_len += n;
+    p   += n;
+    len -= n;
+    if ( sw->block_len == BGZF_BLOCK_DATA ) {
+      flush_bgzf_block( sw );
+    }
+  }
+}
+
+/* add_cigar
+   Args: 1. SamRecP to add to
+         2. CIGAR operation
+         3. its length
+   Returns: void
+   Adds len of op to the end of the CIGAR of rec, lengthening the
+   last operation if it is the same one
+*/
+static void add_cigar( SamRecP rec, char op, int len ) {
+  if ( len <= 0 ) {
+    return;
+  }
+  if ( (rec->num_cigar > 0) &&
+       (rec->cigar_ops[rec->num_cigar-1] == op) ) {
+    rec->cigar_lens[rec->num_cigar-1] += len;
+    return;
+  }
+  if ( rec->num_cigar == SAM_MAX_CIGAR ) {
+    fprintf( stderr, "CIGAR of %s is too long for SAM output\n",
+	     rec->qname );
+    exit( 1 );
+  }
+  rec->cigar_ops[rec->num_cigar]  = op;
+  rec->cigar_lens[rec->num_cigar] = len;
+  rec->num_cigar++;
+}
+
+/* add_base
+   Args: 1. SamRecP to add to
+         2. base
+   Returns: void
+*/
+static void add_base( SamRecP rec, char c ) {
+  if ( rec->seq_len == SAM_MAX_SEQ ) {
+    fprintf( stderr, "%s is too long for SAM output\n", rec->qname );
+    exit( 1 );
+  }
+  rec->seq[rec->seq_len++] = c;
+  rec->seq[rec->seq_len] = '\0';
+}
+
+/* add_ins_bases
+   Args: 1. SamRecP to add to
+         2. inserted sequence; may be NULL
+   Returns: number of bases added
+*/
+static int add_ins_bases( SamRecP rec, const char* ins ) {
+  int n = 0;
+  if ( ins == NULL ) {
+    return 0;
+  }
+  for( ; *ins != '\0'; ins++ ) {
+    if ( *ins != '-' ) {
+      add_base( rec, *ins );
+      n++;
+    }
+  }
+  return n;
+}
+
+/* add_aln_seq
+   Args: 1. SamRecP to add to
+         2. AlnSeqP whose alignment to add
+         3. RefSeqP it is aligned to
+   Returns: void
+   Adds the bases of as to rec->seq, its alignment to the CIGAR of
+   rec, and makes rec->pos, rec->ref_span, rec->md and rec->nm.
+   as->seq has one character per reference position from as->start
+   on, '-' where the reference base is deleted; as->ins[k] is the
+   sequence inserted before as->seq[k]. Bases aligned before the
+   start or past the end of the reference, as on the wrapped part
+   of a circular one, and sequence inserted next to them or before
+   the first aligned position, are soft clipped, since they are not
+   aligned to anything in the @SQ line
+*/
+static void add_aln_seq( SamRecP rec, AlnSeqP as, RefSeqP ref ) {
+  int k, k0, k1, len, n, run = 0, in_del = 0;
+  char c, r;
+  char* md = rec->md;
+  len = strlen( as->seq );
+
+  /* as->seq[k0..k1-1] is on the reference */
+  k0 = ( as->start < 0 ) ? -as->start : 0;
+  k1 = ref->seq_len - as->start;
+  if ( k1 > len ) {
+    k1 = len;
+  }
+  if ( k0 > k1 ) {
+    k0 = k1;
+  }
+  rec->pos = as->start + k0;
+  if ( rec->pos < 0 ) {
+    rec->pos = 0;
+  }
+  if ( rec->pos >= ref->seq_len ) {
+    rec->pos = ref->seq_len - 1;
+  }
+
+  for( k = 0; k < len; k++ ) {
+    n = add_ins_bases( rec, as->ins[k] );
+    if ( n > 0 ) {
+      if ( (k <= k0) || (k >= k1) ) {
+	add_cigar( rec, 'S', n );
+      }
+      else {
+	add_cigar( rec, 'I', n );
+	rec->nm += n;
+	in_del = 0;
+      }
+    }
+    c = as->seq[k];
+    if ( (k < k0) || (k >= k1) ) {
+      if ( c != '-' ) {
+	add_base( rec, c );
+	add_cigar( rec, 'S', 1 );
+      }
+      continue;
+    }
+    r = toupper( ref->seq[as->start + k] );
+    if ( md - rec->md > SAM_MAX_MD - 16 ) {
+      fprintf( stderr, "MD tag of %s is too long for SAM output\n",
+	       rec->qname );
+      exit( 1 );
+    }
+    if ( c == '-' ) {
+      add_cigar( rec, 'D', 1 );
+      rec->nm++;
+      if ( !in_del ) {
+	md += sprintf( md, "%d^", run );
+	run = 0;
+	in_del = 1;
+      }
+      *md++ = r;
+    }
+    else {
+      add_base( rec, c );
+      add_cigar( rec, 'M', 1 );
+      in_del = 0;
+      if ( toupper( c ) == r ) {
+	run++;
+      }
+      else {
+	md += sprintf( md, "%d%c", run, r );
+	run = 0;
+	rec->nm++;
+      }
+    }
+  }
+  sprintf( md, "%d", run );
+  rec->ref_span = k1 - k0;
+}
+
+/* cigar_str
+   Args: 1. SamRecP
+         2. where to write its CIGAR string
+   Returns: length of the string written
+*/
+static int cigar_str( SamRecP rec, char* s ) {
+  int i;
+  char* p = s;
+  if ( rec->num_cigar == 0 ) {
+    return sprintf( s, "*" );
+  }
+  for( i = 0; i < rec->num_cigar; i++ ) {
+    p += sprintf( p, "%d%c", rec->cigar_lens[i], rec->cigar_ops[i] );
+  }
+  return p - s;
+}
+
+/* clear_sam_rec
+   Args: 1. SamRecP to clear
+         2. its qname
+   Returns: void
+*/
+static void clear_sam_rec( SamRecP rec, const char* qname ) {
+  strcpy( rec->qname, qname );
+  rec->flag = 0;
+  rec->pos  = 0;
+  rec->ref_span  = 0;
+  rec->num_cigar = 0;
+  rec->seq_len = 0;
+  rec->seq[0]  = '\0';
+  rec->md[0]   = '\0';
+  rec->nm      = 0;
+  rec->score   = 0;
+  rec->num_inputs = 0;
+  rec->sa[0]   = '\0';
+}
+
+/* unmap_if_clipped
+   Args: 1. SamRecP made by add_aln_seq
+   Returns: void
+   A record with nothing left on the reference once its ends are
+   clipped is written as unmapped, with no CIGAR
+*/
+static void unmap_if_clipped( SamRecP rec ) {
+  if ( rec->ref_span == 0 ) {
+    rec->flag |= 0x4;
+    rec->num_cigar = 0;
+  }
+}
+
+/* make_sam_rec
+   Args: 1. SamRecP to fill
+         2. AlnSeqP to make it from
+         3. AlnSeqP of the other segment of this read if as is one
+            segment of a fragment split at the wrap point; else NULL
+         4. SamRecP to use for working out the SA tag
+         5. RefSeqP they are aligned to
+   Returns: void
+*/
+static void make_sam_rec( SamRecP rec, AlnSeqP as, AlnSeqP mate,
+			  SamRecP mate_rec, RefSeqP ref ) {
+  int i, len;
+  char* p;
+
+  /* Segments of a split fragment are named after the read */
+  clear_sam_rec( rec, as->id );
+  len = strlen( rec->qname );
+  if ( ((as->segment == 'f') || (as->segment == 'b')) &&
+       (len > 2) && (rec->qname[len-2] == '_') &&
+       (rec->qname[len-1] == as->segment) ) {
+    rec->qname[len-2] = '\0';
+  }
+
+  rec->flag = ( as->revcom ? 0x10 : 0 ) | ( as->dropped ? 0x200 : 0 );
+  rec->score      = as->score;
+  rec->num_inputs = as->num_inputs;
+
+  if ( mate == NULL ) {
+    add_aln_seq( rec, as, ref );
+    unmap_if_clipped( rec );
+    return;
+  }
+
+  /* The front segment is the primary record and has all the bases,
+     the back segment's soft clipped after its own. The back segment
+     is supplementary, with the front segment's bases hard clipped.
+     Each gets an SA tag with the other's alignment */
+  clear_sam_rec( mate_rec, rec->qname );
+  if ( as->segment == 'f' ) {
+    add_aln_seq( rec, as, ref );
+    add_cigar( mate_rec, 'S', rec->seq_len );
+    add_aln_seq( mate_rec, mate, ref );
+    for( i = 0; i < mate_rec->seq_len; i++ ) {
+      add_base( rec, mate_rec->seq[i] );
+    }
+    add_cigar( rec, 'S', mate_rec->seq_len );
+  }
+  else {
+    rec->flag |= 0x800;
+    add_aln_seq( mate_rec, mate, ref );
+    add_cigar( rec, 'H', mate_rec->seq_len );
+    add_aln_seq( rec, as, ref );
+    add_cigar( mate_rec, 'S', rec->seq_len );
+  }
+  unmap_if_clipped( rec );
+  if ( mate_rec->ref_span > 0 ) {
+    p = rec->sa;
+    p += sprintf( p, "%s,%d,%c,", ref->id, mate_rec->pos + 1,
+		  mate->revcom ? '-' : '+' );
+    p += cigar_str( mate_rec, p );
+    sprintf( p, ",%d,%d;", SAM_MAPQ, mate_rec->nm );
+  }
+}
+
+/* write_sam_text
+   Args: 1. SamWriterP
+         2. SamRecP to write
+         3. RefSeqP it is aligned to
+   Returns: void
+*/
+static void write_sam_text( SamWriterP sw, SamRecP rec, RefSeqP ref ) {
+  char cigar[12*SAM_MAX_CIGAR];
+  cigar_str( rec, cigar );
+  fprintf( sw->f, "%s\t%d\t%s\t%d\t%d\t%s\t*\t0\t0\t%s\t*",
+	   rec->qname, rec->flag, ref->id, rec->pos + 1, SAM_MAPQ,
+	   cigar, rec->seq_len > 0 ? rec->seq : "*" );
+  fprintf( sw->f, "\tNM:i:%d\tMD:Z:%s\tAS:i:%d\tXC:i:%d",
+	   rec->nm, rec->md, rec->score, rec->num_inputs );
+  if ( rec->sa[0] != '\0' ) {
+    fprintf( sw->f, "\tSA:Z:%s", rec->sa );
+  }
+  fprintf( sw->f, "\n" );
+}
+
+/* reg2bin
+   Args: 1. 0-indexed start of a region
+         2. 0-indexed end of it, exclusive
+   Returns: the BAM index bin of the region, as given in the
+            SAM specification
+*/
+static int reg2bin( int beg, int end ) {
+  --end;
+  if ( beg>>14 == end>>14 ) return ((1<<15)-1)/7 + (beg>>14);
+  if ( beg>>17 == end>>17 ) return ((1<<12)-1)/7 + (beg>>17);
+  if ( beg>>20 == end>>20 ) return ((1<<9)-1)/7  + (beg>>20);
+  if ( beg>>23 == end>>23 ) return ((1<<6)-1)/7  + (beg>>23);
+  if ( beg>>26 == end>>26 ) return ((1<<3)-1)/7  + (beg>>26);
+  return 0;
+}
+
+/* bam_tag_int, bam_tag_str
+   Args: 1. where to write the tag
+         2. its two letter name
+         3. its value
+   Returns: the end of the tag written
+*/
+static unsigned char* bam_tag_int( unsigned char* p, const char* tag,
+				   int v ) {
+  p[0] = tag[0];
+  p[1] = tag[1];
+  p[2] = 'i';
+  put_le( &p[3], (unsigned int)v, 4 );
+  return p + 7;
+}
+
+static unsigned char* bam_tag_str( unsigned char* p, const char* tag,
+				   const char* v ) {
+  size_t len = strlen( v ) + 1;
+  p[0] = tag[0];
+  p[1] = tag[1];
+  p[2] = 'Z';
+  memcpy( &p[3], v, len );
+  return p + 3 + len;
+}
+
+/* write_bam_rec
+   Args: 1. SamWriterP
+         2. SamRecP to write
+   Returns: void
+   Encodes rec as a BAM alignment record of the one reference and
+   writes it
+*/
+static void write_bam_rec( SamWriterP sw, SamRecP rec ) {
+  static const char* nt16 = "=ACMGRSVTWYHKDBN";
+  static const char* cigar_codes = "MIDNSHP=X";
+  unsigned char* buf = sw->rec_buf;
+  unsigned char* p;
+  const char* code;
+  int i, name_len, bin;
+  name_len = strlen( rec->qname ) + 1;
+  bin = reg2bin( rec->pos, rec->pos + ( rec->ref_span > 0 ?
+					rec->ref_span : 1 ) );
+
+  put_le( &buf[4],  0, 4 );  // refID
+  put_le( &buf[8],  rec->pos, 4 );
+  buf[12] = name_len;
+  buf[13] = SAM_MAPQ;
+  put_le( &buf[14], bin, 2 );
+  put_le( &buf[16], rec->num_cigar, 2 );
+  put_le( &buf[18], rec->flag, 2 );
+  put_le( &buf[20], rec->seq_len, 4 );
+  put_le( &buf[24], (unsigned int)-1, 4 ); // next refID
+  put_le( &buf[28], (unsigned int)-1, 4 ); // next pos
+  put_le( &buf[32], 0, 4 );  // tlen
+  p = &buf[36];
+  memcpy( p, rec->qname, name_len );
+  p += name_len;
+  for( i = 0; i < rec->num_cigar; i++ ) {
+    code = strchr( cigar_codes, rec->cigar_ops[i] );
+    put_le( p, (rec->cigar_lens[i] << 4) | (code - cigar_codes), 4 );
+    p += 4;
+  }
+  memset( p, 0, (rec->seq_len + 1) / 2 );
+  for( i = 0; i < rec->seq_len; i++ ) {
+    code = strchr( nt16, toupper( rec->seq[i] ) );
+    p[i/2] |= ( (code == NULL) ? 15 : (code - nt16) ) <<
+      ( (i % 2) ? 0 : 4 );
+  }
+  p += (rec->seq_len + 1) / 2;
+  memset( p, 0xff, rec->seq_len ); // no qualities
+  p += rec->seq_len;
+  p = bam_tag_int( p, "NM", rec->nm );
+  p = bam_tag_str( p, "MD", rec->md );
+  p = bam_tag_int( p, "AS", rec->score );
+  p = bam_tag_int( p, "XC", rec->num_inputs );
+  if ( rec->sa[0] != '\0' ) {
+    p = bam_tag_str( p, "SA", rec->sa );
+  }
+  put_le( buf, (p - buf) - 4, 4 ); // block_size
+  sam_write( sw, buf, p - buf );
+}
+
+/* write_sam_header
+   Args: 1. SamWriterP
+         2. MapAlignmentP to be written
+   Returns: void
+   Writes the SAM header, or the BAM header with the same text in
+   it. The records are said to be sorted by coordinate if maln is
+*/
+static void write_sam_header( SamWriterP sw, MapAlignmentP maln ) {
+  char text[3*MAX_ID_LEN + 128];
+  unsigned char num[4];
+  int i, sorted = 1, len;
+  for( i = 1; i < maln->num_aln_seqs; i++ ) {
+    if ( maln->AlnSeqArray[i]->start < maln->AlnSeqArray[i-1]->start ) {
+      sorted = 0;
+      break;
+    }
+  }
+  len = sprintf( text, "@HD\tVN:1.6\tSO:%s\n@SQ\tSN:%s\tLN:%d\n"
+		 "@PG\tID:%s\tPN:%s\tVN:%s\n",
+		 sorted ? "coordinate" : "unsorted",
+		 maln->ref->id, maln->ref->seq_len,
+		 PACKAGE_NAME, PACKAGE_NAME, PACKAGE_VERSION );
+  if ( !sw->bam ) {
+    sam_write( sw, text, len );
+    return;
+  }
+  sam_write( sw, "BAM\1", 4 );
+  put_le( num, len, 4 );
+  sam_write( sw, num, 4 );
+  sam_write( sw, text, len );
+  put_le( num, 1, 4 ); // n_ref
+  sam_write( sw, num, 4 );
+  put_le( num, strlen( maln->ref->id ) + 1, 4 );
+  sam_write( sw, num, 4 );
+  sam_write( sw, maln->ref->id, strlen( maln->ref->id ) + 1 );
+  put_le( num, maln->ref->seq_len, 4 );
+  sam_write( sw, num, 4 );
+}
+
+/* comp_aln_seq_ids
+   Args: 1. pointer to an AlnSeqP
+         2. pointer to another AlnSeqP
+   Returns: strcmp of their ids, for qsort and bsearch
+*/
+static int comp_aln_seq_ids( const void* a, const void* b ) {
+  return strcmp( (*(AlnSeqP*)a)->id, (*(AlnSeqP*)b)->id );
+}
+
+/* find_mate
+   Args: 1. AlnSeqP of one segment of a fragment split at the wrap
+            point
+         2. all such segments, sorted by id
+         3. number of them
+   Returns: the AlnSeqP of the other segment of the same read,
+            or NULL if there is none
+*/
+static AlnSeqP find_mate( AlnSeqP as, AlnSeqP* segs, int num_segs ) {
+  AlnSeq key;
+  AlnSeqP keyp = &key;
+  AlnSeqP* found;
+  int len = strlen( as->id );
+  if ( (len < 2) || (as->id[len-2] != '_') ||
+       (as->id[len-1] != as->segment) ) {
+    return NULL;
+  }
+  strcpy( key.id, as->id );
+  key.id[len-1] = ( as->segment == 'f' ) ? 'b' : 'f';
+  found = (AlnSeqP*)bsearch( &keyp, segs, num_segs, sizeof( AlnSeqP ),
+			     comp_aln_seq_ids );
+  if ( (found == NULL) || ((*found)->segment != key.id[len-1]) ) {
+    return NULL;
+  }
+  return *found;
+}
+
+int write_sam( const char* fn, MapAlignmentP maln, int bam ) {
+  SamWriter sw;
+  SamRecP rec;
+  AlnSeqP as, mate;
+  AlnSeqP* segs;
+  int i, num_segs = 0, ok;
+
+  sw.f = fopen( fn, "w" );
+  if ( sw.f == NULL ) {
+    return 0;
+  }
+  sw.bam = bam;
+  sw.block_len = 0;
+  sw.block   = (char*)save_malloc( BGZF_BLOCK_DATA );
+  sw.cblock  = (unsigned char*)save_malloc( BGZF_MAX_BLOCK );
+  sw.rec_buf = (unsigned char*)save_malloc( BGZF_MAX_BLOCK );
+  rec  = (SamRecP)save_malloc( 2 * sizeof( SamRec ) );
+  segs = (AlnSeqP*)save_malloc( (maln->num_aln_seqs + 1) *
+				sizeof( AlnSeqP ) );
+
+  /* Segments of fragments split at the wrap point, to find
+     each one's mate by id */
+  for( i = 0; i < maln->num_aln_seqs; i++ ) {
+    as = maln->AlnSeqArray[i];
+    if ( (as->segment == 'f') || (as->segment == 'b') ) {
+      segs[num_segs++] = as;
+    }
+  }
+  qsort( segs, num_segs, sizeof( AlnSeqP ), comp_aln_seq_ids );
+
+  write_sam_header( &sw, maln );
+  for( i = 0; i < maln->num_aln_seqs; i++ ) {
+    as = maln->AlnSeqArray[i];
+    mate = NULL;
+    if ( (as->segment == 'f') || (as->segment == 'b') ) {
+      mate = find_mate( as, segs, num_segs );
+    }
+    make_sam_rec( &rec[0], as, mate, &rec[1], maln->ref );
+    if ( bam ) {
+      write_bam_rec( &sw, &rec[0] );
+    }
+    else {
+      write_sam_text( &sw, &rec[0], maln->ref );
+    }
+  }
+
+  if ( bam ) {
+    flush_bgzf_block( &sw );
+    fwrite( bgzf_eof, 1, sizeof( bgzf_eof ), sw.f );
+  }
+  ok = !ferror( sw.f );
+  if ( fclose( sw.f ) != 0 ) {
+    ok = 0;
+  }
+  free( sw.block );
+  free( sw.cblock );
+  free( sw.rec_buf );
+  free( rec );
+  free( segs );
+  return ok;
+}
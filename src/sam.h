@@ -0,0 +1,53 @@
+/*
+ * File:   sam.h
+ *
+ * SAM and BAM output of the fragments of a MapAlignment
+ */
+
+#ifndef _SAM_H
+#define	_SAM_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "params.h"
+#include "types.h"
+#include "config.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <zlib.h>
+
+/* is_bam_fn
+   Args: 1. name of a file to write alignments to
+   Returns: 1 if it ends in ".bam", so should be BAM rather
+            than SAM; 0 otherwise
+*/
+int is_bam_fn( const char* fn );
+
+/* write_sam
+   Args: 1. name of the file to write
+         2. MapAlignmentP whose fragments to write
+         3. Boolean; 1 => write BAM, 0 => write SAM
+   Returns: 1 if the file was written, 0 if it could not
+            be opened or written
+   Writes each AlnSeq as one record against maln->ref, in the order
+   of maln->AlnSeqArray, with its CIGAR made from its seq and ins
+   strings and NM and MD tags from the reference. Fragments split at
+   the wrap point of a circular reference ("<id>_f" and "<id>_b")
+   become one primary and one supplementary record of the read <id>,
+   linked by SA tags. Bases aligned past either end of the
+   reference are soft clipped; a record left with none on it is
+   written as unmapped. Records are streamed out as they are made;
+   BAM is written as BGZF blocks as they fill
+*/
+int write_sam( const char* fn, MapAlignmentP maln, int bam );
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _SAM_H */
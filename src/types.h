@@ -9,8 +9,12 @@
 #define	_TYPES_H
 
 #include "params.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <stdint.h>
 
 
 #define save_malloc malloc
@@ -139,6 +143,7 @@ typedef struct fragseqdb {
                        // determining whether a sequence is unique
   size_t    size; // Current size of array pointed to by fss
   size_t    num_fss; // Current number of FragSeqs in fss
+  int       num_threads; // threads for sorting fss
 } FragSeqDB;
 typedef struct fragseqdb* FSDB;
 
@@ -190,11 +195,95 @@ typedef struct map_alignment {
                      //    1 => only majority rule consensus
                      //    2 => (unique) plurality rule consensus
   int distant_ref;   // initial reference sequence is distantly related
+  int num_threads;   // threads for calling the consensus
   AlnSeqP* AlnSeqArray;
 } MapAlignment;
 // pointer to struct alignment
 typedef struct map_alignment* MapAlignmentP;
 
+/* MalnBinHeader starts a binary maln file, as written by write_ma_bin.
+   Every section is found by its offset from the start of the file
+   and is 8-byte aligned, so the file can be mmapped and read where
+   it is. Strings are '\0' terminated in the heap and referred to by
+   their offset in it. Numbers are in the byte order of the machine
+   that wrote the file, which byte_order shows.
+   From version 2 on, a region index lists, for each bin of
+   bin_len reference positions, the records of the AlnSeqs that
+   overlap it, so a region can be loaded without the rest */
+typedef struct maln_bin_header {
+  char magic[8];        // MALN_BIN_MAGIC
+  uint32_t version;     // MALN_BIN_VERSION
+  uint32_t byte_order;  // MALN_BIN_BYTE_ORDER
+  int32_t num_aln_seqs;
+  int32_t size;         // size of the AlnSeqArray it was written from
+  int32_t cons_code;
+  int32_t ref_seq_len;
+  int32_t ref_size;
+  int32_t depth;        // depth of both PSSMs
+  uint64_t ref_id;      // heap offsets of the reference strings
+  uint64_t ref_desc;
+  uint64_t ref_seq;
+  uint64_t gaps_off;    // ref_seq_len int32_t gaps
+  uint64_t fpsm_off;    // (2*depth+1) 5x5 int32_t matrices
+  uint64_t rpsm_off;
+  uint64_t recs_off;    // num_aln_seqs MalnBinRecs
+  uint64_t ins_off;     // num_ins MalnBinIns, in AlnSeq order
+  uint64_t num_ins;
+  uint64_t heap_off;
+  uint64_t heap_len;
+  int32_t bin_len;      // version 2 on: reference positions per bin
+  int32_t num_bins;
+  uint64_t bins_off;    // num_bins+1 uint64_t; bin b has the records
+                        // bin_recs[bins[b]..bins[b+1]-1]
+  uint64_t bin_recs_off; // uint32_t record numbers, ascending in each bin
+} MalnBinHeader;
+
+/* MalnBinRec is the fixed-width record of one AlnSeq in a binary
+   maln */
+typedef struct maln_bin_rec {
+  uint64_t id;          // heap offsets
+  uint64_t desc;
+  uint64_t seq;
+  uint64_t smp;
+  uint64_t first_ins;   // index of its first MalnBinIns
+  int32_t num_ins;
+  int32_t start;
+  int32_t end;
+  int32_t score;
+  int32_t num_inputs;
+  char segment;
+  char revcom;
+  char trimmed;
+  char dropped;
+} MalnBinRec;
+
+/* MalnBinIns is one insert of an AlnSeq in a binary maln */
+typedef struct maln_bin_ins {
+  uint64_t str;         // heap offset of the inserted sequence
+  int32_t pos;          // AlnSeq position it follows
+  int32_t pad;
+} MalnBinIns;
+
+/* ConsFill is the consensus of a MapAlignment being called by
+   several threads, each claiming the next CONS_CHUNK_LEN reference
+   positions. Every reference position and every insert position
+   before it has a known place in the output, so chunks can be
+   filled in any order */
+typedef struct cons_fill {
+  MapAlignmentP maln;
+  char* consensus;    // consensus base at each position
+  char* aln_ref;      // reference base, or '-' for inserts; may be NULL
+  int* cov;           // coverage; may be NULL
+  int* ref_poss;      // reference position; may be NULL
+  int skip_dropped;   // Boolean; TRUE => dropped AlnSeqs do not count
+  int out_format;     // passed to find_ins_cons; 4 and 41 print as they go
+  int* chunk_starts;  // output position of the first base of each chunk
+  int num_chunks;
+  int next_chunk;     // next chunk for a thread to claim
+  pthread_mutex_t lock; // protects next_chunk
+} ConsFill;
+typedef struct cons_fill* ConsFillP;
+
 typedef struct base_counts {
   int As;
   int scoreA;
@@ -220,8 +309,13 @@ typedef struct alignment {
                              // sequence2 that cannot be longer
   int len1;   // length of reference sequence
   int len2;   // length of fragment sequence
-  unsigned char* align_mask; // 0 => alignment cannot be here;
-                             // 1 => alignment can go through here
+  unsigned int* align_mask; // == mask_epoch => alignment can go through here;
+                            // anything else => alignment cannot be here
+  unsigned int mask_epoch;  // current stamp for open align_mask columns;
+                            // incremented to mask everything at once
+  int mask_all;  // Boolean, TRUE = ignore align_mask, alignment can go
+                 // anywhere
+  int mask_size; // number of elements in align_mask
 
   PSSMP submat;  // position substitution matrices
   int gop;    // gap open penalty
@@ -253,6 +347,121 @@ typedef struct alignment {
 } Alignment;
 typedef struct alignment* AlignmentP;
 
+/* BgzfBlock is one block of BGZF compressed input, which is a
+   complete gzip member of its own and so can be inflated separately
+   from the blocks around it */
+typedef struct bgzf_block {
+  unsigned char* cdata; // deflated data
+  size_t clen;          // length of cdata
+  unsigned int crc;     // CRC32 of the inflated data
+  unsigned int isize;   // length of the inflated data
+  char* out;            // where the inflated data goes
+} BgzfBlock;
+typedef struct bgzf_block* BgzfBlockP;
+
+/* BgzfSlice is the run of blocks of a batch that one thread inflates */
+typedef struct bgzf_slice {
+  BgzfBlockP blocks;
+  int num_blocks;
+} BgzfSlice;
+typedef struct bgzf_slice* BgzfSliceP;
+
+/* SeqReader is an input sequence file read READ_BUF_LEN bytes at a
+   time, so that records can be found with memchr and their sequences
+   copied in bulk instead of calling fgetc for every byte. Bytes
+   pos..end-1 of buf have been read but not parsed yet; buf never
+   grows, so any stream can be read in bounded memory.
+   gzip input is inflated on the way into buf; BGZF input is inflated
+   a batch of blocks at a time, num_threads blocks at once. A plain
+   file is instead mmapped whole as buf, so records are parsed
+   straight from the page cache */
+typedef struct seq_reader {
+  FILE* f;
+  char* buf;
+  size_t size;  // allocated size of buf; longer lines are cut
+  size_t pos;   // next byte to parse
+  size_t end;   // one past the last byte read
+  int eof;      // Boolean; TRUE => nothing more to read from f
+  int mapped;   // Boolean; TRUE => buf is all of f, mmapped
+  int format;   // SEQ_INPUT_PLAIN, SEQ_INPUT_GZIP or SEQ_INPUT_BGZF
+  int num_threads;     // threads inflating BGZF blocks
+  unsigned char* raw;  // bytes read from f but not used yet
+  size_t raw_pos;
+  size_t raw_end;
+  z_stream* zs;        // inflate state of gzip input
+  unsigned char* cbuf; // compressed blocks of the current BGZF batch
+  BgzfBlockP blocks;   // and where each one of them is
+  char* zout;          // inflated BGZF data not moved to buf yet
+  size_t zout_pos;
+  size_t zout_end;
+  char ref_id[MAX_ID_LEN + 1]; // reference mapped SAM/BAM records must
+                               // be on to count as mapped; "" => any
+  int num_refs;        // @SQ lines or BAM references seen so far
+  int bam_ref;         // BAM refID of ref_id; -1 => not in the header
+} SeqReader;
+typedef struct seq_reader* SeqReaderP;
+
+/* SamRec is the SAM/BAM record of one AlnSeq, worked out once and
+   then written as SAM text or BAM. A fragment split at the wrap
+   point of a circular reference is two records: the front segment,
+   with the back one's bases soft clipped after it, and the back
+   segment, as a supplementary alignment with the front one's bases
+   hard clipped before it */
+typedef struct sam_rec {
+  char qname[MAX_ID_LEN + 1];
+  int flag;
+  int pos;                 // 0-indexed
+  int ref_span;            // reference positions covered
+  int num_cigar;
+  char cigar_ops[SAM_MAX_CIGAR];  // M, I, D, S or H
+  int cigar_lens[SAM_MAX_CIGAR];
+  char seq[SAM_MAX_SEQ + 1];
+  int seq_len;
+  char md[SAM_MAX_MD + 1]; // MD tag, mismatches and deletions
+  int nm;                  // NM tag, edit distance to the reference
+  int score;
+  int num_inputs;
+  char sa[SAM_MAX_SA + 1]; // SA tag; "" => none
+} SamRec;
+typedef struct sam_rec* SamRecP;
+
+/* SamWriter streams SamRecs to a SAM file, or to a BAM file through
+   BGZF blocks of BGZF_BLOCK_DATA bytes at a time */
+typedef struct sam_writer {
+  FILE* f;
+  int bam;                 // Boolean; 1 => BAM, 0 => SAM
+  char* block;             // BAM data of the BGZF block being filled
+  size_t block_len;
+  unsigned char* cblock;   // the block, deflated
+  unsigned char* rec_buf;  // one BAM record being encoded
+} SamWriter;
+typedef struct sam_writer* SamWriterP;
+
+/* SortKey is the sort order of one sequence packed into
+   SORT_KEY_WORDS unsigned words, most significant first, and the
+   sequence it belongs to. Sorting the keys avoids following the
+   pointer to the sequence for every comparison */
+typedef struct sort_key {
+  unsigned int k[SORT_KEY_WORDS];
+  void* item;
+} SortKey;
+typedef struct sort_key* SortKeyP;
+
+/* SortSlice is the part of a radix sort pass done by one thread:
+   counting the digits of keys start..end-1 of src or, once the
+   counts are turned into offsets, scattering those keys into dst */
+typedef struct sort_slice {
+  SortKeyP src;
+  SortKeyP dst;
+  size_t start;
+  size_t end;
+  size_t* counts;  // SORT_RADIX_SIZE counts or offsets
+  int word;        // which k[] the digit is in
+  int shift;       // where in k[word] the digit is
+  int scatter;     // Boolean; FALSE => count, TRUE => scatter
+} SortSlice;
+typedef struct sort_slice* SortSliceP;
+
 typedef struct ids_list {
   int num_ids;
   int sorted;
@@ -272,12 +481,215 @@ typedef struct kmers* KmersP;
 
 typedef struct kmer_pos_list {
   size_t num_pos; // current number of known positions for this kmer
+  size_t count;   // number of times this kmer occurs in the reference;
+                  // keeps counting past MAX_KMER_POS
   int    sorted;  // boolean; TRUE => positions are in order
   unsigned int positions[MAX_KMER_POS]; // list of known positions
                                         // for this kmer
 } KmerPosList;
 typedef struct kmer_pos_list* KPL;
 
+/* A Seed describes which bases of a stretch of sequence
+   make up a kmer index. Positions in pattern that are '1'
+   are looked at, positions that are '0' are don't care.
+   If ry is TRUE, only purine (A,G) versus pyrimidine (C,T)
+   is looked at, which tolerates the C->T and G->A changes
+   of damaged ancient DNA */
+typedef struct seed {
+  int span;   // number of bases covered by this seed
+  int weight; // number of '1' positions in pattern
+  int bits;   // number of bits in an index made from this seed
+  int ry;     // boolean; TRUE => purine/pyrimidine alphabet
+  char pattern[MAX_SEED_SPAN+1];
+} Seed;
+typedef struct seed* SeedP;
+
+/* KmerFilter holds everything needed to decide whether and
+   where on the reference a fragment should be aligned */
+typedef struct kmer_filt {
+  SeedP seed;   // seed used for the whole fragment
+  KPL*  fkpa;   // forward reference index for seed
+  KPL*  rkpa;   // reverse complement reference index for seed
+  SeedP end_seed; // damage tolerant seed for fragment ends, a purine/
+                  // pyrimidine kmer twice seed's weight; NULL => none
+  KPL*  end_fkpa;
+  KPL*  end_rkpa;
+  int   end_len; // kmers touching this many bases at either end of
+                 // a fragment may use end_seed
+  size_t max_kmer_freq; // kmers occurring more often than this in the
+                        // reference are repetitive
+  unsigned char* bloom; // Bloom filter bit array of every index in the
+                        // kmer arrays above, checked before them
+  size_t bloom_bits;    // number of bits in bloom
+  int bloom_hashes;     // number of bits set per kmer
+} KmerFilter;
+typedef struct kmer_filt* KmerFilterP;
+
+/* SeqBatch holds a batch of sequences on their way through the
+   first pass pipeline and what became of each of them */
+typedef struct seq_batch {
+  FragSeq* seqs;      // sequences to align
+  PWAlnFrag* pwalns;  // best alignment of each sequence
+  int* kmer_hits;     // what new_kmer_filter found for each sequence
+  int* aligned;       // Boolean for each sequence; TRUE => pwalns is valid
+  size_t num_seqs;    // number of sequences in seqs; 0 => end of input
+  size_t batch_num;   // place of this batch in the input
+  size_t num_done;    // sequences the current stage has finished
+} SeqBatch;
+typedef struct seq_batch* SeqBatchP;
+
+/* BatchQueue passes SeqBatches from one pipeline stage to the next.
+   Batches may be pushed in any order but are popped in batch_num
+   order. There are only ever size batches, so each has a slot */
+typedef struct batch_queue {
+  SeqBatchP* slots;   // batch number n waits in slots[n % size]
+  size_t size;
+  size_t next;        // batch_num of the next batch to pop
+  pthread_mutex_t lock;
+  pthread_cond_t ready; // signalled when a batch is pushed
+} BatchQueue;
+typedef struct batch_queue* BatchQueueP;
+
+struct aln_worker;
+
+/* PipeStage is one stage of the first pass pipeline that works on
+   one sequence at a time. Its threads claim the next unclaimed
+   sequence of the current batch, taking the next batch from in
+   when that is all claimed; a batch goes to out once all of its
+   sequences are done */
+typedef struct pipe_stage {
+  BatchQueueP in;
+  BatchQueueP out;
+  SeqBatchP cur;      // batch whose sequences are being claimed
+  size_t next_seq;    // next sequence in cur to claim
+  int done;           // Boolean; TRUE => end of input reached
+  int fetching;       // Boolean; TRUE => a thread is waiting on in
+  pthread_mutex_t lock; // protects all of the above and busy
+  pthread_cond_t fetched; // signalled when fetching is done
+  void (*work)( struct aln_worker*, SeqBatchP, size_t );
+  int num_threads;
+  double busy;        // seconds of work, summed over threads
+} PipeStage;
+typedef struct pipe_stage* PipeStageP;
+
+/* Pipeline is the first alignment pass against the reference:
+   reader -> trimmer -> aligner -> merger. The reader and the
+   merger are one thread each; the trimmer is skipped if there
+   is no adapter trimming */
+typedef struct pipeline {
+  BatchQueue free_q;  // batches the merger is done with
+  BatchQueue trim_q;  // read, to be trimmed
+  BatchQueue align_q; // to be kmer filtered and aligned
+  BatchQueue merge_q; // aligned, to be merged in input order
+  PipeStage trim;
+  PipeStage align;
+  SeqReaderP reader;  // input sequences
+  int seq_code;       // input format, from find_input_type
+  SeqReaderP mate_reader; // second reads of pairs, reader itself if they
+                          // are interleaved; NULL => no paired reads
+  int mate_seq_code;  // format of mate_reader
+  int seen_pairs;     // pairs read
+  int merged_pairs;   // pairs whose reads overlapped and were merged
+  IDsListP good_ids;  // NULL => no ID restriction
+  int seen_seqs;      // sequences read, in good_ids or not
+  double read_busy;   // seconds the reader spent reading
+  RefSeqP ref;        // reference; read only while workers run
+  KmerFilterP kmer_filt; // NULL => no kmer filtering
+  PSSMP submat;       // substitution matrix for both strands
+  char* adapter;      // NULL => no adapter trimming
+} Pipeline;
+typedef struct pipeline* PipelineP;
+
+/* ReadCost pairs a sequence with an estimate of the work aligning
+   it takes, so the most expensive ones can be started first */
+typedef struct read_cost {
+  size_t cost;        // estimated dynamic programming cells
+  size_t inx;         // index of the sequence in its batch
+} ReadCost;
+typedef struct read_cost* ReadCostP;
+
+/* RealignBatch is REALIGN_BATCH sequences of an FSDB being
+   realigned, with their alignments until they are merged */
+typedef struct realign_batch {
+  FragSeqP* fss;      // sequences to realign; points into an FSDB
+  PWAlnFrag* pwalns;  // alignment of each sequence
+  PWAlnFrag* back_pwalns; // wrapped part of each split alignment
+  int* aligned;       // number of segments of each sequence's alignment:
+                      // 0 => none, 1 => pwalns, 2 => pwalns and back_pwalns
+  AlnSeqP* front_asps; // AlnSeq in the MapAlignment for each pwalns
+  AlnSeqP* back_asps; // AlnSeq in the MapAlignment for each back_pwalns
+  ReadCost* order;    // sequences in the order workers claim them
+  size_t num_seqs;    // number of sequences in fss
+  size_t next_align;  // next sequence in order to claim for aligning
+  size_t num_aligned; // sequences done aligning
+  size_t next_merge;  // next sequence to claim for merging
+  size_t num_merged;  // sequences done merging
+} RealignBatch;
+typedef struct realign_batch* RealignBatchP;
+
+/* Realign holds an FSDB being realigned to a new assembly, up to
+   REALIGN_BATCHES batches at a time; batch n is kept in
+   batches[n % REALIGN_BATCHES]. The same worker threads see it
+   through from start to finish. Batches are aligned, most
+   expensive sequence first, then each alignment is given the
+   AlnSeq slots it would have had if merged in fsdb order, then
+   merged. One batch is merged while the next is aligned, and
+   workers only all wait for each other once every batch is merged,
+   before the gaps arrays they kept are combined by taking the
+   maximum at each position */
+typedef struct realign {
+  FSDB fsdb;          // sequences to realign
+  RealignBatch* batches;
+  size_t num_batches; // number of batches in fsdb
+  size_t num_loaded;  // batches set up for aligning
+  size_t align_batch; // batch whose sequences are being claimed for aligning
+  size_t slot_batch;  // next batch to be given its AlnSeq slots
+  size_t merge_batch; // batch whose sequences are being claimed for merging
+  size_t done_batch;  // batches before this are all merged
+  size_t next_chunk;  // next gaps merging job, once all are merged
+  int loading;        // Boolean; TRUE => batch num_loaded is being set up
+  int assigning;      // Boolean; TRUE => batch slot_batch is being given slots
+  pthread_mutex_t lock; // protects all of the above and the batches' counts
+  pthread_cond_t changed; // signalled when there may be more to do
+  MapAlignmentP maln; // where the alignments are merged
+  struct aln_worker* workers; // all workers, for combining their gaps
+  int num_workers;
+  RefSeqP ref;        // new assembly; read only while workers run
+  KmerFilterP loc_filt; // NULL => align strand-unknown sequences everywhere
+  PSSMP ancsubmat;    // substitution matrices for forward sequences
+  PSSMP rcancsubmat;  // substitution matrices for revcom sequences
+  int distant_ref;    // Boolean; TRUE => try strand-unknown sequences
+  int iter_num;       // iteration number
+} Realign;
+typedef struct realign* RealignP;
+
+/* AlnWorker is one thread's view of a Pipeline stage or Realign,
+   with its own alignment workspaces */
+typedef struct aln_worker {
+  PipelineP pl;
+  PipeStageP stage;
+  RealignP rp;
+  int* gaps; // longest insert before each reference position
+             // in the sequences this worker merged into rp->maln
+  AlignmentP fw_align;
+  AlignmentP rc_align;
+  AlignmentP adapt_align; // NULL if no adapter trimming
+} AlnWorker;
+typedef struct aln_worker* AlnWorkerP;
+
+/* MalnWriter writes maln files on a thread of its own, each from a
+   copy of the MapAlignment taken when it was asked for, so that
+   the next iteration can go on changing the MapAlignment meanwhile.
+   At most one file is being written at a time */
+typedef struct maln_writer {
+  pthread_t thread;
+  int busy;           // Boolean; TRUE => thread is writing snap to fn
+  int ok;             // Boolean; FALSE => the last write failed
+  MapAlignmentP snap; // copy being written; freed when it is done
+  char fn[MAX_FN_LEN+1];
+} MalnWriter;
+typedef struct maln_writer* MalnWriterP;
+
 
 
 
@@ -7,12 +7,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <CUnit/Basic.h>
 #include "../src/mia.h"
 #include "../src/map_align.h"
 #include "../src/map_alignment.h"
 #include "../src/io.h"
 #include "../src/fsdb.h"
+#include "../src/sam.h"
 
  RefSeqP ref_seq;
  FragSeqP frag_seq;
@@ -31,9 +34,449 @@
       CU_ASSERT(maxi(2,2) == 2);
     }
 
+    /* Random values from a few of them, so there are many ties,
+       and the ends of the int range */
+    int tie_rand(int range)
+    {
+        int r = rand() % (range + 2);
+        if (r == range) return INT_MIN;
+        if (r == range + 1) return INT_MAX;
+        return r - range / 2;
+    }
+
+    /* Checks that sorted, sorted by the radix sort, is in the order
+       qsorted, sorted by qsort with cmp, is in; equal items need not
+       be the same ones, but must be in their original order, which
+       is given by index() */
+    void check_same_order(void** sorted, void** qsorted, size_t n,
+            int (*cmp)(const void*, const void*),
+            int (*index)(const void*))
+    {
+        size_t i;
+        int ok = 1;
+        for (i = 0; i < n; i++) {
+            if (cmp(&sorted[i], &qsorted[i]) != 0) ok = 0;
+            if ((i > 0) && (cmp(&sorted[i-1], &sorted[i]) == 0) &&
+                    (index(sorted[i-1]) >= index(sorted[i]))) ok = 0;
+        }
+        CU_ASSERT(ok);
+    }
+
+    int fs_index(const void* fs)
+    {
+        return ((const FragSeq*)fs)->seq_len;
+    }
+
+    int as_index(const void* as)
+    {
+        return ((const AlnSeq*)as)->score;
+    }
+
+    void test_sort_fsdb(void)
+    {
+        size_t n = 20000, i;
+        int qscore;
+        FragSeq* fs = (FragSeq*)calloc(n, sizeof(FragSeq));
+        FragSeqP* orig = (FragSeqP*)malloc(n * sizeof(FragSeqP));
+        FragSeqP* qsorted = (FragSeqP*)malloc(n * sizeof(FragSeqP));
+        FragSeqDB db;
+
+        srand(37);
+        for (i = 0; i < n; i++) {
+            fs[i].rc = rand() % 2;
+            fs[i].as = tie_rand(20);
+            fs[i].ae = tie_rand(20);
+            fs[i].score = tie_rand(4);
+            fs[i].qual_sum = tie_rand(4);
+            fs[i].seq_len = i;
+            orig[i] = &fs[i];
+        }
+        db.fss = (FragSeqP*)malloc(n * sizeof(FragSeqP));
+        db.num_fss = n;
+        db.size = n;
+        db.num_threads = 4;
+
+        for (qscore = 0; qscore <= 1; qscore++) {
+            memcpy(db.fss, orig, n * sizeof(FragSeqP));
+            memcpy(qsorted, orig, n * sizeof(FragSeqP));
+            if (qscore) {
+                sort_fsdb_qscore(&db);
+                qsort(qsorted, n, sizeof(FragSeqP), fs_comp_qscore);
+                check_same_order((void**)db.fss, (void**)qsorted, n,
+                        fs_comp_qscore, fs_index);
+            } else {
+                sort_fsdb(&db);
+                qsort(qsorted, n, sizeof(FragSeqP), fs_comp);
+                check_same_order((void**)db.fss, (void**)qsorted, n,
+                        fs_comp, fs_index);
+            }
+        }
+        free(db.fss);
+        free(qsorted);
+        free(orig);
+        free(fs);
+    }
+
+    void test_sort_aln_frags(void)
+    {
+        int n = 5000, i;
+        AlnSeq* as = (AlnSeq*)calloc(n, sizeof(AlnSeq));
+        AlnSeqP* qsorted = (AlnSeqP*)malloc(n * sizeof(AlnSeqP));
+        MapAlignment maln;
+
+        srand(38);
+        maln.AlnSeqArray = (AlnSeqP*)malloc(n * sizeof(AlnSeqP));
+        maln.num_aln_seqs = n;
+        maln.num_threads = 4;
+        for (i = 0; i < n; i++) {
+            as[i].start = tie_rand(30);
+            as[i].end = tie_rand(30);
+            as[i].score = i;
+            maln.AlnSeqArray[i] = &as[i];
+        }
+        memcpy(qsorted, maln.AlnSeqArray, n * sizeof(AlnSeqP));
+        sort_aln_frags(&maln);
+        qsort(qsorted, n, sizeof(AlnSeqP), alnSeqCmp);
+        check_same_order((void**)maln.AlnSeqArray, (void**)qsorted, n,
+                alnSeqCmp, as_index);
+        free(maln.AlnSeqArray);
+        free(qsorted);
+        free(as);
+    }
+
+    void test_sort_keys_threads(void)
+    {
+        size_t n = 3 * SORT_MIN_PER_THREAD, i;
+        int w, ok = 1;
+        SortKeyP keys1 = (SortKeyP)malloc(n * sizeof(SortKey));
+        SortKeyP keys4 = (SortKeyP)malloc(n * sizeof(SortKey));
+
+        srand(39);
+        for (i = 0; i < n; i++) {
+            for (w = 0; w < SORT_KEY_WORDS; w++) {
+                keys1[i].k[w] = int_sort_key(tie_rand(6), w % 2);
+            }
+            keys1[i].item = (void*)i;
+        }
+        memcpy(keys4, keys1, n * sizeof(SortKey));
+        sort_keys(keys1, n, 1);
+        sort_keys(keys4, n, 4);
+        for (i = 0; i < n; i++) {
+            if (keys1[i].item != keys4[i].item) ok = 0;
+            if (i == 0) continue;
+            /* In order, and stable */
+            for (w = 0; w < SORT_KEY_WORDS; w++) {
+                if (keys1[i-1].k[w] != keys1[i].k[w]) break;
+            }
+            if ((w < SORT_KEY_WORDS) ? (keys1[i-1].k[w] > keys1[i].k[w]) :
+                    (keys1[i-1].item > keys1[i].item)) ok = 0;
+        }
+        CU_ASSERT(ok);
+        free(keys1);
+        free(keys4);
+    }
+
+    AlnSeqP new_aln_seq(const char* id, const char* seq, int start,
+            char segment)
+    {
+        AlnSeqP as = (AlnSeqP)calloc(1, sizeof(AlnSeq));
+        strcpy(as->id, id);
+        strcpy(as->seq, seq);
+        as->start = start;
+        as->end = start + strlen(seq) - 1;
+        as->segment = segment;
+        as->num_inputs = 1;
+        return as;
+    }
+
+    /* Checks the fields of a SAM line other than the ones that are
+       always the same; sa is "" if there should be no SA tag */
+    void check_sam_line(const char* line, const char* qname, int flag,
+            int pos, const char* cigar, const char* seq, int nm,
+            const char* md, const char* sa)
+    {
+        char exp[512];
+        int len = sprintf(exp, "%s\t%d\tref\t%d\t255\t%s\t*\t0\t0\t%s\t*"
+                "\tNM:i:%d\tMD:Z:%s\tAS:i:0\tXC:i:1",
+                qname, flag, pos, cigar, seq, nm, md);
+        if (sa[0] != '\0') {
+            sprintf(exp + len, "\tSA:Z:%s", sa);
+        }
+        CU_ASSERT_STRING_EQUAL(line, exp);
+    }
+
+    /* A read split where a circular reference wraps around, one
+       aligned past its end, one with an insert past its end and one
+       that is all past it */
+    void test_sam_wrap(void)
+    {
+        RefSeq ref;
+        MapAlignment maln;
+        AlnSeqP ases[4];
+        char line[512];
+        char* lines[5];
+        int i, n = 0;
+        FILE* f;
+
+        memset(&ref, 0, sizeof(RefSeq));
+        strcpy(ref.id, "ref");
+        ref.seq = "AACCGGTTACGTACGTTTGGCCAATACGATCGATGCATGC";
+        ref.seq_len = 40;
+        ref.circular = 1;
+        memset(&maln, 0, sizeof(MapAlignment));
+        maln.ref = &ref;
+        maln.AlnSeqArray = ases;
+        maln.num_aln_seqs = maln.size = 4;
+
+        ases[0] = new_aln_seq("x_b", "AACCTGTTAC", 0, 'b');
+        ases[1] = new_aln_seq("x_f", "ATGCATGC", 32, 'f');
+        ases[2] = new_aln_seq("y", "ATGCAACCGG", 36, 'a');
+        ases[2]->ins[6] = "T";
+        ases[3] = new_aln_seq("z", "AACCG", 40, 'a');
+
+        CU_ASSERT(write_sam("sam_wrap.sam", &maln, 0));
+        f = fopen("sam_wrap.sam", "r");
+        CU_ASSERT_PTR_NOT_NULL(f);
+        if (f == NULL) return;
+        while ((n < 5) && fgets(line, sizeof(line), f)) {
+            if (line[0] == '@') continue;
+            line[strcspn(line, "\n")] = '\0';
+            lines[n++] = strdup(line);
+        }
+        fclose(f);
+        remove("sam_wrap.sam");
+        CU_ASSERT_EQUAL(n, 4);
+        if (n == 4) {
+            check_sam_line(lines[0], "x", 2048, 1, "8H10M", "AACCTGTTAC",
+                    1, "4G5", "ref,33,+,8M10S,255,0;");
+            check_sam_line(lines[1], "x", 0, 33, "8M10S",
+                    "ATGCATGCAACCTGTTAC", 0, "8", "ref,1,+,8S10M,255,1;");
+            check_sam_line(lines[2], "y", 0, 37, "4M7S", "ATGCAATCCGG",
+                    0, "4", "");
+            check_sam_line(lines[3], "z", 4, 40, "*", "AACCG",
+                    0, "0", "");
+        }
+        for (i = 0; i < n; i++) free(lines[i]);
+        for (i = 0; i < 4; i++) free(ases[i]);
+    }
+
+    /* Insert of a read pair, and the adapters read past its ends */
+    const char* pe_insert = "TGGCTGAGCACGAGGCCAGTAAGTACGGTACTGTCGCATATTCTGA"
+        "GCAGATTCCACGTCGAAACGTTTTTATAGAAATAGGGTAGCTCAAACCACAGGA";
+    const char* pe_adapt1 = "CACGACTTTG";
+    const char* pe_adapt2 = "CCAGGTGACT";
+
+    /* Puts the reverse complement of the first len bases of seq
+       into rc, with tail after it */
+    void pe_revcom(char* rc, const char* seq, int len, const char* tail)
+    {
+        int i;
+        for (i = 0; i < len; i++) {
+            switch (seq[len-1-i]) {
+            case 'A': rc[i] = 'T'; break;
+            case 'C': rc[i] = 'G'; break;
+            case 'G': rc[i] = 'C'; break;
+            default:  rc[i] = 'A';
+            }
+        }
+        strcpy(rc + len, tail);
+    }
+
+    /* Writes r1 and r2 as the mates of pair "p", each as fastq with
+       all qualities 40 if fastq1 or fastq2, or as fasta, and reads
+       them back with read_next_pair */
+    int pe_read(int fastq1, int fastq2, const char* r1, const char* r2,
+            FragSeqP fs1, FragSeqP fs2)
+    {
+        const char* fns[2] = { "pe_1.fq", "pe_2.fq" };
+        const char* reads[2];
+        SeqReaderP sr1, sr2;
+        FILE* f;
+        int m, i, ret;
+
+        reads[0] = r1;
+        reads[1] = r2;
+        for (m = 0; m < 2; m++) {
+            f = fopen(fns[m], "w");
+            if (m == 0 ? fastq1 : fastq2) {
+                fprintf(f, "@p/%d\n%s\n+\n", m + 1, reads[m]);
+                for (i = 0; reads[m][i] != '\0'; i++) fputc('I', f);
+                fputc('\n', f);
+            }
+            else {
+                fprintf(f, ">p/%d\n%s\n", m + 1, reads[m]);
+            }
+            fclose(f);
+        }
+        sr1 = open_seq_reader(fns[0], 1);
+        sr2 = open_seq_reader(fns[1], 1);
+        ret = read_next_pair(sr1, sr2, fs1, fs2, find_input_type(sr1),
+                find_input_type(sr2));
+        close_seq_reader(sr1);
+        close_seq_reader(sr2);
+        remove(fns[0]);
+        remove(fns[1]);
+        return ret;
+    }
+
+    /* Mates overlapping by 20 bases merge into the insert, with one
+       mismatch in the overlap taken from the first read */
+    void test_pe_overlap(void)
+    {
+        FragSeq fs1, fs2;
+        char r1[128], r2[128];
+        strncpy(r1, pe_insert, 60);
+        r1[60] = '\0';
+        pe_revcom(r2, pe_insert + 40, 60, "");
+        r2[49] = (r2[49] == 'A') ? 'C' : 'A';
+        CU_ASSERT_EQUAL(pe_read(1, 1, r1, r2, &fs1, &fs2), 1);
+        CU_ASSERT_STRING_EQUAL(fs1.id, "p");
+        CU_ASSERT_STRING_EQUAL(fs1.seq, pe_insert);
+        CU_ASSERT_EQUAL(fs1.seq_len, 100);
+        CU_ASSERT_EQUAL(fs1.qual[0], 'I');
+        CU_ASSERT_EQUAL(fs1.qual[45], 33 + PE_MAX_QUAL);
+        CU_ASSERT_EQUAL(fs1.qual[50], 33);
+    }
+
+    /* An insert shorter than the reads leaves out the adapter read
+       through past its end on both */
+    void test_pe_short_insert(void)
+    {
+        FragSeq fs1, fs2;
+        char r1[128], r2[128], insert[128];
+        strncpy(insert, pe_insert, 30);
+        insert[30] = '\0';
+        sprintf(r1, "%s%s", insert, pe_adapt1);
+        pe_revcom(r2, pe_insert, 30, pe_adapt2);
+        CU_ASSERT_EQUAL(pe_read(1, 1, r1, r2, &fs1, &fs2), 1);
+        CU_ASSERT_STRING_EQUAL(fs1.seq, insert);
+        CU_ASSERT_EQUAL(fs1.seq_len, 30);
+        CU_ASSERT_EQUAL((int)strlen(fs1.qual), 30);
+    }
+
+    /* Mates that do not overlap, or whose overlap has too many
+       mismatches, are left as they were, as /1 and /2 */
+    void test_pe_no_merge(void)
+    {
+        FragSeq fs1, fs2;
+        char r1[128], r2[128];
+        strncpy(r1, pe_insert, 40);
+        r1[40] = '\0';
+        pe_revcom(r2, pe_insert + 60, 40, "");
+        CU_ASSERT_EQUAL(pe_read(1, 1, r1, r2, &fs1, &fs2), 2);
+        CU_ASSERT_STRING_EQUAL(fs1.id, "p/1");
+        CU_ASSERT_STRING_EQUAL(fs2.id, "p/2");
+        CU_ASSERT_STRING_EQUAL(fs1.seq, r1);
+        CU_ASSERT_STRING_EQUAL(fs2.seq, r2);
+
+        /* 3 mismatches in an overlap of 20 is more than
+           PE_MAX_MISMATCH_PCT */
+        strncpy(r1, pe_insert, 60);
+        r1[60] = '\0';
+        pe_revcom(r2, pe_insert + 40, 60, "");
+        r2[42] = (r2[42] == 'A') ? 'C' : 'A';
+        r2[47] = (r2[47] == 'A') ? 'C' : 'A';
+        r2[52] = (r2[52] == 'A') ? 'C' : 'A';
+        CU_ASSERT_EQUAL(pe_read(1, 1, r1, r2, &fs1, &fs2), 2);
+        CU_ASSERT_STRING_EQUAL(fs1.seq, r1);
+        CU_ASSERT_STRING_EQUAL(fs2.seq, r2);
+    }
+
+    /* fasta mates merge without qualities; a mismatch in the overlap
+       cannot be decided, so is N */
+    void test_pe_fasta(void)
+    {
+        FragSeq fs1, fs2;
+        char r1[128], r2[128];
+        strncpy(r1, pe_insert, 60);
+        r1[60] = '\0';
+        pe_revcom(r2, pe_insert + 40, 60, "");
+        r2[49] = (r2[49] == 'A') ? 'C' : 'A';
+        CU_ASSERT_EQUAL(pe_read(0, 0, r1, r2, &fs1, &fs2), 1);
+        CU_ASSERT_EQUAL(fs1.seq_len, 100);
+        CU_ASSERT_EQUAL(fs1.seq[50], 'N');
+        CU_ASSERT(strncmp(fs1.seq, pe_insert, 50) == 0);
+        CU_ASSERT_STRING_EQUAL(fs1.seq + 51, pe_insert + 51);
+        CU_ASSERT_EQUAL(fs1.qual[0], '\0');
+    }
+
+    /* Mates with qualities for only one of them merge without any,
+       so the sequence and qualities are never of different lengths */
+    void test_pe_mixed(void)
+    {
+        FragSeq fs1, fs2;
+        char r1[128], r2[128];
+        strncpy(r1, pe_insert, 60);
+        r1[60] = '\0';
+        pe_revcom(r2, pe_insert + 40, 60, "");
+        CU_ASSERT_EQUAL(pe_read(1, 0, r1, r2, &fs1, &fs2), 1);
+        CU_ASSERT_EQUAL(fs1.seq_len, 100);
+        CU_ASSERT_EQUAL(fs1.qual[0], '\0');
+        CU_ASSERT_EQUAL(fs1.qual_sum, 0);
+    }
+
+    /* Random sequence of len bases */
+    void random_seq(char* seq, int len)
+    {
+        int i;
+        for (i = 0; i < len; i++) seq[i] = "ACGT"[rand() % 4];
+        seq[len] = '\0';
+    }
+
+    /* Counts how many of n random 40-mers new_kmer_filter rejects
+       against a random 16.5 kb reference with 12-mers, with damage
+       tolerant end kmers if damage_tolerant */
+    int count_kmer_rejects(int damage_tolerant, int n)
+    {
+        RefSeq ref;
+        KmerFilterP kf;
+        AlignmentP fwa, rca;
+        FragSeqP fs = (FragSeqP)calloc(1, sizeof(FragSeq));
+        int i, hit_type, rejected = 0;
+
+        memset(&ref, 0, sizeof(RefSeq));
+        ref.seq_len = ref.wrap_seq_len = 16500;
+        ref.seq = (char*)malloc(ref.seq_len + 1);
+        ref.rcseq = (char*)malloc(ref.seq_len + 1);
+        srand(27);
+        random_seq(ref.seq, ref.seq_len);
+        for (i = 0; i < ref.seq_len; i++) {
+            ref.rcseq[i] = revcom_char(ref.seq[ref.seq_len - 1 - i]);
+        }
+        ref.rcseq[ref.seq_len] = '\0';
+        kf = init_kmer_filter(&ref, init_seed(NULL, 12, 0),
+                damage_tolerant, 0, DEF_MAX_KMER_FREQ);
+        fwa = init_alignment(64, ref.seq_len, 0, 0);
+        rca = init_alignment(64, ref.seq_len, 1, 0);
+        fwa->len1 = rca->len1 = ref.seq_len;
+
+        for (i = 0; i < n; i++) {
+            random_seq(fs->seq, 40);
+            fs->seq_len = 40;
+            if (!new_kmer_filter(fs, kf, fwa, rca, &hit_type)) rejected++;
+        }
+        free_alignment(fwa);
+        free_alignment(rca);
+        free_kmer_filter(kf);
+        free(ref.seq);
+        free(ref.rcseq);
+        free(fs);
+        return rejected;
+    }
+
+    /* Reads unrelated to the reference share almost no 12-mers with
+       it, and damage tolerant end kmers must not change that */
+    void test_kmer_filter_damage(void)
+    {
+        int plain = count_kmer_rejects(0, 2000);
+        int ry = count_kmer_rejects(1, 2000);
+        CU_ASSERT(plain > 1800);
+        CU_ASSERT(ry > 1800);
+    }
+
     int init_testsuite(void){
-        ref_seq = (RefSeqP)calloc(1, sizeof(RefSeqP));
-        frag_seq = (FragSeqP)calloc(1, sizeof(FragSeqP));
+        ref_seq = (RefSeqP)calloc(1, sizeof(RefSeq));
+        frag_seq = (FragSeqP)calloc(1, sizeof(FragSeq));
         frag_db = init_FSDB();
 
 
@@ -41,13 +484,14 @@
         if (read_fasta_ref(ref_seq, "tr1.fna") != 1)
             return EXIT_FAILURE;
 
-        FILE* frag_file = fileOpen("tf.fna", "r");
+        SeqReaderP frag_file = open_seq_reader("tf.fna", 1);
         if (frag_file == NULL)
             return EXIT_FAILURE;
 
         while (read_fasta(frag_file, frag_seq)){
             printf("%s\n", frag_seq->id);
         }
+        close_seq_reader(frag_file);
 
         
 
@@ -80,6 +524,17 @@ int main(int argc, char** argv) {
 
     // add tests to suite
     CU_add_test(test, "Basic Test", test_maxi);
+    CU_add_test(test, "Radix sort of an FSDB", test_sort_fsdb);
+    CU_add_test(test, "Radix sort of AlnSeqs", test_sort_aln_frags);
+    CU_add_test(test, "Radix sort on threads", test_sort_keys_threads);
+    CU_add_test(test, "SAM records of wrapped fragments", test_sam_wrap);
+    CU_add_test(test, "Overlapping mates", test_pe_overlap);
+    CU_add_test(test, "Mates of a short insert", test_pe_short_insert);
+    CU_add_test(test, "Mates that do not merge", test_pe_no_merge);
+    CU_add_test(test, "fasta mates", test_pe_fasta);
+    CU_add_test(test, "fastq and fasta mates", test_pe_mixed);
+    CU_add_test(test, "Kmer filter with damage tolerant ends",
+            test_kmer_filter_damage);
 
 
     // Now Run all tests